@@ -0,0 +1,341 @@
+// render benchmarks for tracking performance over time: canonical scenes at a fixed size, sample count, depth and
+// seed, rendered at several thread counts, one JSON line per run on stdout
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "scene.h"
+#include "utils/cpu_topology.h"
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+static double elapsed_ms(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+#pragma region peak memory
+// starts a new peak at the current resident size, false where only the peak of the whole process is known
+static bool reset_peak_rss()
+{
+#ifdef __linux__
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+    clear_refs.flush();
+    return static_cast<bool>(clear_refs);
+#else
+    return false;
+#endif
+}
+
+static double peak_rss_mb()
+{
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return std::atof(line.c_str() + 6) / 1024.0;
+    }
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss / 1024.0;
+#endif
+    return 0;
+}
+#pragma endregion
+
+#pragma region scenes
+static void add_ground(Scene &scene, Color albedo)
+{
+    scene.addMaterial(MaterialFactory::createLambertian("ground", albedo));
+    scene.addObject(HittableFactory::createSphere("ground_sphere", Point3d(0.0, -1000.0, 0.0), 1000, scene.materials["ground"]));
+}
+
+// a field of count small spheres, one per square unit so the density stays the same as it grows. A fixed palette
+// of materials, mostly diffuse with some metal and glass
+static void build_spheres(Scene &scene, int count)
+{
+    static const int palette = 16;
+    for (int m = 0; m < palette; m++)
+    {
+        std::string name = "material_" + std::to_string(m);
+        Color albedo(random_double(0.1, 0.9), random_double(0.1, 0.9), random_double(0.1, 0.9));
+        if (m < 12)
+            scene.addMaterial(MaterialFactory::createLambertian(name, albedo));
+        else if (m < 15)
+            scene.addMaterial(MaterialFactory::createMetal(name, albedo, random_double(0, 0.3)));
+        else
+            scene.addMaterial(MaterialFactory::createDielectric(name, Color(1, 1, 1), 1.5));
+    }
+    add_ground(scene, Color(0.5, 0.5, 0.5));
+
+    double side = std::sqrt(double(count));
+    for (int s = 0; s < count; s++)
+    {
+        double radius = random_double(0.1, 0.3);
+        Point3d center(random_double(-side / 2, side / 2), radius, random_double(-side / 2, side / 2));
+        int m = int(random_double() * palette);
+        scene.addObject(HittableFactory::createSphere("sphere_" + std::to_string(s), center, radius, scene.materials["material_" + std::to_string(m)]));
+    }
+
+    // looking down across the whole field
+    scene.setCameraPositionFrom(Point3d(0, side * 0.35 + 2, side * 0.6 + 4));
+    scene.setCameraPositionTo(Point3d(0, 0, 0));
+    scene.setCameraUp(Vector3d(0, 1, 0));
+}
+
+// rows of glass spheres in front of each other, most paths refract several times
+static void build_glass(Scene &scene)
+{
+    scene.addMaterial(MaterialFactory::createDielectric("glass", Color(1, 1, 1), 1.5));
+    scene.addMaterial(MaterialFactory::createDielectric("tinted_glass", Color(0.8, 0.9, 1.0), 1.33));
+    scene.addMaterial(MaterialFactory::createLambertian("backdrop", Color(0.8, 0.3, 0.2)));
+    add_ground(scene, Color(0.4, 0.6, 0.3));
+
+    for (int row = 0; row < 5; row++)
+    {
+        for (int column = 0; column < 7; column++)
+        {
+            std::string name = "glass_" + std::to_string(row) + "_" + std::to_string(column);
+            Point3d center((column - 3) * 1.1, 0.5, -row * 1.1);
+            scene.addObject(HittableFactory::createSphere(name, center, 0.5, scene.materials[(row + column) % 2 == 0 ? "glass" : "tinted_glass"]));
+        }
+    }
+    scene.addObject(HittableFactory::createSphere("backdrop_sphere", Point3d(0, 3, -12), 4, scene.materials["backdrop"]));
+
+    scene.setCameraPositionFrom(Point3d(0, 1.2, 3.5));
+    scene.setCameraPositionTo(Point3d(0, 0.5, -2));
+    scene.setCameraUp(Vector3d(0, 1, 0));
+}
+
+// mirrors packed around the camera and a mirror floor: paths bounce until they run out of depth
+static void build_bounce(Scene &scene)
+{
+    scene.addMaterial(MaterialFactory::createMetal("mirror", Color(0.95, 0.95, 0.95), 0.0));
+    scene.addMaterial(MaterialFactory::createMetal("brushed", Color(0.9, 0.8, 0.7), 0.05));
+    scene.addObject(HittableFactory::createSphere("ground_sphere", Point3d(0.0, -1000.0, 0.0), 1000, scene.materials["mirror"]));
+
+    for (int k = 0; k < 12; k++)
+    {
+        double angle = k * 2 * pi / 12;
+        Point3d center(3 * std::cos(angle), 1.2, 3 * std::sin(angle));
+        scene.addObject(HittableFactory::createSphere("mirror_" + std::to_string(k), center, 1.2, scene.materials[k % 3 == 0 ? "brushed" : "mirror"]));
+    }
+    scene.addObject(HittableFactory::createSphere("top_mirror", Point3d(0, 6, 0), 3, scene.materials["mirror"]));
+
+    scene.setCameraPositionFrom(Point3d(0, 1.2, 0));
+    scene.setCameraPositionTo(Point3d(3, 1.0, 0));
+    scene.setCameraUp(Vector3d(0, 1, 0));
+}
+
+static bool build_scene(const std::string &name, int spheres, Scene &scene, int &depth)
+{
+    if (name == "default")
+    {
+        scene.init();
+        return true;
+    }
+
+    scene.init();
+    scene.world.clear();
+    scene.materials.clear();
+    if (name == "spheres")
+        build_spheres(scene, spheres);
+    else if (name == "glass")
+        build_glass(scene);
+    else if (name == "bounce")
+    {
+        build_bounce(scene);
+        depth = std::max(depth, 50); // the point of the scene
+    }
+    else
+        return false;
+    return true;
+}
+#pragma endregion
+
+struct Run
+{
+    double ms;
+    uint64_t rays;
+    double rays_per_path;
+};
+
+// "all" for 1, 2, 4... up to every usable thread, or a comma separated list
+static bool parse_thread_counts(const std::string &list, std::vector<int> &counts)
+{
+    counts.clear();
+    if (list == "all")
+    {
+        int usable = static_cast<int>(CpuTopology::get().usable_threads());
+        for (int n = 1; n < usable; n *= 2)
+            counts.push_back(n);
+        counts.push_back(std::max(usable, 1));
+        return true;
+    }
+
+    std::stringstream stream(list);
+    std::string count;
+    while (std::getline(stream, count, ','))
+    {
+        int n = std::atoi(count.c_str());
+        if (n < 1)
+            return false;
+        counts.push_back(n);
+    }
+    return !counts.empty();
+}
+
+static void print_usage()
+{
+    std::cerr << "usage: raytracer-bench [options]\n"
+              << "  --scene NAME    default, spheres, glass or bounce (default)\n"
+              << "  --spheres N     spheres in the spheres scene (1000)\n"
+              << "  --width N       image width, 16:9 (320)\n"
+              << "  --spp N         samples per pixel (16)\n"
+              << "  --depth N       maximum bounces (10, at least 50 for bounce)\n"
+              << "  --seed N        seed for the scene and the samples (1)\n"
+              << "  --threads LIST  comma separated thread counts, or all for powers of two up to every usable thread (all)\n"
+              << "  --repeat N      renders per thread count, the median is reported (3)\n"
+              << "  --output FILE   also append the JSON lines to FILE\n";
+}
+
+int main(int argc, char **argv)
+{
+    std::string scene_name = "default";
+    std::string thread_list = "all";
+    std::string output;
+    int spheres = 1000, width = 320, spp = 16, depth = 10, repeat = 3;
+    unsigned int seed = 1;
+
+    for (int a = 1; a < argc; a++)
+    {
+        std::string option = argv[a];
+        if (option == "--help" || option == "-h")
+        {
+            print_usage();
+            return 0;
+        }
+        if (a + 1 >= argc)
+        {
+            print_usage();
+            return 1;
+        }
+
+        std::string value = argv[++a];
+        if (option == "--scene")
+            scene_name = value;
+        else if (option == "--spheres")
+            spheres = std::atoi(value.c_str());
+        else if (option == "--width")
+            width = std::atoi(value.c_str());
+        else if (option == "--spp")
+            spp = std::atoi(value.c_str());
+        else if (option == "--depth")
+            depth = std::atoi(value.c_str());
+        else if (option == "--seed")
+            seed = static_cast<unsigned int>(std::strtoul(value.c_str(), nullptr, 10));
+        else if (option == "--threads")
+            thread_list = value;
+        else if (option == "--repeat")
+            repeat = std::atoi(value.c_str());
+        else if (option == "--output")
+            output = value;
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+
+    std::vector<int> thread_counts;
+    if (!parse_thread_counts(thread_list, thread_counts) || spheres < 1 || width < 16 || spp < 1 || depth < 1 || repeat < 1)
+    {
+        print_usage();
+        return 1;
+    }
+
+    // the scene is built from the seed, the samples of every render come from it too
+    std::srand(seed);
+    std::chrono::steady_clock::time_point build_start = std::chrono::steady_clock::now();
+    Scene scene(16, 9);
+    if (!build_scene(scene_name, spheres, scene, depth))
+    {
+        std::cerr << "unknown scene " << scene_name << "\n";
+        print_usage();
+        return 1;
+    }
+    scene.camera.image_width = width;
+    scene.camera.samples_per_pixel = spp;
+    scene.camera.max_depth = depth;
+    scene.camera.sample_seed = uint64_t(seed) + 1; // per tile streams, so every thread count renders the same image
+    scene.world.updateBvh();
+    double build_ms = elapsed_ms(build_start);
+    std::clog << "Built " << scene_name << " with " << scene.world.objects.size() << " objects in " << build_ms << " ms\n";
+
+    std::ofstream results;
+    if (!output.empty())
+    {
+        results.open(output, std::ios::app);
+        if (!results)
+        {
+            std::cerr << "could not open " << output << "\n";
+            return 1;
+        }
+    }
+
+    std::vector<unsigned int> measured;
+    for (int requested : thread_counts)
+    {
+        // the renders run on no more threads than are usable, the line reports what they ran on
+        unsigned int nthreads = CpuTopology::get().clamp_threads(requested);
+        if (nthreads != static_cast<unsigned int>(requested))
+            std::cerr << "Warning: " << requested << " threads requested, using " << nthreads << ".\n";
+        if (std::find(measured.begin(), measured.end(), nthreads) != measured.end())
+        {
+            std::clog << "Skipping " << requested << " threads, " << nthreads << " were measured already.\n";
+            continue;
+        }
+        measured.push_back(nthreads);
+
+        bool per_run_peak = reset_peak_rss();
+        std::vector<Run> runs;
+        for (int r = 0; r < repeat; r++)
+        {
+            scene.markChanged(SCENE_CHANGE_ALL); // a full frame every time, nothing is kept from the last run
+            std::string progress;
+            scene.render(progress, nthreads);
+            runs.push_back(Run{scene.last_stats->elapsed_ms, scene.last_stats->rays, scene.last_stats->average_path_length()});
+        }
+        std::sort(runs.begin(), runs.end(), [](const Run &a, const Run &b)
+                  { return a.ms < b.ms; });
+        const Run &median = runs[runs.size() / 2];
+
+        std::ostringstream line;
+        line << "{\"scene\":\"" << scene_name << "\",\"objects\":" << scene.world.objects.size()
+             << ",\"width\":" << scene.camera.image_width << ",\"height\":" << scene.camera.image_height
+             << ",\"spp\":" << spp << ",\"depth\":" << depth << ",\"seed\":" << seed << ",\"threads\":" << nthreads
+             << ",\"requested_threads\":" << requested << ",\"repeat\":" << repeat << ",\"build_ms\":" << build_ms << ",\"ms\":" << median.ms
+             << ",\"min_ms\":" << runs.front().ms << ",\"max_ms\":" << runs.back().ms
+             << ",\"rays\":" << median.rays << ",\"rays_per_sec\":" << median.rays / (median.ms / 1000.0)
+             << ",\"rays_per_path\":" << median.rays_per_path
+             << ",\"peak_rss_mb\":" << peak_rss_mb() << ",\"peak_rss_scope\":\"" << (per_run_peak ? "run" : "process") << "\"}";
+        std::cout << line.str() << std::endl;
+        if (results.is_open())
+            results << line.str() << std::endl;
+    }
+    return 0;
+}
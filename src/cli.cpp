@@ -0,0 +1,581 @@
+// headless renderer for render nodes: no SDL, no GUI, one JSON result line on stdout
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include "scene.h"
+#include "scene_compiler.h"
+#include "scene_serializer.h"
+#include "distributed.h"
+#include "job_server.h"
+#include "sequence.h"
+#include "raytracer/image_writer.h"
+#include "raytracer/hdr_writer.h"
+#include "raytracer/streamed_spheres.h"
+#include "utils/cpu_topology.h"
+#include "utils/json.h"
+
+enum ExitStatus
+{
+    EXIT_OK = 0,
+    EXIT_USAGE = 1,
+    EXIT_SCENE = 2,
+    EXIT_RENDER = 3,
+    EXIT_OUTPUT = 4,
+};
+
+static int fail(ExitStatus status, const std::string &message)
+{
+    std::cout << "{\"status\":\"error\",\"exit_code\":" << status << ",\"message\":\"" << json_escape(message) << "\"}" << std::endl;
+    return status;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+static bool read_file(const std::string &path, std::string &text)
+{
+    std::ifstream file(path);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    text = contents.str();
+    return static_cast<bool>(file);
+}
+
+// "all" or a comma separated subset of the render passes
+static bool parse_pass_names(const std::string &list, std::vector<std::string> &names)
+{
+    static const std::string known[] = {"depth", "normal", "albedo", "samples", "cost"};
+    names.clear();
+    if (list == "all")
+        return true;
+
+    std::stringstream stream(list);
+    std::string name;
+    while (std::getline(stream, name, ','))
+    {
+        if (std::find(std::begin(known), std::end(known), name) == std::end(known))
+            return false;
+        names.push_back(name);
+    }
+    return !names.empty();
+}
+
+static int render_sequence(Scene &scene, const Animation &animation, const std::string &output, int nthreads,
+                           double load_ms, std::chrono::steady_clock::time_point start)
+{
+    SequenceRenderer sequence(scene, animation);
+    sequence.output_pattern = output;
+
+    std::string progress;
+    try
+    {
+        if (!sequence.render(nthreads, progress))
+        {
+            return fail(sequence.frames_rendered > 0 ? EXIT_OUTPUT : EXIT_RENDER, "sequence stopped after " + std::to_string(sequence.frames_rendered) + " frames");
+        }
+    }
+    catch (const std::exception &e)
+    {
+        return fail(EXIT_RENDER, e.what());
+    }
+    if (!scene.geometry_error().empty())
+    {
+        return fail(EXIT_RENDER, scene.geometry_error());
+    }
+
+    std::cout << "{\"status\":\"ok\",\"exit_code\":0"
+              << ",\"output\":\"" << json_escape(sequence.frame_path(sequence.first_frame)) << "\""
+              << ",\"frames\":" << sequence.frames_rendered << ",\"fps\":" << animation.fps
+              << ",\"width\":" << scene.camera.image_width << ",\"height\":" << scene.camera.image_height
+              << ",\"spp\":" << scene.camera.samples_per_pixel << ",\"threads\":" << nthreads
+              << ",\"frames_per_hour\":" << sequence.frames_per_hour() << ",\"bvh_builds\":" << sequence.bvh_builds
+              << ",\"load_ms\":" << load_ms << ",\"trace_ms\":" << 1000 * sequence.trace_seconds
+              << ",\"write_ms\":" << 1000 * sequence.encode_seconds << ",\"total_ms\":" << elapsed_ms(start) << "}" << std::endl;
+    return EXIT_OK;
+}
+
+static int render_views(Scene &scene, std::vector<Camera> &views, const std::string &output, ImageFormat format, int nthreads,
+                        double load_ms, std::chrono::steady_clock::time_point start)
+{
+    std::chrono::steady_clock::time_point render_start = std::chrono::steady_clock::now();
+    std::string progress;
+    std::vector<FramePixels> images;
+    try
+    {
+        images = scene.render_views(views, progress, nthreads);
+    }
+    catch (const std::exception &e)
+    {
+        return fail(EXIT_RENDER, e.what());
+    }
+    if (!scene.geometry_error().empty())
+    {
+        return fail(EXIT_RENDER, scene.geometry_error());
+    }
+    double render_ms = elapsed_ms(render_start);
+
+    std::chrono::steady_clock::time_point write_start = std::chrono::steady_clock::now();
+    for (size_t v = 0; v < images.size(); v++)
+    {
+        if (!write_image_file(numbered_path(output, v), format, images[v], views[v].image_width, views[v].image_height, nthreads))
+        {
+            return fail(EXIT_OUTPUT, "could not write " + numbered_path(output, v));
+        }
+    }
+    double write_ms = elapsed_ms(write_start);
+
+    std::cout << "{\"status\":\"ok\",\"exit_code\":0"
+              << ",\"output\":\"" << json_escape(numbered_path(output, 0)) << "\""
+              << ",\"views\":" << images.size() << ",\"threads\":" << nthreads
+              << ",\"load_ms\":" << load_ms << ",\"render_ms\":" << render_ms << ",\"write_ms\":" << write_ms
+              << ",\"total_ms\":" << elapsed_ms(start) << "}" << std::endl;
+    return EXIT_OK;
+}
+
+static void print_usage()
+{
+    std::cerr << "usage: raytracer-cli [options]\n"
+              << "  --scene FILE        scene text or compiled scene file, the built-in scene otherwise\n"
+              << "  --compile FILE      write the scene as a compiled scene file and exit\n"
+              << "  --geometry-cache MB leave a compiled scene's spheres on disk and page them in, keeping at most MB\n"
+              << "  --width N           image width, height follows the aspect ratio\n"
+              << "  --spp N             samples per pixel\n"
+              << "  --depth N           maximum bounces\n"
+              << "  --threads N         render threads, all usable CPUs by default\n"
+              << "  --time-budget S     keep adding samples for S seconds\n"
+              << "  --target-noise E    keep adding samples until the estimated error is below E\n"
+              << "  --checkpoint FILE   keep the render's progress in FILE and continue from it if it's already there\n"
+              << "  --checkpoint-interval S\n"
+              << "                      seconds between checkpoint writes, 30 by default\n"
+              << "  --workers LIST      render on host:port tile workers, comma separated\n"
+              << "  --output FILE       .png, .qoi, .ppm, or linear float .exr or .pfm to write, image.png by default.\n"
+              << "                      For sequences # marks the frame number\n"
+              << "  --passes LIST       also write depth, normal, albedo, samples and/or cost (comma separated, or all) as\n"
+              << "                      layers of an .exr, or next to a .pfm as FILE.pass.pfm\n"
+              << "  --precision P       half or float (the default) for .exr color channels\n"
+              << "  --compression C     zip (the default) or none for .exr\n"
+              << "  --bit-depth N       8 (the default) or 16 bits per channel for .png and .ppm\n"
+              << "  --framebuffer F     tiled streams tile rows to the output without holding the frame, full keeps it;\n"
+              << "                      auto (the default) streams frames over 1 GB\n"
+              << "  --views FILE        render every view line of FILE (a scene file works) as numbered images\n"
+              << "  --animation FILE    render the keyframes in FILE as numbered frames\n"
+              << "  --turntable S       render an S second orbit of the camera as numbered frames\n"
+              << "  --fps N             frames per second of --animation or --turntable\n"
+              << "  --worker PORT       serve tiles to a coordinator instead of rendering\n"
+              << "  --bind ADDRESS      where --worker listens, 127.0.0.1 by default, 0.0.0.0 for every interface\n"
+              << "  --serve ADDRESS     queue render jobs from a loopback port or unix socket path instead of rendering\n";
+}
+
+int main(int argc, char **argv)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::string scene_file;
+    std::string compile_file;
+    std::string output = "image.png";
+    std::string workers;
+    int worker_port = -1;
+    std::string bind_address = "127.0.0.1";
+    std::string serve_address;
+    std::string animation_file;
+    std::string views_file;
+    double turntable_seconds = 0, fps = 0;
+    int width = 0, spp = 0, depth = 0;
+    int nthreads = CpuTopology::get().usable_threads();
+    double time_budget = 0, target_noise = 0;
+    std::string pass_list;
+    std::string checkpoint_file;
+    double checkpoint_interval = 0;
+    double geometry_cache_mb = 0;
+    ExrOptions exr_options;
+    int bit_depth = 8;
+    std::string framebuffer = "auto";
+
+    for (int a = 1; a < argc; a++)
+    {
+        std::string option = argv[a];
+        if (option == "--help" || option == "-h")
+        {
+            print_usage();
+            return EXIT_OK;
+        }
+        if (a + 1 >= argc)
+        {
+            print_usage();
+            return fail(EXIT_USAGE, "missing value for " + option);
+        }
+
+        std::string value = argv[++a];
+        if (option == "--scene")
+            scene_file = value;
+        else if (option == "--compile")
+            compile_file = value;
+        else if (option == "--geometry-cache")
+            geometry_cache_mb = std::atof(value.c_str());
+        else if (option == "--width")
+            width = std::atoi(value.c_str());
+        else if (option == "--spp")
+            spp = std::atoi(value.c_str());
+        else if (option == "--depth")
+            depth = std::atoi(value.c_str());
+        else if (option == "--threads")
+            nthreads = std::atoi(value.c_str());
+        else if (option == "--time-budget")
+            time_budget = std::atof(value.c_str());
+        else if (option == "--target-noise")
+            target_noise = std::atof(value.c_str());
+        else if (option == "--workers")
+            workers = value;
+        else if (option == "--output")
+            output = value;
+        else if (option == "--worker")
+            worker_port = std::atoi(value.c_str());
+        else if (option == "--bind")
+            bind_address = value;
+        else if (option == "--serve")
+            serve_address = value;
+        else if (option == "--views")
+            views_file = value;
+        else if (option == "--animation")
+            animation_file = value;
+        else if (option == "--turntable")
+            turntable_seconds = std::atof(value.c_str());
+        else if (option == "--fps")
+            fps = std::atof(value.c_str());
+        else if (option == "--passes")
+            pass_list = value;
+        else if (option == "--checkpoint")
+            checkpoint_file = value;
+        else if (option == "--checkpoint-interval")
+            checkpoint_interval = std::atof(value.c_str());
+        else if (option == "--precision")
+        {
+            if (value != "half" && value != "float")
+                return fail(EXIT_USAGE, "precision is half or float");
+            exr_options.half = value == "half";
+        }
+        else if (option == "--bit-depth")
+        {
+            bit_depth = std::atoi(value.c_str());
+            if (bit_depth != 8 && bit_depth != 16)
+                return fail(EXIT_USAGE, "bit depth is 8 or 16");
+        }
+        else if (option == "--framebuffer")
+        {
+            if (value != "auto" && value != "tiled" && value != "full")
+                return fail(EXIT_USAGE, "framebuffer is auto, tiled or full");
+            framebuffer = value;
+        }
+        else if (option == "--compression")
+        {
+            if (value != "zip" && value != "none")
+                return fail(EXIT_USAGE, "compression is zip or none");
+            exr_options.compress = value == "zip";
+        }
+        else
+        {
+            print_usage();
+            return fail(EXIT_USAGE, "unknown option " + option);
+        }
+    }
+
+    if (worker_port >= 0)
+    {
+        return run_tile_worker(worker_port, bind_address);
+    }
+
+    // renders run on 1 to usable_threads() threads, the JSON reports how many they actually ran on
+    unsigned int effective_threads = CpuTopology::get().clamp_threads(nthreads);
+    if (int(effective_threads) != nthreads)
+    {
+        std::cerr << "Warning: " << nthreads << " threads requested, using " << effective_threads << ".\n";
+        nthreads = int(effective_threads);
+    }
+
+    if (!serve_address.empty())
+    {
+        RenderJobServer server(nthreads);
+        return server.serve(serve_address);
+    }
+
+    ImageFormat format;
+    if (!image_format_for_path(output, format))
+    {
+        return fail(EXIT_USAGE, "unsupported output format " + output + ", use .png, .qoi, .ppm, .exr or .pfm");
+    }
+
+    if (bit_depth == 16 && (format == IMAGE_FORMAT_QOI || image_format_is_float(format)))
+    {
+        return fail(EXIT_USAGE, "16 bits per channel need a .png or .ppm output");
+    }
+
+    std::vector<std::string> pass_names;
+    if (!pass_list.empty())
+    {
+        if (!parse_pass_names(pass_list, pass_names))
+            return fail(EXIT_USAGE, "unknown render pass in " + pass_list + ", use depth, normal, albedo, samples, cost or all");
+        if (!image_format_is_float(format))
+            return fail(EXIT_USAGE, "render passes need an .exr or .pfm output");
+        if (!workers.empty() || !views_file.empty() || !animation_file.empty() || turntable_seconds > 0)
+            return fail(EXIT_USAGE, "render passes are only collected for single local renders");
+        if (!checkpoint_file.empty())
+            return fail(EXIT_USAGE, "render passes can't be resumed from a checkpoint");
+    }
+    if (!checkpoint_file.empty() && (!workers.empty() || !views_file.empty() || !animation_file.empty() || turntable_seconds > 0))
+    {
+        return fail(EXIT_USAGE, "checkpoints are only kept for single local renders");
+    }
+
+    if (geometry_cache_mb > 0 && (scene_file.empty() || !is_compiled_scene(scene_file)))
+    {
+        return fail(EXIT_USAGE, "--geometry-cache needs a compiled --scene, see --compile");
+    }
+    if (geometry_cache_mb > 0 && !workers.empty())
+    {
+        return fail(EXIT_USAGE, "streamed geometry stays on this machine, it can't be sent to workers");
+    }
+
+    Scene scene(16, 9);
+    if (scene_file.empty())
+    {
+        scene.init();
+    }
+    else
+    {
+        std::string text, error;
+        bool loaded = is_compiled_scene(scene_file) ? load_compiled_scene(scene_file, scene, error, size_t(geometry_cache_mb * 1024 * 1024))
+                                                    : read_file(scene_file, text) && deserialize_scene(text, scene, error);
+        if (!loaded)
+        {
+            return fail(EXIT_SCENE, "could not load " + scene_file + (error.empty() ? "" : ": " + error));
+        }
+    }
+
+    if (width > 0)
+        scene.camera.image_width = width;
+    if (spp > 0)
+        scene.camera.samples_per_pixel = spp;
+    if (depth > 0)
+        scene.camera.max_depth = depth;
+    // the options override a budget line of the scene file
+    if (time_budget > 0)
+        scene.camera.budget.seconds = time_budget;
+    if (target_noise > 0)
+        scene.camera.budget.target_noise = target_noise;
+
+    if (!compile_file.empty())
+    {
+        std::string error;
+        if (!write_compiled_scene(scene, compile_file, error))
+        {
+            return fail(EXIT_OUTPUT, error);
+        }
+        std::clog << "Compiled " << scene.world.objects.size() << " objects into " << compile_file << " in " << elapsed_ms(start) << " ms\n";
+        return EXIT_OK;
+    }
+
+    if (!views_file.empty())
+    {
+        std::vector<Camera> views;
+        std::string text, error;
+        if (!read_file(views_file, text) || !deserialize_views(text, scene.camera, views, error) || views.empty())
+        {
+            return fail(EXIT_SCENE, "could not load views from " + views_file + (error.empty() ? "" : ": " + error));
+        }
+        for (Camera &view : views)
+        {
+            view.image_width = width > 0 ? width : view.image_width;
+            view.samples_per_pixel = spp > 0 ? spp : view.samples_per_pixel;
+            view.max_depth = depth > 0 ? depth : view.max_depth;
+        }
+        return render_views(scene, views, output, format, nthreads, elapsed_ms(start), start);
+    }
+
+    if (!animation_file.empty() || turntable_seconds > 0)
+    {
+        Animation animation = turntable_seconds > 0 ? Animation::turntable(scene.camera, turntable_seconds) : Animation();
+        std::string text, error;
+        if (!animation_file.empty() && (!read_file(animation_file, text) || !deserialize_animation(text, animation, error)))
+        {
+            return fail(EXIT_SCENE, "could not load " + animation_file + (error.empty() ? "" : ": " + error));
+        }
+        if (fps > 0)
+            animation.fps = fps;
+        if (!animation.check(scene, error))
+        {
+            return fail(EXIT_SCENE, "animation doesn't fit the scene: " + error);
+        }
+        return render_sequence(scene, animation, output, nthreads, elapsed_ms(start), start);
+    }
+    double load_ms = elapsed_ms(start);
+
+    // 8-bit rows are encoded and written while the rest of the frame still traces, float images once it's done
+    scene.camera.plan_tiles();
+    int frame_width = scene.camera.image_width, frame_height = scene.camera.image_height;
+    FILE *file = nullptr;
+    std::unique_ptr<ImageWriter> writer;
+    if (!image_format_is_float(format))
+    {
+        file = fopen(output.c_str(), "wb");
+        if (file == nullptr)
+        {
+            return fail(EXIT_OUTPUT, "could not write " + output);
+        }
+        writer.reset(new ImageWriter(format, frame_width, frame_height, nthreads, [file](const uint8_t *data, size_t size)
+                                     { return fwrite(data, 1, size, file) == size; }, bit_depth));
+        scene.camera.row_sink = writer.get();
+    }
+
+    // a tiled framebuffer holds a few tile rows instead of the frame, for prints far bigger than memory
+    bool streamable = writer && !scene.camera.budget.enabled() && checkpoint_file.empty() && workers.empty();
+    size_t frame_bytes = size_t(frame_width) * frame_height * sizeof(Color);
+    bool tiled = framebuffer == "tiled" || (framebuffer == "auto" && streamable && frame_bytes > (size_t(1) << 30));
+    if (tiled && !streamable)
+    {
+        fclose(file);
+        return fail(EXIT_USAGE, "a tiled framebuffer needs a .png, .qoi or .ppm output and no budget, checkpoint or workers");
+    }
+
+    RenderPasses passes;
+    if (!pass_list.empty() && pass_list != "cost") // the cost alone comes with every render
+    {
+        scene.camera.passes = &passes;
+    }
+
+    // the key covers the camera line too, so a different size or sample count starts over.
+    // Not the budget though, resuming with more time or a lower noise target continues the same render
+    RenderBudget budget = scene.camera.budget;
+    scene.camera.budget = RenderBudget();
+    RenderCheckpoint checkpoint(checkpoint_file, checkpoint_key(checkpoint_file.empty() ? std::string() : serialize_scene(scene)));
+    scene.camera.budget = budget;
+    if (checkpoint_interval > 0)
+        checkpoint.sync_seconds = checkpoint_interval;
+    if (!checkpoint_file.empty())
+    {
+        scene.camera.checkpoint = &checkpoint;
+    }
+
+    std::chrono::steady_clock::time_point render_start = std::chrono::steady_clock::now();
+    std::string progress;
+    bool streamed = false;
+    try
+    {
+        if (tiled)
+            streamed = scene.render_streamed(progress, nthreads);
+        else if (workers.empty())
+            scene.render(progress, nthreads);
+        else
+            scene.render_distributed(progress, parse_worker_list(workers));
+    }
+    catch (const std::exception &e)
+    {
+        if (file != nullptr)
+            fclose(file);
+        return fail(EXIT_RENDER, e.what());
+    }
+    // the frame misses geometry that couldn't be read, it isn't the scene
+    if (!scene.geometry_error().empty())
+    {
+        if (file != nullptr)
+            fclose(file);
+        return fail(EXIT_RENDER, scene.geometry_error());
+    }
+    scene.camera.row_sink = nullptr;
+    scene.camera.passes = nullptr;
+    scene.camera.checkpoint = nullptr;
+    double render_ms = elapsed_ms(render_start);
+
+    std::shared_ptr<const RenderTarget> target = scene.getRenderTarget();
+    if (tiled ? !streamed : (target->getWidth() != frame_width || target->getHeight() != frame_height))
+    {
+        if (file != nullptr)
+            fclose(file);
+        return fail(EXIT_RENDER, "render produced no image");
+    }
+
+    std::chrono::steady_clock::time_point write_start = std::chrono::steady_clock::now();
+    const FramePixels &pixels = target->getPixels(); // empty for tiled renders
+    int streamed_rows = 0;
+    size_t layer_count = 1;
+    bool written;
+    if (writer)
+    {
+        // budgeted and distributed renders don't stream, their rows all go out here
+        streamed_rows = writer->rows_written();
+        if (!tiled)
+            writer->write_rows(pixels.data() + size_t(streamed_rows) * frame_width, frame_height - streamed_rows);
+        written = writer->finish();
+        written = fclose(file) == 0 && written;
+    }
+    else
+    {
+        std::vector<ImageLayer> layers = {color_layer("", pixels)};
+        if (!pass_list.empty())
+        {
+            std::vector<ImageLayer> pass_layers = passes.layers(pass_names);
+            layers.insert(layers.end(), pass_layers.begin(), pass_layers.end());
+        }
+        // the per-pixel cost comes from the render stats, not the passes
+        bool want_cost = pass_names.empty() || std::find(pass_names.begin(), pass_names.end(), "cost") != pass_names.end();
+        if (!pass_list.empty() && want_cost && target->stats && !target->stats->cost.empty())
+        {
+            layers.push_back(target->stats->cost_layer());
+        }
+        layer_count = layers.size();
+        written = format == IMAGE_FORMAT_EXR ? write_exr_file(output, layers, frame_width, frame_height, exr_options)
+                                             : write_pfm_file(output, layers, frame_width, frame_height);
+    }
+    if (!written)
+    {
+        return fail(EXIT_OUTPUT, "could not write " + output);
+    }
+    double write_ms = elapsed_ms(write_start);
+
+    std::string stats_json;
+    if (scene.last_stats)
+    {
+        const RenderStats &stats = *scene.last_stats;
+        std::clog << "Render stats: " << stats.rays_per_second() / 1e6 << " Mrays/s, " << stats.samples_per_second() / 1e6
+                  << " Msamples/s, " << stats.average_path_length() << " rays per path, " << stats.tests_per_ray() << " tests per ray\n";
+        stats_json = ",\"stats\":" + stats.to_json();
+    }
+
+    std::ostringstream cache_json;
+    for (const auto &pair : scene.world.objects)
+    {
+        if (const StreamedSpheres *streamed = dynamic_cast<const StreamedSpheres *>(pair.second.get()))
+        {
+            GeometryCacheStats stats = streamed->stats();
+            std::clog << "Geometry cache: " << stats.clusters << " clusters, " << stats.hit_rate() * 100 << "% hits, " << stats.loads
+                      << " loads, " << stats.evictions << " evictions, " << stats.bytes_read / (1024.0 * 1024.0) << " MB read, "
+                      << stats.peak_bytes / (1024.0 * 1024.0) << " MB peak\n";
+            cache_json << ",\"geometry_cache\":{\"hit_rate\":" << stats.hit_rate() << ",\"loads\":" << stats.loads
+                       << ",\"evictions\":" << stats.evictions << ",\"read_mb\":" << stats.bytes_read / (1024.0 * 1024.0)
+                       << ",\"peak_mb\":" << stats.peak_bytes / (1024.0 * 1024.0) << "}";
+        }
+    }
+
+    std::cout << "{\"status\":\"ok\",\"exit_code\":0"
+              << ",\"output\":\"" << json_escape(output) << "\""
+              << ",\"width\":" << frame_width << ",\"height\":" << frame_height
+              << ",\"spp\":" << (scene.camera.budget.enabled() || !checkpoint_file.empty() ? scene.camera.achieved_samples_per_pixel : scene.camera.samples_per_pixel)
+              << ",\"depth\":" << scene.camera.max_depth << ",\"threads\":" << nthreads
+              << ",\"streamed_rows\":" << streamed_rows << ",\"framebuffer\":\"" << (tiled ? "tiled" : "full") << "\""
+              << ",\"layers\":" << layer_count
+              << ",\"resumed\":" << (checkpoint.resumed() ? "true" : "false") << cache_json.str() << stats_json
+              << ",\"load_ms\":" << load_ms << ",\"render_ms\":" << render_ms << ",\"write_ms\":" << write_ms
+              << ",\"total_ms\":" << elapsed_ms(start) << "}" << std::endl;
+
+    return EXIT_OK;
+}
@@ -0,0 +1,541 @@
+#include "distributed.h"
+#include "scene_serializer.h"
+#include "utils/cpu_topology.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#ifndef __EMSCRIPTEN__
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#pragma region protocol
+// every message is a [type, payload size] header of two uint32 followed by the payload
+enum MessageType
+{
+    MESSAGE_SCENE = 1,  // coordinator -> worker, scene text
+    MESSAGE_READY = 2,  // worker -> coordinator, uint32 tiles it renders at once
+    MESSAGE_TILE = 3,   // coordinator -> worker, TileMessage
+    MESSAGE_PIXELS = 4, // worker -> coordinator, uint32 tile id then 3 doubles per pixel
+};
+
+struct TileMessage
+{
+    uint32_t id;
+    int32_t x0, y0, x1, y1;
+};
+
+// bigger payloads are refused before anything is allocated for them, a peer can't make the other side allocate 4 GB
+static const uint32_t max_message_bytes = 512u << 20;
+
+#ifndef __EMSCRIPTEN__
+static bool send_all(int fd, const void *data, size_t size)
+{
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0)
+    {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void *data, size_t size)
+{
+    char *bytes = static_cast<char *>(data);
+    while (size > 0)
+    {
+        ssize_t received = recv(fd, bytes, size, 0);
+        if (received <= 0)
+            return false;
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+static bool send_message(int fd, uint32_t type, const std::vector<char> &payload)
+{
+    // header and payload in one send, a separate small header would wait on Nagle and the delayed ack
+    uint32_t header[2] = {type, static_cast<uint32_t>(payload.size())};
+    std::vector<char> message(sizeof(header) + payload.size());
+    std::memcpy(message.data(), header, sizeof(header));
+    if (!payload.empty())
+        std::memcpy(message.data() + sizeof(header), payload.data(), payload.size());
+    return send_all(fd, message.data(), message.size());
+}
+
+static bool recv_message(int fd, uint32_t &type, std::vector<char> &payload)
+{
+    uint32_t header[2];
+    if (!recv_all(fd, header, sizeof(header)))
+        return false;
+
+    type = header[0];
+    if (header[1] > max_message_bytes)
+    {
+        std::cerr << "Refusing a message of " << header[1] << " bytes." << std::endl;
+        return false;
+    }
+    payload.resize(header[1]);
+    return recv_all(fd, payload.data(), payload.size());
+}
+
+static int connect_to(const std::string &address, int timeout_seconds)
+{
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos)
+        return -1;
+
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo *results = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0)
+        return -1;
+
+    int fd = -1;
+    for (addrinfo *ai = results; ai != nullptr && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(results);
+
+    if (fd >= 0)
+    {
+        // a silent worker shows up as a failed receive
+        timeval timeout;
+        timeout.tv_sec = timeout_seconds;
+        timeout.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+#endif
+#pragma endregion
+
+std::vector<std::string> parse_worker_list(const std::string &list)
+{
+    std::vector<std::string> workers;
+    std::stringstream ss(list);
+    std::string worker;
+    while (std::getline(ss, worker, ','))
+    {
+        size_t first = worker.find_first_not_of(" \t");
+        size_t last = worker.find_last_not_of(" \t");
+        if (first != std::string::npos)
+            workers.push_back(worker.substr(first, last - first + 1));
+    }
+    return workers;
+}
+
+#pragma region coordinator
+TileCoordinator::TileCoordinator(const std::vector<std::string> &workers)
+    : straggler_factor(4),
+      timeout_seconds(60),
+      workers(workers)
+{
+}
+
+FramePixels TileCoordinator::render(Scene &scene, std::string &progress)
+{
+    std::vector<Tile> tiles = scene.camera.plan_tiles();
+    int width = scene.camera.image_width;
+    FramePixels image(size_t(width) * scene.camera.image_height, Color());
+
+    struct TileState
+    {
+        bool done;
+        int in_flight;
+        std::chrono::steady_clock::time_point started;
+    };
+    std::vector<TileState> states(tiles.size(), TileState{false, 0, std::chrono::steady_clock::time_point()});
+    size_t done_count = 0;
+    double tile_seconds = 0; // summed over finished tiles, for the straggler threshold
+
+    auto store_tile = [&](size_t k, const Color *pixels)
+    {
+        const Tile &tile = tiles[k];
+        for (int j = tile.y0; j < tile.y1; j++)
+        {
+            for (int i = tile.x0; i < tile.x1; i++)
+            {
+                image[size_t(j) * width + i] = *pixels++;
+            }
+        }
+        states[k].done = true;
+        done_count++;
+        progress = "Progress " + std::to_string(100 * done_count / tiles.size()) + "%";
+    };
+
+#ifndef __EMSCRIPTEN__
+    std::string scene_text = serialize_scene(scene); // serialized once for every worker
+    std::vector<char> scene_payload(scene_text.begin(), scene_text.end());
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<int> sockets(workers.size(), -1);
+
+    // fresh tiles first, then a second copy of the slowest tile still in flight
+    auto next_tile = [&](std::chrono::steady_clock::time_point now) -> long
+    {
+        for (size_t k = 0; k < tiles.size(); k++)
+        {
+            if (!states[k].done && states[k].in_flight == 0)
+                return k;
+        }
+
+        if (done_count == 0)
+            return -1;
+
+        double threshold = straggler_factor * tile_seconds / done_count;
+        long slowest = -1;
+        for (size_t k = 0; k < tiles.size(); k++)
+        {
+            double elapsed = std::chrono::duration<double>(now - states[k].started).count();
+            if (!states[k].done && states[k].in_flight == 1 && elapsed > threshold)
+            {
+                threshold = elapsed;
+                slowest = k;
+            }
+        }
+        return slowest;
+    };
+
+    std::clog << "Distributing " << tiles.size() << " tiles over " << workers.size() << " workers.\n";
+
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < workers.size(); w++)
+    {
+        threads.push_back(std::thread([&, w]()
+                                      {
+            int fd = connect_to(workers[w], timeout_seconds);
+            uint32_t type = 0;
+            std::vector<char> payload;
+            if (fd < 0 || !send_message(fd, MESSAGE_SCENE, scene_payload) || !recv_message(fd, type, payload) || type != MESSAGE_READY || payload.size() < 4)
+            {
+                std::cerr << "Worker " << workers[w] << " unavailable.\n";
+                if (fd >= 0)
+                    close(fd);
+                return;
+            }
+
+            uint32_t slots;
+            std::memcpy(&slots, payload.data(), sizeof(slots));
+            slots = slots ? slots : 1;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                sockets[w] = fd;
+            }
+
+            std::map<uint32_t, std::chrono::steady_clock::time_point> assigned; // tiles in flight on this worker
+            bool failed = false;
+            while (!failed)
+            {
+                std::vector<TileMessage> to_send;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    if (done_count == tiles.size())
+                        break;
+
+                    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                    while (assigned.size() < slots)
+                    {
+                        long k = next_tile(now);
+                        if (k < 0)
+                            break;
+
+                        if (states[k].in_flight++ == 0)
+                            states[k].started = now;
+                        assigned[k] = now;
+                        to_send.push_back(TileMessage{uint32_t(k), tiles[k].x0, tiles[k].y0, tiles[k].x1, tiles[k].y1});
+                    }
+
+                    if (assigned.empty())
+                    {
+                        changed.wait_for(lock, std::chrono::milliseconds(50));
+                        continue;
+                    }
+                }
+
+                for (const TileMessage &tile : to_send)
+                {
+                    std::vector<char> message(reinterpret_cast<const char *>(&tile), reinterpret_cast<const char *>(&tile) + sizeof(tile));
+                    failed = failed || !send_message(fd, MESSAGE_TILE, message);
+                }
+
+                uint32_t id = 0;
+                if (failed || !recv_message(fd, type, payload) || type != MESSAGE_PIXELS || payload.size() < sizeof(id))
+                {
+                    failed = true;
+                    break;
+                }
+                std::memcpy(&id, payload.data(), sizeof(id));
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if (id >= tiles.size() || assigned.find(id) == assigned.end())
+                {
+                    failed = true;
+                    break;
+                }
+
+                const Tile &tile = tiles[id];
+                size_t expected = sizeof(id) + sizeof(double) * 3 * (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+                double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - assigned[id]).count();
+                assigned.erase(id);
+                states[id].in_flight--;
+
+                if (payload.size() != expected)
+                {
+                    failed = true;
+                    break;
+                }
+
+                // a straggler's duplicate may already have finished it
+                if (!states[id].done)
+                {
+                    std::vector<Color> pixels((payload.size() - sizeof(id)) / (3 * sizeof(double)));
+                    const char *data = payload.data() + sizeof(id);
+                    for (Color &pixel : pixels)
+                    {
+                        std::memcpy(pixel.e, data, 3 * sizeof(double));
+                        data += 3 * sizeof(double);
+                    }
+                    tile_seconds += elapsed;
+                    store_tile(id, pixels.data());
+                }
+                changed.notify_all();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (failed && done_count < tiles.size())
+            {
+                std::cerr << "Worker " << workers[w] << " dropped, reassigning " << assigned.size() << " tiles.\n";
+            }
+            for (const auto &pair : assigned)
+            {
+                states[pair.first].in_flight--;
+            }
+            sockets[w] = -1;
+            close(fd);
+            changed.notify_all();
+
+            // the frame is done, wake the workers still waiting on duplicates
+            if (done_count == tiles.size())
+            {
+                for (int other : sockets)
+                {
+                    if (other >= 0)
+                        shutdown(other, SHUT_RDWR);
+                }
+            } }));
+    }
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+#endif
+
+    size_t remaining = tiles.size() - done_count;
+    if (remaining > 0)
+    {
+        std::cerr << "Rendering " << remaining << " tiles locally, no worker finished them.\n";
+        std::vector<Tile> leftover;
+        for (size_t k = 0; k < tiles.size(); k++)
+        {
+            if (!states[k].done)
+                leftover.push_back(tiles[k]);
+        }
+        // on every usable thread here, the way a local render would
+        scene.camera.render_tiles(scene.world, CpuTopology::get().usable_threads(), progress, image, leftover);
+    }
+
+    return image;
+}
+#pragma endregion
+
+#pragma region worker
+#ifndef __EMSCRIPTEN__
+static void serve_coordinator(int fd)
+{
+    uint32_t type = 0;
+    std::vector<char> payload;
+    std::string error;
+    Scene scene(16, 9);
+    if (!recv_message(fd, type, payload) || type != MESSAGE_SCENE || !deserialize_scene(std::string(payload.begin(), payload.end()), scene, error))
+    {
+        std::cerr << "Could not receive scene: " << error << std::endl;
+        close(fd);
+        return;
+    }
+    scene.camera.plan_tiles();
+    scene.world.updateBvh();
+
+    uint32_t slots = CpuTopology::get().usable_threads();
+    std::vector<char> ready(reinterpret_cast<const char *>(&slots), reinterpret_cast<const char *>(&slots) + sizeof(slots));
+    if (!send_message(fd, MESSAGE_READY, ready))
+    {
+        close(fd);
+        return;
+    }
+    std::clog << "Serving " << scene.camera.image_width << "x" << scene.camera.image_height << " frame on " << slots << " threads.\n";
+
+    // tiles keep arriving while earlier ones render, one render thread per slot
+    std::deque<TileMessage> queue;
+    bool closed = false;
+    std::mutex mutex;
+    std::mutex send_mutex;
+    std::condition_variable available;
+
+    std::vector<std::thread> renderers;
+    for (uint32_t s = 0; s < slots; s++)
+    {
+        renderers.push_back(std::thread([&]()
+                                        {
+            while (true)
+            {
+                TileMessage message;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    available.wait(lock, [&]() { return closed || !queue.empty(); });
+                    if (queue.empty())
+                        return;
+                    message = queue.front();
+                    queue.pop_front();
+                }
+
+                Tile tile = {message.x0, message.y0, message.x1, message.y1};
+                std::vector<Color> pixels = scene.camera.render_single_tile(scene.world, tile);
+
+                std::vector<char> result(sizeof(message.id) + 3 * sizeof(double) * pixels.size());
+                std::memcpy(result.data(), &message.id, sizeof(message.id));
+                char *data = result.data() + sizeof(message.id);
+                for (const Color &pixel : pixels)
+                {
+                    std::memcpy(data, pixel.e, 3 * sizeof(double));
+                    data += 3 * sizeof(double);
+                }
+
+                std::lock_guard<std::mutex> lock(send_mutex);
+                send_message(fd, MESSAGE_PIXELS, result);
+            } }));
+    }
+
+    while (recv_message(fd, type, payload))
+    {
+        if (type != MESSAGE_TILE || payload.size() != sizeof(TileMessage))
+            break;
+
+        TileMessage message;
+        std::memcpy(&message, payload.data(), sizeof(message));
+        if (message.x0 < 0 || message.y0 < 0 || message.x1 > scene.camera.image_width || message.y1 > scene.camera.image_height ||
+            message.x0 >= message.x1 || message.y0 >= message.y1)
+        {
+            std::cerr << "Tile outside the " << scene.camera.image_width << "x" << scene.camera.image_height << " frame, dropping the coordinator." << std::endl;
+            break;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(message);
+        available.notify_one();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        queue.clear(); // the coordinator is gone or done, nobody wants the rest
+    }
+    available.notify_all();
+    for (std::thread &renderer : renderers)
+    {
+        renderer.join();
+    }
+    close(fd);
+}
+#endif
+
+int run_tile_worker(int port, const std::string &bind_address)
+{
+#ifdef __EMSCRIPTEN__
+    std::cerr << "Tile workers are unsupported in web assembly." << std::endl;
+    return 1;
+#else
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    addrinfo *results = nullptr;
+    std::string port_text = std::to_string(port);
+    if (getaddrinfo(bind_address.c_str(), port_text.c_str(), &hints, &results) != 0)
+    {
+        std::cerr << "Could not resolve " << bind_address << std::endl;
+        return 1;
+    }
+
+    int server = -1;
+    int one = 1;
+    for (addrinfo *ai = results; ai != nullptr && server < 0; ai = ai->ai_next)
+    {
+        server = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (server < 0)
+            continue;
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(server, ai->ai_addr, ai->ai_addrlen) != 0 || listen(server, 8) != 0)
+        {
+            close(server);
+            server = -1;
+        }
+    }
+    freeaddrinfo(results);
+
+    if (server < 0)
+    {
+        std::cerr << "Could not listen on " << bind_address << " port " << port << std::endl;
+        return 1;
+    }
+
+    std::clog << "Tile worker listening on " << bind_address << " port " << port << std::endl;
+    while (true)
+    {
+        int fd = accept(server, nullptr, nullptr);
+        if (fd >= 0)
+        {
+            // tile replies go out as soon as they're rendered
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::thread(serve_coordinator, fd).detach();
+        }
+    }
+#endif
+}
+#pragma endregion
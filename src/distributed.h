@@ -0,0 +1,31 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <string>
+#include <vector>
+#include "scene.h"
+
+// renders a frame by handing its tiles to worker processes over TCP.
+// Workers must run the same build on the same architecture, pixels travel as raw doubles
+class TileCoordinator
+{
+public:
+    TileCoordinator(const std::vector<std::string> &workers); // "host:port" each
+
+    double straggler_factor; // a tile in flight this many times longer than average gets a second copy elsewhere
+    int timeout_seconds;     // a worker silent for this long is dropped and its tiles reassigned
+
+    // tiles no worker could finish are rendered locally
+    FramePixels render(Scene &scene, std::string &progress);
+
+private:
+    std::vector<std::string> workers;
+};
+
+std::vector<std::string> parse_worker_list(const std::string &list); // comma separated
+
+// serves coordinators on port until the process is stopped, returns non-zero if it can't listen.
+// Workers take scenes and tiles from anyone who connects, so they only listen on loopback unless given an address
+int run_tile_worker(int port, const std::string &bind_address = "127.0.0.1");
+
+#endif
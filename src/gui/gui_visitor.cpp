@@ -2,21 +2,29 @@
 #include "imgui.h"
 #include "../raytracer/hittable.h"
 #include "../raytracer/sphere3d.h"
+#include "../raytracer/compiled_spheres.h"
 #include "../raytracer/vector3d.h"
 
+ImGuiVisitor::ImGuiVisitor() : edited(false) {}
+
 void ImGuiVisitor::visit(Sphere3d *sphere)
 {
-    ImGui::InputDouble("Radius", &sphere->radius);
-    ImGui::InputDouble("Center X", &sphere->center.e[0]);
-    ImGui::InputDouble("Center Y", &sphere->center.e[1]);
-    ImGui::InputDouble("Center Z", &sphere->center.e[2]);
+    edited |= ImGui::InputDouble("Radius", &sphere->radius);
+    edited |= ImGui::InputDouble("Center X", &sphere->center.e[0]);
+    edited |= ImGui::InputDouble("Center Y", &sphere->center.e[1]);
+    edited |= ImGui::InputDouble("Center Z", &sphere->center.e[2]);
+}
+
+void ImGuiVisitor::visit(CompiledSpheres *spheres)
+{
+    ImGui::Text("%zu spheres from a compiled scene, read-only", spheres->sphere_count);
 }
 
 void ImGuiVisitor::visit(Vector3d *vector)
 {
-    ImGui::InputDouble("X", &vector->e[0]);
-    ImGui::InputDouble("Y", &vector->e[1]);
-    ImGui::InputDouble("Z", &vector->e[2]);
+    edited |= ImGui::InputDouble("X", &vector->e[0]);
+    edited |= ImGui::InputDouble("Y", &vector->e[1]);
+    edited |= ImGui::InputDouble("Z", &vector->e[2]);
 }
 
 void ImGuiVisitor::visit(IHittable *object)
@@ -37,6 +45,7 @@ void ImGuiVisitor::visit(Lambertian *material)
         material->albedo.e[0] = static_cast<double>(albedo[0]);
         material->albedo.e[1] = static_cast<double>(albedo[1]);
         material->albedo.e[2] = static_cast<double>(albedo[2]);
+        edited = true;
     }
 }
 
@@ -48,8 +57,9 @@ void ImGuiVisitor::visit(Metal *material)
         material->albedo.e[0] = static_cast<double>(albedo[0]);
         material->albedo.e[1] = static_cast<double>(albedo[1]);
         material->albedo.e[2] = static_cast<double>(albedo[2]);
+        edited = true;
     }
-    ImGui::InputDouble("Fuzz", &material->fuzz);
+    edited |= ImGui::InputDouble("Fuzz", &material->fuzz);
 }
 
 void ImGuiVisitor::visit(Dielectric *material)
@@ -60,6 +70,7 @@ void ImGuiVisitor::visit(Dielectric *material)
         material->tint.e[0] = static_cast<double>(tint[0]);
         material->tint.e[1] = static_cast<double>(tint[1]);
         material->tint.e[2] = static_cast<double>(tint[2]);
+        edited = true;
     }
-    ImGui::InputDouble("Refraction index", &material->refraction_index);
+    edited |= ImGui::InputDouble("Refraction index", &material->refraction_index);
 }
\ No newline at end of file
@@ -8,8 +8,13 @@
 class ImGuiVisitor : public IVisitor
 {
 public:
+    ImGuiVisitor();
+
+    bool edited; // set when any visited field changes, reset by the caller
+
     void visit(class IHittable *object) override;
     void visit(class Sphere3d *sphere) override;
+    void visit(class CompiledSpheres *spheres) override;
     void visit(class Vector3d *vector) override;
     void visit(class IMaterial *material) override;
     void visit(class Lambertian *material) override;
@@ -4,31 +4,287 @@
 #include "./misc/cpp/imgui_stdlib.h"
 
 #include "../scene.h"
+#include "../scene_compiler.h"
+#include "../scene_serializer.h"
+#include "../distributed.h"
 #include "../raytracer/hittable.h"
+#include "../raytracer/render_stats.h"
+#include "../utils/cpu_topology.h"
 
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
 #include <iterator>
 
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+
+EM_JS(void, download_file_js, (const char *name, const uint8_t *data, size_t size), {
+    // copied, a Blob won't take a view of the pthreads build's shared memory
+    var blob = new Blob([HEAPU8.slice(data, data + size)], { type: 'application/octet-stream' });
+    var url = URL.createObjectURL(blob);
+    var a = document.createElement('a');
+    a.href = url;
+    a.download = UTF8ToString(name);
+    document.body.appendChild(a);
+    a.click();
+    document.body.removeChild(a);
+    URL.revokeObjectURL(url);
+});
+#endif
+
 RayTracerInterface::RayTracerInterface(Scene scene)
+#ifdef __EMSCRIPTEN_PTHREADS__
+    : nthreads(CpuTopology::get().usable_threads()), // the page's worker pool is sized to navigator.hardwareConcurrency
+#else
     : nthreads(1),
+#endif
       auto_render(false),
       progress_message(""),
       is_rendering(false),
+      interactive_mode(true),
+      preview_downscale(4),
+      preview_max_depth(3),
+      preview_idle_ms(300),
+      frame_budget_ms(16),
+      preview_rendering(false),
+      preview_pending(false),
+      refine_pending(false),
+      render_cancellable(false),
+      last_edit_ms(0),
+      last_preview_time(0),
       selected_world_object(0),
       selected_object_material(0),
       selected_scene_material(0),
       last_elapsed_time(0),
-      scene(scene)
+      texture_upload_ms(0),
+      texture_upload_pixels(0),
+      heap_peak_bytes(0),
+      show_heatmap(false),
+      scene(scene),
+      render_scene(16, 9),
+      cancel_requested(false)
 {
-    scene.render(progress_message, 1);
+    syncRenderScene();
+    requestRender();
 }
 
 void RayTracerInterface::resetScene()
 {
+    stopRender();
     scene.init();
-    scene.render(progress_message, 1);
+    syncRenderScene();
+    requestRender();
+}
+
+void RayTracerInterface::syncRenderScene()
+{
+    scene.snapshot_into(render_scene, world_mirror);
+    cancel_requested = false;
+    render_scene.camera.cancel = &cancel_requested;
+}
+
+void RayTracerInterface::cancelRender()
+{
+    render_scene.cancel_render(); // a stepped one
+    cancel_requested = true;      // one on another thread
+}
+
+void RayTracerInterface::stopRender()
+{
+    cancelRender();
+    if (render_future.valid())
+        render_future.wait();
+}
+
+bool RayTracerInterface::isRenderRunning() const
+{
+    if (render_scene.render_in_progress())
+        return true;
+    return render_future.valid() && render_future.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+bool RayTracerInterface::isExportRunning() const
+{
+    return export_future.valid() && export_future.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+void RayTracerInterface::exportImage(const std::string &format)
+{
+    // held rather than copied, the frame buffer never renders into a frame someone still holds
+    std::shared_ptr<const RenderTarget> snapshot = scene.getRenderTarget();
+    if (snapshot->getWidth() <= 0 || snapshot->getHeight() <= 0)
+    {
+        return;
+    }
+
+    #ifdef SINGLE_THREADED_BUILD
+    snapshot->save_image(format);
+    #else
+    export_future = std::async(std::launch::async, [snapshot, format]()
+                               { snapshot->save_image(format); });
+    #endif
+}
+
+// downloads name.extension in the browser, writes /tmp/name_id.extension otherwise
+static void saveFile(const std::string &name, int id, const std::string &extension, const std::vector<uint8_t> &data)
+{
+    #ifdef __EMSCRIPTEN__
+    download_file_js((name + extension).c_str(), data.data(), data.size());
+    std::clog << "Downloaded " << name << extension << std::endl;
+    #else
+    std::string path = "/tmp/" + name + "_" + std::to_string(id) + extension;
+    FILE *file = fopen(path.c_str(), "wb");
+    bool ok = file != nullptr && fwrite(data.data(), 1, data.size(), file) == data.size();
+    ok = file != nullptr && fclose(file) == 0 && ok;
+    if (ok)
+        std::clog << "Saved " << path << std::endl;
+    else
+        std::cerr << "Could not write " << path << std::endl;
+    #endif
+}
+
+void RayTracerInterface::saveScene(bool compiled)
+{
+    std::vector<uint8_t> data;
+    if (compiled)
+    {
+        std::string error;
+        data = compile_scene(scene, error);
+        if (data.empty())
+        {
+            std::cerr << "Could not compile the scene: " << error << std::endl;
+            return;
+        }
+    }
+    else
+    {
+        std::string text = serialize_scene(scene);
+        data.assign(text.begin(), text.end());
+    }
+    saveFile("scene", rand(), compiled ? ".rtscene" : ".txt", data);
+}
+
+void RayTracerInterface::saveStats()
+{
+    std::shared_ptr<const RenderTarget> frame = scene.getRenderTarget();
+    if (!frame->stats)
+    {
+        return;
+    }
+
+    int id = rand();
+    std::string json = frame->stats->to_json();
+    saveFile("stats", id, ".json", std::vector<uint8_t>(json.begin(), json.end()));
+    if (!frame->stats->cost.empty())
+    {
+        saveFile("cost", id, ".pfm", encode_pfm(frame->stats->cost_layer(), frame->stats->width, frame->stats->height));
+    }
 }
 
-void RayTracerInterface::ShowMainWindow(SDL_Rect &background_rectangle, RenderTarget &renderTarget)
+void RayTracerInterface::startRender(bool preview)
+{
+    is_rendering = true;
+    preview_rendering = preview;
+    render_cancellable = true;
+    render_ms_start = SDL_GetTicks64();
+    syncRenderScene();
+
+    #ifdef SINGLE_THREADED_BUILD
+    if (preview)
+        render_scene.render_preview(progress_message, nthreads, preview_downscale, preview_max_depth);
+    else if (render_scene.camera.budget.enabled())
+        render_scene.render(progress_message, nthreads); // budgeted passes aren't stepped
+    else
+        render_scene.begin_render(); // ShowMainWindow renders a slice of it every frame
+    #else
+    render_future = std::async(std::launch::async, [this, preview]()
+                               {
+                                   if (preview)
+                                       render_scene.render_preview(progress_message, nthreads, preview_downscale, preview_max_depth);
+                                   else
+                                       render_scene.render(progress_message, nthreads); });
+    #endif
+}
+
+void RayTracerInterface::requestRender()
+{
+    // updateInteractiveRender takes it from here, the same way it handles an edit
+    if (interactive_mode)
+    {
+        last_edit_ms = SDL_GetTicks64();
+        preview_pending = true;
+        refine_pending = true;
+        return;
+    }
+    startRender(false);
+}
+
+void RayTracerInterface::startViewsRender()
+{
+    is_rendering = true;
+    preview_rendering = false;
+    refine_pending = false;
+    render_cancellable = true;
+    render_ms_start = SDL_GetTicks64();
+    syncRenderScene();
+
+    auto render_views = [this](std::vector<Camera> views)
+    {
+        std::vector<FramePixels> images = render_scene.render_views(views, progress_message, nthreads);
+        for (size_t v = 0; v < images.size(); v++)
+        {
+            RenderTarget(images[v], views[v].image_width, views[v].image_height).save_image("png");
+        }
+    };
+
+    #ifdef SINGLE_THREADED_BUILD
+    render_views(render_scene.views);
+    #else
+    render_future = std::async(std::launch::async, render_views, render_scene.views);
+    #endif
+}
+
+void RayTracerInterface::updateInteractiveRender(int changes)
+{
+    if (!interactive_mode)
+    {
+        preview_pending = false;
+        refine_pending = false;
+        return;
+    }
+
+    Uint64 now = SDL_GetTicks64();
+    if (changes != SCENE_CHANGE_NONE)
+    {
+        last_edit_ms = now;
+        preview_pending = true;
+        refine_pending = true;
+        // a render of the old scene would hold the preview back until it's done. Previews are short and
+        // show the edit so far, they aren't stopped
+        if (!preview_rendering && render_cancellable)
+            cancelRender();
+    }
+
+    // one render at a time; edits made meanwhile are picked up by the next preview
+    if (isRenderRunning() || is_rendering)
+    {
+        return;
+    }
+
+    if (preview_pending)
+    {
+        preview_pending = false;
+        startRender(true);
+    }
+    else if (refine_pending && now - last_edit_ms >= preview_idle_ms)
+    {
+        refine_pending = false;
+        startRender(false);
+    }
+}
+
+void RayTracerInterface::ShowMainWindow(SDL_Rect &background_rectangle)
 {
 
 
@@ -42,10 +298,40 @@ void RayTracerInterface::ShowMainWindow(SDL_Rect &background_rectangle, RenderTa
             {
                 resetScene();
             }
-            if (ImGui::MenuItem("Save", "Ctrl+S"))
+            if (ImGui::MenuItem("Save", "Ctrl+S", false, !isExportRunning()))
+            {
+                exportImage("png");
+            }
+            if (ImGui::MenuItem("Save as QOI", nullptr, false, !isExportRunning()))
+            {
+                exportImage("qoi");
+            }
+            if (ImGui::MenuItem("Save as PPM", nullptr, false, !isExportRunning()))
             {
-                renderTarget.save_image("png");
+                exportImage("ppm");
             }
+            if (ImGui::MenuItem("Save as EXR", nullptr, false, !isExportRunning()))
+            {
+                exportImage("exr");
+            }
+            if (ImGui::MenuItem("Save as PFM", nullptr, false, !isExportRunning()))
+            {
+                exportImage("pfm");
+            }
+            ImGui::Separator();
+            if (ImGui::MenuItem("Save scene"))
+            {
+                saveScene(false);
+            }
+            if (ImGui::MenuItem("Save compiled scene"))
+            {
+                saveScene(true);
+            }
+            if (ImGui::MenuItem("Save render stats"))
+            {
+                saveStats();
+            }
+            ImGui::Separator();
             if (ImGui::MenuItem("Close", "Ctrl+W"))
             {
                 std::exit(0);
@@ -55,19 +341,34 @@ void RayTracerInterface::ShowMainWindow(SDL_Rect &background_rectangle, RenderTa
         ImGui::EndMenuBar();
     }
 
-    if (ImGui::Button("Render"))
+    int changes = SCENE_CHANGE_NONE;
+
+    // a stepped render gets half of every frame, the rest keeps the UI and the viewport going
+    if (render_scene.render_in_progress())
     {
-        is_rendering = true;
-        render_ms_start = SDL_GetTicks64();
+        render_scene.render_step(progress_message, frame_budget_ms / 2.0);
+    }
 
-        #ifdef __EMSCRIPTEN__
-        scene.render(progress_message, nthreads);
-        #endif
-        #ifndef __EMSCRIPTEN__
-        render_future = std::async(std::launch::async, [&]()
-                                   { scene.render(progress_message, nthreads); });
-        #endif
+    ImGui::BeginDisabled(isRenderRunning());
+    if (ImGui::Button("Render"))
+    {
+        refine_pending = false;
+        startRender(false);
     }
+    ImGui::EndDisabled();
+    if (isRenderRunning() && render_cancellable)
+    {
+        ImGui::SameLine();
+        if (ImGui::Button("Cancel"))
+        {
+            cancelRender();
+        }
+    }
+
+    ImGui::SameLine();
+    ImGui::Checkbox("Interactive", &interactive_mode);
+    ImGui::SameLine();
+    ImGui::Checkbox("Conservative updates", &scene.conservative_dirty_regions);
 
     // ImGui::SameLine();
     // if (ImGui::Button("Abort"))
@@ -83,22 +384,47 @@ void RayTracerInterface::ShowMainWindow(SDL_Rect &background_rectangle, RenderTa
     //     last_elapsed_time = 0;
     // }
 
-    #ifdef __EMSCRIPTEN__
-    ImGui::Text("Multithread and async are unsupported in web assembly!");
+    #ifdef SINGLE_THREADED_BUILD
+    ImGui::Text("Single-threaded build, threads need index-mt.html on a cross-origin isolated page");
 
     //defaults for threads and auto render
     nthreads = 1;
     auto_render = false;
+    #else
+    ImGui::InputInt("Threads", &nthreads, 1, 10);
     #endif
     #ifndef __EMSCRIPTEN__
-    ImGui::InputInt("Threads", &nthreads, 1, 10);
+    ImGui::SameLine();
+    ImGui::Checkbox("Huge pages", &scene.camera.huge_pages);
+
+    ImGui::InputText("Workers", &distributed_workers);
+    ImGui::SameLine();
+    ImGui::BeginDisabled(isRenderRunning() || distributed_workers.empty());
+    if (ImGui::Button("Distribute"))
+    {
+        refine_pending = false;
+        is_rendering = true;
+        preview_rendering = false;
+        render_cancellable = false;
+        render_ms_start = SDL_GetTicks64();
+        syncRenderScene();
+        std::vector<std::string> workers = parse_worker_list(distributed_workers);
+        render_future = std::async(std::launch::async, [this, workers]()
+                                   { render_scene.render_distributed(progress_message, workers); });
+    }
+    ImGui::EndDisabled();
     // ImGui::SameLine();
     // ImGui::Checkbox("Auto Render", &auto_render);
     #endif
     
-    if (render_future.valid() && render_future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    if (isExportRunning())
+    {
+        ImGui::Text("Exporting...");
+    }
+
+    if (isRenderRunning())
     {
-        ImGui::Text("Rendering...");
+        ImGui::Text(preview_rendering ? "Previewing..." : "Rendering...");
         ImGui::Text("%s", progress_message.c_str());
     }
     else
@@ -106,47 +432,155 @@ void RayTracerInterface::ShowMainWindow(SDL_Rect &background_rectangle, RenderTa
         if (is_rendering)
         {
             render_ms_end = SDL_GetTicks64();
-            last_elapsed_time = render_ms_end - render_ms_start;
             is_rendering = false;
+            // what the render measured goes back to the edited camera
+            scene.camera.achieved_samples_per_pixel = render_scene.camera.achieved_samples_per_pixel;
+            scene.camera.achieved_noise = render_scene.camera.achieved_noise;
+
+            if (preview_rendering)
+            {
+                // keep previews inside the frame budget by trading resolution for speed
+                last_preview_time = render_ms_end - render_ms_start;
+                if (last_preview_time > frame_budget_ms && preview_downscale < 16)
+                    preview_downscale++;
+                else if (last_preview_time < frame_budget_ms / 3 && preview_downscale > 2)
+                    preview_downscale--;
+            }
+            else
+            {
+                last_elapsed_time = render_ms_end - render_ms_start;
+            }
         }
     }
 
     if (!is_rendering)
     {
         ImGui::Text("Finished rendering in %llu ms", last_elapsed_time ? last_elapsed_time : 0);
+        if (texture_upload_pixels > 0)
+        {
+            ImGui::Text("Viewport upload %.2f ms for %zu pixels", texture_upload_ms, texture_upload_pixels);
+        }
+        if (heap_peak_bytes > 0)
+        {
+            ImGui::Text("Heap peak %.1f MB", heap_peak_bytes / (1024.0 * 1024.0));
+        }
+        if (render_scene.gbuffer.last_reshade_ms > 0)
+        {
+            ImGui::Text("Last re-shade %.0f ms vs %.0f ms full trace", render_scene.gbuffer.last_reshade_ms, render_scene.gbuffer.last_trace_ms);
+        }
+        if (render_scene.gbuffer.bytes() > 0)
+        {
+            ImGui::Text("Primary hit cache %.1f MB", render_scene.gbuffer.bytes() / (1024.0 * 1024.0));
+        }
+        if (interactive_mode && (preview_pending || refine_pending))
+        {
+            ImGui::Text("Preview at 1/%d resolution in %llu ms", preview_downscale, last_preview_time);
+        }
+    }
+
+    if (ImGui::CollapsingHeader("Statistics"))
+    {
+        // the frame on screen carries the stats of the render that made it
+        std::shared_ptr<const RenderTarget> frame = scene.getRenderTarget();
+        if (!frame->stats)
+        {
+            ImGui::Text("Previews aren't measured, render to see statistics");
+        }
+        else
+        {
+            const RenderStats &stats = *frame->stats;
+            ImGui::Text("%.2f Mrays/s, %.2f Msamples/s", stats.rays_per_second() / 1e6, stats.samples_per_second() / 1e6);
+            ImGui::Text("%.2f rays per path, %.1f tests per ray", stats.average_path_length(), stats.tests_per_ray());
+            for (size_t t = 0; t < stats.thread_busy_ms.size(); t++)
+            {
+                char label[32];
+                snprintf(label, sizeof(label), "Thread %d: %.0f%%", static_cast<int>(t), 100 * stats.thread_utilization(t));
+                ImGui::ProgressBar(static_cast<float>(stats.thread_utilization(t)), ImVec2(-1, 0), label);
+            }
+        }
+        ImGui::Checkbox("Cost heatmap", &show_heatmap);
     }
 
     if (ImGui::CollapsingHeader("Camera"))
     {
         ImGui::SeparatorText("Location");
         ImGui::Text("Origin");
-        CustomInputDoubleWithLabel("X", &scene.camera.lookFrom.e[0]);
-        CustomInputDoubleWithLabel("Y", &scene.camera.lookFrom.e[1]);
-        CustomInputDoubleWithLabel("Z", &scene.camera.lookFrom.e[2]);
+        changes |= CustomInputDoubleWithLabel("X", &scene.camera.lookFrom.e[0]) ? SCENE_CHANGE_CAMERA : 0;
+        changes |= CustomInputDoubleWithLabel("Y", &scene.camera.lookFrom.e[1]) ? SCENE_CHANGE_CAMERA : 0;
+        changes |= CustomInputDoubleWithLabel("Z", &scene.camera.lookFrom.e[2]) ? SCENE_CHANGE_CAMERA : 0;
         ImGui::Text("Target");
-        CustomInputDoubleWithLabel("X", &scene.camera.lookAt.e[0]);
-        CustomInputDoubleWithLabel("Y", &scene.camera.lookAt.e[1]);
-        CustomInputDoubleWithLabel("Z", &scene.camera.lookAt.e[2]);
+        changes |= CustomInputDoubleWithLabel("X", &scene.camera.lookAt.e[0]) ? SCENE_CHANGE_CAMERA : 0;
+        changes |= CustomInputDoubleWithLabel("Y", &scene.camera.lookAt.e[1]) ? SCENE_CHANGE_CAMERA : 0;
+        changes |= CustomInputDoubleWithLabel("Z", &scene.camera.lookAt.e[2]) ? SCENE_CHANGE_CAMERA : 0;
         ImGui::Text("Up vector");
-        CustomInputDoubleWithLabel("X", &scene.camera.vector_up.e[0]);
-        CustomInputDoubleWithLabel("Y", &scene.camera.vector_up.e[1]);
-        CustomInputDoubleWithLabel("Z", &scene.camera.vector_up.e[2]);
+        changes |= CustomInputDoubleWithLabel("X", &scene.camera.vector_up.e[0]) ? SCENE_CHANGE_CAMERA : 0;
+        changes |= CustomInputDoubleWithLabel("Y", &scene.camera.vector_up.e[1]) ? SCENE_CHANGE_CAMERA : 0;
+        changes |= CustomInputDoubleWithLabel("Z", &scene.camera.vector_up.e[2]) ? SCENE_CHANGE_CAMERA : 0;
+    }
+
+    if (ImGui::CollapsingHeader("Views"))
+    {
+        ImGui::PushID("Views##");
+        for (size_t v = 0; v < scene.views.size(); v++)
+        {
+            const Camera &view = scene.views[v];
+            ImGui::PushID(static_cast<int>(v));
+            ImGui::Text("%d: from (%.2f, %.2f, %.2f)", static_cast<int>(v + 1), view.lookFrom.x(), view.lookFrom.y(), view.lookFrom.z());
+            ImGui::SameLine();
+            if (ImGui::Button("Go to"))
+            {
+                scene.camera.lookFrom = view.lookFrom;
+                scene.camera.lookAt = view.lookAt;
+                scene.camera.vector_up = view.vector_up;
+                scene.camera.vfov = view.vfov;
+                changes |= SCENE_CHANGE_CAMERA;
+            }
+            ImGui::SameLine();
+            bool deleted = ImGui::Button("Delete");
+            ImGui::PopID();
+            if (deleted)
+            {
+                scene.views.erase(scene.views.begin() + v);
+                break;
+            }
+        }
+
+        if (ImGui::Button("Add current view"))
+        {
+            scene.views.push_back(scene.camera);
+        }
+        ImGui::SameLine();
+        ImGui::BeginDisabled(isRenderRunning() || scene.views.empty());
+        if (ImGui::Button("Render all views"))
+        {
+            startViewsRender();
+        }
+        ImGui::EndDisabled();
+        ImGui::PopID();
     }
 
     if (ImGui::CollapsingHeader("Image"))
     {
         ImGui::SeparatorText("Size");
-        CustomInputDoubleWithLabel("Aspect Ratio Width", &scene.camera.aspect_ratio_width);
-        CustomInputDoubleWithLabel("Aspect Ratio Height", &scene.camera.aspect_ratio_height);
-        ImGui::InputInt("Image Width", &scene.camera.image_width);
+        changes |= CustomInputDoubleWithLabel("Aspect Ratio Width", &scene.camera.aspect_ratio_width) ? SCENE_CHANGE_CAMERA : 0;
+        changes |= CustomInputDoubleWithLabel("Aspect Ratio Height", &scene.camera.aspect_ratio_height) ? SCENE_CHANGE_CAMERA : 0;
+        changes |= ImGui::InputInt("Image Width", &scene.camera.image_width) ? SCENE_CHANGE_CAMERA : 0;
 
         ImGui::SeparatorText("Focus blur");
-        CustomInputDoubleWithLabel("Defocus angle", &scene.camera.defocus_angle);
-        CustomInputDoubleWithLabel("Focus distance", &scene.camera.focus_distance);
+        changes |= CustomInputDoubleWithLabel("Defocus angle", &scene.camera.defocus_angle) ? SCENE_CHANGE_CAMERA : 0;
+        changes |= CustomInputDoubleWithLabel("Focus distance", &scene.camera.focus_distance) ? SCENE_CHANGE_CAMERA : 0;
 
         ImGui::SeparatorText("Parameters");
-        ImGui::InputInt("Samples", &scene.camera.samples_per_pixel, 1, 10);
-        ImGui::InputInt("Max Depth", &scene.camera.max_depth);
+        changes |= ImGui::InputInt("Samples", &scene.camera.samples_per_pixel, 1, 10) ? SCENE_CHANGE_CAMERA : 0;
+        changes |= ImGui::InputInt("Max Depth", &scene.camera.max_depth) ? SCENE_CHANGE_CAMERA : 0;
+
+        ImGui::SeparatorText("Budget");
+        CustomInputDoubleWithLabel("Time limit (s)", &scene.camera.budget.seconds);
+        CustomInputDoubleWithLabel("Target noise", &scene.camera.budget.target_noise);
+        if (scene.camera.achieved_samples_per_pixel > 0)
+        {
+            ImGui::Text("Last budgeted render: %.1f spp, noise %.4f", scene.camera.achieved_samples_per_pixel, scene.camera.achieved_noise);
+        }
 
         ImGui::SeparatorText("Output");
         ImGui::InputInt("Origin X", &background_rectangle.x);
@@ -180,7 +614,8 @@ void RayTracerInterface::ShowMainWindow(SDL_Rect &background_rectangle, RenderTa
 
                 selected_world_object -= 1;
 
-                scene.world.remove(toDelete);
+                scene.removeObject(toDelete);
+                changes |= SCENE_CHANGE_GEOMETRY;
 
                 if (selected_world_object < 0)
                 {
@@ -207,31 +642,45 @@ void RayTracerInterface::ShowMainWindow(SDL_Rect &background_rectangle, RenderTa
                     }
                 }
 
-                ImGui::SeparatorText("Material");
-                std::vector<const char *> materialKeys = scene.getMaterialKeys();
-
-                selected_object_material = scene.getMaterialIndexForName(selectedObject->material->name);
-                // If the material was not found in the vector, set the index to -1
-                if (selected_object_material >= materialKeys.size())
-                {
-                    selected_object_material = -1;
-                }
-                // on change list, update object material
-                if (ImGui::Combo(getLabelForValue("", selected_object_material).c_str(), &selected_object_material, materialKeys.data(), materialKeys.size()))
+                // compiled spheres have one material per sphere, not per object
+                if (selectedObject->material)
                 {
-                    // Get the new material
-                    const char *newMaterial = materialKeys[selected_object_material];
+                    ImGui::SeparatorText("Material");
+                    std::vector<const char *> materialKeys = scene.getMaterialKeys();
+
+                    selected_object_material = scene.getMaterialIndexForName(selectedObject->material->name);
+                    // If the material was not found in the vector, set the index to -1
+                    if (selected_object_material >= materialKeys.size())
+                    {
+                        selected_object_material = -1;
+                    }
+                    // on change list, update object material
+                    if (ImGui::Combo(getLabelForValue("", selected_object_material).c_str(), &selected_object_material, materialKeys.data(), materialKeys.size()))
+                    {
+                        // Get the new material
+                        const char *newMaterial = materialKeys[selected_object_material];
 
-                    // Get the selected object
-                    const char *object = objectKeys[selected_world_object];
+                        // Get the selected object
+                        const char *object = objectKeys[selected_world_object];
 
-                    // Update the material of the object
-                    scene.setMaterialForObject(object, newMaterial);
+                        // Update the material of the object
+                        scene.setMaterialForObject(object, newMaterial);
+                        changes |= SCENE_CHANGE_MATERIAL;
+                    }
                 }
 
                 ImGui::SeparatorText("Edit attributes");
 
+                AABB bounds_before_edit = selectedObject->bounding_box();
+                visitor.edited = false;
                 selectedObject->accept(&visitor);
+                if (visitor.edited)
+                {
+                    // both where the object was and where it is now need re-rendering
+                    scene.markChanged(SCENE_CHANGE_GEOMETRY, bounds_before_edit);
+                    scene.markChanged(SCENE_CHANGE_GEOMETRY, selectedObject->bounding_box());
+                    changes |= SCENE_CHANGE_GEOMETRY;
+                }
 
                 ImGui::EndPopup();
             }
@@ -260,6 +709,7 @@ void RayTracerInterface::ShowMainWindow(SDL_Rect &background_rectangle, RenderTa
                 selected_scene_material -= 1;
 
                 scene.deleteMaterial(toDelete);
+                changes |= SCENE_CHANGE_MATERIAL;
 
                 if (selected_scene_material < 0)
                 {
@@ -288,7 +738,13 @@ void RayTracerInterface::ShowMainWindow(SDL_Rect &background_rectangle, RenderTa
                     }
                 }
 
+                visitor.edited = false;
                 selectedMaterial->accept(&visitor);
+                if (visitor.edited)
+                {
+                    scene.markMaterialChanged(selectedMaterial);
+                    changes |= SCENE_CHANGE_MATERIAL;
+                }
 
                 ImGui::EndPopup();
             }
@@ -297,5 +753,12 @@ void RayTracerInterface::ShowMainWindow(SDL_Rect &background_rectangle, RenderTa
     }
 
     ImGui::End();
+
+    if (changes & SCENE_CHANGE_CAMERA)
+    {
+        scene.markChanged(SCENE_CHANGE_CAMERA);
+    }
+
+    updateInteractiveRender(changes);
 }
 
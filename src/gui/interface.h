@@ -3,6 +3,7 @@
 
 #include <SDL2/SDL.h>
 
+#include <atomic>
 #include <future>
 #include <string>
 #include "../scene.h"
@@ -13,6 +14,7 @@ class RayTracerInterface
 public:
     int nthreads;
     std::future<void> render_future;
+    std::future<void> export_future;
     bool auto_render;
 
     std::string progress_message;
@@ -20,6 +22,25 @@ public:
     Uint64 render_ms_start;
     Uint64 render_ms_end;
     Uint64 last_elapsed_time;
+    double texture_upload_ms;     // converting and uploading the last new image to the viewport texture
+    size_t texture_upload_pixels; // of it, less than the image when only changed tiles went up
+    size_t heap_peak_bytes;       // most the browser build's heap has held so far, 0 where it isn't tracked
+    bool show_heatmap;            // per-pixel cost of the render over the viewport, see RenderStats
+
+    // interactive mode: low resolution previews while editing, full render once idle
+    bool interactive_mode;
+    int preview_downscale;
+    int preview_max_depth;
+    Uint64 preview_idle_ms;
+    Uint64 frame_budget_ms;
+    bool preview_rendering;
+    bool preview_pending;
+    bool refine_pending;
+    bool render_cancellable; // the running render stops early on cancelRender(), distributed ones don't
+    Uint64 last_edit_ms;
+    Uint64 last_preview_time;
+
+    std::string distributed_workers; // comma separated host:port list
 
     int selected_world_object;
     int selected_object_material;
@@ -29,10 +50,29 @@ public:
     
     RayTracerInterface(Scene scene);
 
-    void ShowMainWindow(SDL_Rect &background_rectangle, RenderTarget &renderTarget);
+    void ShowMainWindow(SDL_Rect &background_rectangle);
     void resetScene();
+    void startRender(bool preview);
+    void requestRender(); // a preview, then the full render once idle, as after an edit. Nothing waits for them
+    void startViewsRender(); // renders scene.views and saves one image per view
+    void exportImage(const std::string &format); // encodes a copy of the current image off the UI thread
+    bool isExportRunning() const;
+    void saveScene(bool compiled); // as scene text, or as a compiled scene the CLI loads without parsing
+    void saveStats(); // the stats of the frame shown as JSON, and its per-pixel cost as a .pfm
+    bool isRenderRunning() const;
+    void updateInteractiveRender(int changes);
+    void cancelRender(); // the running render stops at its next tile, nothing of it is shown
+    void stopRender();   // cancels the running render and waits for it
 
     Scene scene;
+    Scene render_scene; // renders run on this copy while scene is edited, see syncRenderScene()
+
+private:
+    WorldMirror world_mirror;
+    std::atomic<bool> cancel_requested;
+
+    // brings render_scene up to date with scene, while no render runs
+    void syncRenderScene();
 };
 
 #endif
\ No newline at end of file
@@ -7,9 +7,7 @@ bool CustomInputDoubleWithLabel(std::string label, double *v, double step, doubl
         return false;
     }
 
-    ImGui::InputDouble(getLabelForValue(label, *v).c_str(), v, step, step_fast, format, flags);
-
-    return true;
+    return ImGui::InputDouble(getLabelForValue(label, *v).c_str(), v, step, step_fast, format, flags);
 }
 
 float getAutoWidthForChildren(int nChildren)
@@ -0,0 +1,534 @@
+#include "job_server.h"
+#include "scene_serializer.h"
+#include "utils/json.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const char *state_names[] = {"queued", "running", "done", "cancelled", "failed"};
+
+static double milliseconds(std::chrono::steady_clock::duration duration)
+{
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+RenderJobServer::Job::Job()
+    : id(0),
+      priority(0),
+      state(JOB_QUEUED),
+      camera(16, 9),
+      next_tile(0),
+      tiles_done(0),
+      in_flight(0),
+      last_served(0),
+      scene_cached(false)
+{
+}
+
+#pragma region scheduling
+RenderJobServer::RenderJobServer(int nthreads)
+    : scene_cache_size(8),
+      finished_job_limit(256),
+      stopping(false),
+      next_id(1),
+      served_tiles(0)
+{
+    for (int t = 0; t < std::max(1, nthreads); t++)
+    {
+        threads.push_back(std::thread(&RenderJobServer::work, this));
+    }
+}
+
+RenderJobServer::~RenderJobServer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_available.notify_all();
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+}
+
+std::shared_ptr<Scene> RenderJobServer::load_scene(const std::string &key, bool &cached, std::string &error)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::list<CachedScene>::iterator it = scene_cache.begin(); it != scene_cache.end(); ++it)
+        {
+            if (it->key == key)
+            {
+                scene_cache.splice(scene_cache.begin(), scene_cache, it);
+                cached = true;
+                return it->scene;
+            }
+        }
+    }
+
+    // parsed outside the lock so a big scene doesn't stall the render threads
+    std::shared_ptr<Scene> scene = std::make_shared<Scene>(16, 9);
+    if (!deserialize_scene(key, *scene, error))
+        return nullptr;
+    scene->world.updateBvh(); // built once, the cached scene is only read from here on
+
+    std::lock_guard<std::mutex> lock(mutex);
+    scene_cache.push_front(CachedScene{key, scene});
+    while (scene_cache.size() > scene_cache_size)
+    {
+        scene_cache.pop_back(); // jobs still rendering keep their own reference
+    }
+    cached = false;
+    return scene;
+}
+
+long RenderJobServer::submit(const std::string &scene_text, int priority, int width, int spp, int depth, std::string &error)
+{
+    // jobs that differ only in camera, budget or samples share one loaded scene
+    std::string camera_text, key;
+    std::stringstream lines(scene_text);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        bool camera_line = line.compare(0, 7, "camera ") == 0 || line.compare(0, 7, "budget ") == 0;
+        (camera_line ? camera_text : key) += line + '\n';
+    }
+
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->scene = load_scene(key, job->scene_cached, error);
+    if (!job->scene)
+        return -1;
+
+    Scene camera_only(16, 9);
+    if (!camera_text.empty() && !deserialize_scene(camera_text, camera_only, error))
+        return -1;
+
+    job->camera = camera_text.empty() ? job->scene->camera : camera_only.camera;
+    if (width > 0)
+        job->camera.image_width = width;
+    if (spp > 0)
+        job->camera.samples_per_pixel = spp;
+    if (depth > 0)
+        job->camera.max_depth = depth;
+    job->tiles = job->camera.plan_tiles();
+    if (job->tiles.empty())
+    {
+        error = "invalid image dimensions";
+        return -1;
+    }
+    job->image.assign(size_t(job->camera.image_width) * job->camera.image_height, Color());
+    job->priority = priority;
+    job->submitted = std::chrono::steady_clock::now();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job->id = next_id++;
+        job->last_served = served_tiles; // new jobs join the rotation instead of jumping it
+        jobs[job->id] = job;
+        runnable.push_back(job);
+    }
+    work_available.notify_all();
+    return job->id;
+}
+
+// highest priority first, then the job that waited longest since its last tile. Called with the lock held
+std::shared_ptr<RenderJobServer::Job> RenderJobServer::next_job()
+{
+    std::shared_ptr<Job> best;
+    for (const std::shared_ptr<Job> &job : runnable)
+    {
+        if (!best || job->priority > best->priority ||
+            (job->priority == best->priority && job->last_served < best->last_served))
+        {
+            best = job;
+        }
+    }
+    return best;
+}
+
+void RenderJobServer::work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping)
+    {
+        std::shared_ptr<Job> job = next_job();
+        if (!job)
+        {
+            work_available.wait(lock);
+            continue;
+        }
+
+        size_t k = job->next_tile++;
+        if (job->next_tile == job->tiles.size())
+        {
+            runnable.erase(std::find(runnable.begin(), runnable.end(), job));
+        }
+        if (job->state == JOB_QUEUED)
+        {
+            job->state = JOB_RUNNING;
+            job->started = std::chrono::steady_clock::now();
+        }
+        job->in_flight++;
+        job->last_served = ++served_tiles;
+        lock.unlock();
+
+        std::vector<Color> pixels = job->camera.render_single_tile(job->scene->world, job->tiles[k]);
+
+        lock.lock();
+        job->in_flight--;
+        if (job->state == JOB_CANCELLED)
+        {
+            if (job->in_flight == 0)
+                FramePixels().swap(job->image);
+            continue;
+        }
+
+        const Tile &tile = job->tiles[k];
+        const Color *pixel = pixels.data();
+        for (int j = tile.y0; j < tile.y1; j++)
+        {
+            for (int i = tile.x0; i < tile.x1; i++)
+            {
+                job->image[size_t(j) * job->camera.image_width + i] = *pixel++;
+            }
+        }
+
+        if (++job->tiles_done == job->tiles.size())
+        {
+            // the last tile's thread encodes while the others keep rendering, counted in flight so a cancel leaves the image alone
+            job->in_flight++;
+            lock.unlock();
+            RenderTarget target(job->image, job->camera.image_width, job->camera.image_height);
+            std::vector<uint8_t> png = target.save_png_to_memory();
+            lock.lock();
+            job->in_flight--;
+
+            FramePixels().swap(job->image);
+            if (job->state != JOB_CANCELLED)
+            {
+                job->png.swap(png);
+                finish(job, job->png.empty() ? JOB_FAILED : JOB_DONE);
+            }
+        }
+    }
+}
+
+// called with the lock held
+void RenderJobServer::finish(const std::shared_ptr<Job> &job, JobState state)
+{
+    job->state = state;
+    job->finished = std::chrono::steady_clock::now();
+    finished_jobs.push_back(job->id);
+    while (finished_jobs.size() > finished_job_limit)
+    {
+        jobs.erase(finished_jobs.front());
+        finished_jobs.pop_front();
+    }
+    job_finished.notify_all();
+}
+
+bool RenderJobServer::cancel(long id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<long, std::shared_ptr<Job>>::iterator it = jobs.find(id);
+    if (it == jobs.end())
+        return false;
+
+    std::shared_ptr<Job> job = it->second;
+    if (job->state == JOB_QUEUED || job->state == JOB_RUNNING)
+    {
+        std::vector<std::shared_ptr<Job>>::iterator queued = std::find(runnable.begin(), runnable.end(), job);
+        if (queued != runnable.end())
+            runnable.erase(queued);
+        if (job->in_flight == 0)
+            FramePixels().swap(job->image); // otherwise the last tile in flight frees it
+        finish(job, JOB_CANCELLED);
+    }
+    return true;
+}
+
+bool RenderJobServer::status(long id, std::string &json) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<long, std::shared_ptr<Job>>::const_iterator it = jobs.find(id);
+    if (it == jobs.end())
+        return false;
+
+    const Job &job = *it->second;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    bool ended = job.state == JOB_DONE || job.state == JOB_CANCELLED || job.state == JOB_FAILED;
+    bool started = job.state != JOB_QUEUED && job.started != std::chrono::steady_clock::time_point();
+
+    std::stringstream out;
+    out << "{\"id\":" << job.id << ",\"state\":\"" << state_names[job.state] << "\",\"priority\":" << job.priority
+        << ",\"progress\":" << double(job.tiles_done) / job.tiles.size()
+        << ",\"width\":" << job.camera.image_width << ",\"height\":" << job.camera.image_height
+        << ",\"spp\":" << job.camera.samples_per_pixel << ",\"scene_cached\":" << (job.scene_cached ? "true" : "false")
+        << ",\"wait_ms\":" << milliseconds((started ? job.started : (ended ? job.finished : now)) - job.submitted)
+        << ",\"render_ms\":" << (started ? milliseconds((ended ? job.finished : now) - job.started) : 0.0)
+        << ",\"png_bytes\":" << job.png.size() << "}";
+    json = out.str();
+    return true;
+}
+
+bool RenderJobServer::result(long id, int timeout_ms, std::vector<uint8_t> &png, JobState &state)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::map<long, std::shared_ptr<Job>>::iterator it = jobs.find(id);
+    if (it == jobs.end())
+        return false;
+
+    std::shared_ptr<Job> job = it->second;
+    auto ended = [&]() { return job->state != JOB_QUEUED && job->state != JOB_RUNNING; };
+    if (timeout_ms < 0)
+        job_finished.wait(lock, ended);
+    else
+        job_finished.wait_for(lock, std::chrono::milliseconds(timeout_ms), ended);
+
+    state = job->state;
+    if (state == JOB_DONE)
+        png = job->png;
+    return true;
+}
+#pragma endregion
+
+#pragma region http
+struct HttpRequest
+{
+    std::string method;
+    std::string path;
+    std::map<std::string, std::string> query;
+    std::string body;
+};
+
+static bool read_request(int fd, HttpRequest &request)
+{
+    const size_t max_header = 64 << 10;
+    const size_t max_body = 256 << 20;
+
+    std::string data;
+    size_t header_end;
+    char buffer[16384];
+    while ((header_end = data.find("\r\n\r\n")) == std::string::npos)
+    {
+        if (data.size() > max_header)
+            return false;
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received <= 0)
+            return false;
+        data.append(buffer, received);
+    }
+
+    std::stringstream header(data.substr(0, header_end));
+    std::string target, line;
+    header >> request.method >> target;
+    std::getline(header, line);
+
+    size_t content_length = 0;
+    while (std::getline(header, line))
+    {
+        std::string name = line.substr(0, line.find(':'));
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name == "content-length")
+            content_length = std::strtoul(line.c_str() + line.find(':') + 1, nullptr, 10);
+    }
+    if (content_length > max_body)
+        return false;
+
+    request.body = data.substr(header_end + 4);
+    while (request.body.size() < content_length)
+    {
+        ssize_t received = recv(fd, buffer, std::min(sizeof(buffer), content_length - request.body.size()), 0);
+        if (received <= 0)
+            return false;
+        request.body.append(buffer, received);
+    }
+    request.body.resize(content_length);
+
+    size_t question = target.find('?');
+    request.path = target.substr(0, question);
+    if (question != std::string::npos)
+    {
+        std::stringstream params(target.substr(question + 1));
+        std::string param;
+        while (std::getline(params, param, '&'))
+        {
+            size_t equals = param.find('=');
+            request.query[param.substr(0, equals)] = equals == std::string::npos ? "" : param.substr(equals + 1);
+        }
+    }
+    return true;
+}
+
+static void send_response(int fd, int code, const std::string &content_type, const void *body, size_t size)
+{
+    const char *reason = code == 200 ? "OK" : code == 201 ? "Created" : code == 202 ? "Accepted" : code == 400 ? "Bad Request"
+                         : code == 404 ? "Not Found" : code == 409 ? "Conflict" : "Error";
+    std::stringstream header;
+    header << "HTTP/1.1 " << code << ' ' << reason << "\r\nContent-Type: " << content_type
+           << "\r\nContent-Length: " << size << "\r\nConnection: close\r\n\r\n";
+    std::string head = header.str();
+
+    std::string response = head + std::string(static_cast<const char *>(body), size);
+    const char *bytes = response.data();
+    size_t left = response.size();
+    while (left > 0)
+    {
+        ssize_t sent = send(fd, bytes, left, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return;
+        bytes += sent;
+        left -= sent;
+    }
+}
+
+static void send_json(int fd, int code, const std::string &json)
+{
+    std::string body = json + "\n";
+    send_response(fd, code, "application/json", body.data(), body.size());
+}
+
+static int query_int(const HttpRequest &request, const std::string &name, int fallback)
+{
+    std::map<std::string, std::string>::const_iterator it = request.query.find(name);
+    return it == request.query.end() ? fallback : std::atoi(it->second.c_str());
+}
+
+// POST /jobs             scene text in the body, ?priority=&width=&spp=&depth=, replies with the job id
+// POST /render           same, but waits and replies with the PNG
+// GET /jobs/ID           job status
+// GET /jobs/ID/image     the PNG once done, 202 while rendering unless ?wait=1
+// DELETE /jobs/ID        cancels the job
+void RenderJobServer::handle_connection(int fd)
+{
+    HttpRequest request;
+    if (!read_request(fd, request))
+    {
+        close(fd);
+        return;
+    }
+
+    long id = -1;
+    std::string rest;
+    if (request.path.compare(0, 6, "/jobs/") == 0)
+    {
+        char *end = nullptr;
+        id = std::strtol(request.path.c_str() + 6, &end, 10);
+        rest = end;
+    }
+
+    auto send_image = [&](long id, bool wait)
+    {
+        std::vector<uint8_t> png;
+        JobState state;
+        std::string json;
+        if (!result(id, wait ? -1 : 0, png, state))
+            send_json(fd, 404, "{\"error\":\"unknown job\"}");
+        else if (state == JOB_DONE)
+            send_response(fd, 200, "image/png", png.data(), png.size());
+        else if ((state == JOB_QUEUED || state == JOB_RUNNING) && status(id, json))
+            send_json(fd, 202, json);
+        else
+            send_json(fd, 409, std::string("{\"error\":\"job ") + state_names[state] + "\"}");
+    };
+
+    if (request.method == "POST" && (request.path == "/jobs" || request.path == "/render"))
+    {
+        std::string error;
+        id = submit(request.body, query_int(request, "priority", 0), query_int(request, "width", 0),
+                    query_int(request, "spp", 0), query_int(request, "depth", 0), error);
+        if (id < 0)
+            send_json(fd, 400, "{\"error\":\"" + json_escape(error) + "\"}");
+        else if (request.path == "/jobs")
+            send_json(fd, 201, "{\"id\":" + std::to_string(id) + "}");
+        else
+            send_image(id, true);
+    }
+    else if (request.method == "GET" && id >= 0 && rest.empty())
+    {
+        std::string json;
+        if (status(id, json))
+            send_json(fd, 200, json);
+        else
+            send_json(fd, 404, "{\"error\":\"unknown job\"}");
+    }
+    else if (request.method == "GET" && id >= 0 && rest == "/image")
+    {
+        send_image(id, query_int(request, "wait", 0) != 0);
+    }
+    else if (request.method == "DELETE" && id >= 0 && rest.empty())
+    {
+        if (cancel(id))
+            send_json(fd, 200, "{\"id\":" + std::to_string(id) + ",\"state\":\"cancelled\"}");
+        else
+            send_json(fd, 404, "{\"error\":\"unknown job\"}");
+    }
+    else
+    {
+        send_json(fd, 404, "{\"error\":\"unknown endpoint\"}");
+    }
+    close(fd);
+}
+
+int RenderJobServer::serve(const std::string &address)
+{
+    bool is_port = !address.empty() && address.find_first_not_of("0123456789") == std::string::npos;
+    int server;
+    if (is_port)
+    {
+        // loopback only, the API has no authentication
+        server = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        sockaddr_in local;
+        std::memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        local.sin_port = htons(std::atoi(address.c_str()));
+        if (server < 0 || bind(server, reinterpret_cast<sockaddr *>(&local), sizeof(local)) != 0)
+            server = -1;
+    }
+    else
+    {
+        server = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un local;
+        std::memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        std::strncpy(local.sun_path, address.c_str(), sizeof(local.sun_path) - 1);
+        unlink(address.c_str());
+        if (server < 0 || address.size() >= sizeof(local.sun_path) || bind(server, reinterpret_cast<sockaddr *>(&local), sizeof(local)) != 0)
+            server = -1;
+    }
+
+    if (server < 0 || listen(server, 64) != 0)
+    {
+        std::cerr << "Could not listen on " << address << std::endl;
+        return 1;
+    }
+
+    std::clog << "Render job server listening on " << (is_port ? "127.0.0.1:" : "") << address << " with " << threads.size() << " threads" << std::endl;
+    while (true)
+    {
+        int fd = accept(server, nullptr, nullptr);
+        if (fd >= 0)
+        {
+            // a client that stops sending doesn't hold its connection thread forever
+            timeval timeout;
+            timeout.tv_sec = 30;
+            timeout.tv_usec = 0;
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            std::thread(&RenderJobServer::handle_connection, this, fd).detach();
+        }
+    }
+}
+#pragma endregion
@@ -0,0 +1,97 @@
+#ifndef JOB_SERVER_H
+#define JOB_SERVER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "scene.h"
+
+enum JobState
+{
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_CANCELLED,
+    JOB_FAILED,
+};
+
+// queues render jobs from other local services and renders their tiles on one shared pool of threads.
+// Higher priority jobs go first, jobs of equal priority take turns tile by tile
+class RenderJobServer
+{
+public:
+    RenderJobServer(int nthreads);
+    ~RenderJobServer();
+
+    size_t scene_cache_size;   // loaded scenes kept for jobs that only change the camera or samples
+    size_t finished_job_limit; // finished jobs kept for their results, the oldest are dropped first
+
+    // scene text as written by serialize_scene, width/spp/depth override the camera line when positive.
+    // Returns the job id, or -1 with error set when the scene can't be loaded
+    long submit(const std::string &scene_text, int priority, int width, int spp, int depth, std::string &error);
+    bool cancel(long id);
+    // false for unknown jobs
+    bool status(long id, std::string &json) const;
+    // waits up to timeout_ms (forever when negative) for the job to finish, true with the PNG once it's done
+    bool result(long id, int timeout_ms, std::vector<uint8_t> &png, JobState &state);
+
+    // serves the HTTP API on a loopback port ("8080") or a unix socket path ("/tmp/raytracer.sock"),
+    // returns non-zero if it can't listen
+    int serve(const std::string &address);
+
+private:
+    struct Job
+    {
+        long id;
+        int priority;
+        JobState state;
+        std::shared_ptr<Scene> scene; // shared with other jobs of the same scene
+        Camera camera;
+        std::vector<Tile> tiles;
+        size_t next_tile;
+        size_t tiles_done;
+        int in_flight;
+        unsigned long last_served; // tile counter when this job last got a thread, for round robin
+        bool scene_cached;
+        FramePixels image;
+        std::vector<uint8_t> png;
+        std::chrono::steady_clock::time_point submitted, started, finished;
+
+        Job();
+    };
+
+    struct CachedScene
+    {
+        std::string key; // scene text without the camera line
+        std::shared_ptr<Scene> scene;
+    };
+
+    mutable std::mutex mutex;
+    std::condition_variable work_available;
+    std::condition_variable job_finished;
+    std::vector<std::thread> threads;
+    bool stopping;
+
+    long next_id;
+    unsigned long served_tiles;
+    std::map<long, std::shared_ptr<Job>> jobs;
+    std::vector<std::shared_ptr<Job>> runnable; // jobs with tiles left to hand out
+    std::deque<long> finished_jobs;             // oldest first
+    std::list<CachedScene> scene_cache;         // most recently used first
+
+    void work();
+    std::shared_ptr<Job> next_job();
+    std::shared_ptr<Scene> load_scene(const std::string &key, bool &cached, std::string &error);
+    void finish(const std::shared_ptr<Job> &job, JobState state);
+    void handle_connection(int fd);
+};
+
+#endif
@@ -7,12 +7,16 @@
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
+#include <malloc.h>
 #endif
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <limits>
 #include <memory>
 #include <string>
+#include <vector>
 #include <mutex>
 
 #include "utils/math_utils.h"
@@ -20,14 +24,13 @@
 #include "raytracer/material.h"
 #include "raytracer/color.h"
 #include "gui/interface.h"
+#include "distributed.h"
 
 using std::make_shared;
 using std::shared_ptr;
 using std::sqrt;
 using std::fabs;
 
-std::mutex renderTargetMutex;
-
 bool initSDL(SDL_Window *&window, SDL_Renderer *&renderer, const char *glsl_version = nullptr)
 {
     // Decide GL+GLSL versions
@@ -60,6 +63,9 @@ bool initSDL(SDL_Window *&window, SDL_Renderer *&renderer, const char *glsl_vers
         return false;
     }
 
+    #ifdef __EMSCRIPTEN__
+    SDL_GL_SetAttribute(SDL_GL_ALPHA_SIZE, 8); // a transparent canvas, the render is on another one under it
+    #endif
     SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
     SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
     SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 8);
@@ -96,48 +102,176 @@ bool initSDL(SDL_Window *&window, SDL_Renderer *&renderer, const char *glsl_vers
     return true;
 }
 
-SDL_Texture *loadTexture(const RenderTarget& renderTarget, SDL_Renderer *renderer)
+// the render shown behind the UI, kept across renders and recreated only when the image size changes
+struct ViewportTexture
 {
-    int width = renderTarget.getWidth();
-    int height = renderTarget.getHeight();
+    SDL_Texture *texture; // null in the browser, which puts the render on a canvas of its own
+    int width;
+    int height;
+    long version; // of the render target it shows
+    std::vector<uint8_t> band; // rgba rows on their way to that canvas
+};
+
+// the rects of frame a viewport showing version at width x height doesn't have yet: only the changed tiles when
+// it shows the frame they changed, the whole frame otherwise
+static std::vector<SDL_Rect> staleRects(const ViewportTexture &viewport, const RenderTarget &frame)
+{
+    bool partial = viewport.width == frame.getWidth() && viewport.height == frame.getHeight() &&
+                   frame.base_version == viewport.version && frame.base_version != 0;
+    if (!partial)
+    {
+        return {SDL_Rect{0, 0, frame.getWidth(), frame.getHeight()}};
+    }
+
+    std::vector<SDL_Rect> rects;
+    for (const Tile &tile : frame.changed_tiles)
+    {
+        rects.push_back(SDL_Rect{tile.x0, tile.y0, tile.x1 - tile.x0, tile.y1 - tile.y0});
+    }
+    return rects;
+}
 
-    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height);
-    if (texture == nullptr)
+#ifdef __EMSCRIPTEN__
+// the viewport canvas sits under the transparent SDL one. The bytes are a view of the heap, putImageData copies
+// them straight into the canvas; the pthreads build's heap is shared memory, which ImageData won't take, so it copies
+EM_JS(void, put_canvas_rgba, (const uint8_t *rgba, int frame_width, int frame_height, int x, int y, int w, int h), {
+    var viewport = document.getElementById('viewport');
+    if (viewport.width != frame_width || viewport.height != frame_height)
     {
-        std::cerr << "SDL_CreateTexture Error: " << SDL_GetError() << std::endl;
-        return nullptr;
+        viewport.width = frame_width;
+        viewport.height = frame_height;
     }
+    var bytes = new Uint8ClampedArray(HEAPU8.buffer, rgba, w * h * 4);
+    if (typeof SharedArrayBuffer !== 'undefined' && bytes.buffer instanceof SharedArrayBuffer)
+        bytes = bytes.slice();
+    viewport.getContext('2d').putImageData(new ImageData(bytes, w, h), x, y);
+});
+
+static const int canvas_band_pixels = 64 * 1024; // converted per putImageData, the band is 256 KB at most
 
+// brings the viewport canvas up to the frame, returns the number of pixels put. No texture and no frame-sized
+// RGBA copy: each stale rect goes through the band a few rows at a time
+size_t updateCanvas(ViewportTexture &viewport, const RenderTarget &frame)
+{
+    int width = frame.getWidth();
+    int height = frame.getHeight();
+    if (width <= 0 || height <= 0)
+    {
+        return 0;
+    }
+
+    std::vector<SDL_Rect> rects = staleRects(viewport, frame);
+    viewport.width = width;
+    viewport.height = height;
+    viewport.version = frame.getVersion();
+
+    size_t put = 0;
+    for (const SDL_Rect &rect : rects)
+    {
+        int band_rows = std::max(1, canvas_band_pixels / rect.w);
+        for (int y = rect.y; y < rect.y + rect.h; y += band_rows)
+        {
+            int rows = std::min(band_rows, rect.y + rect.h - y);
+            viewport.band.resize(size_t(rect.w) * rows * 4);
+            for (int row = 0; row < rows; row++)
+            {
+                colors_to_rgba8(frame.data() + size_t(y + row) * width + rect.x, rect.w, viewport.band.data() + size_t(row) * rect.w * 4);
+            }
+            put_canvas_rgba(viewport.band.data(), width, height, rect.x, y, rect.w, rows);
+        }
+        put += size_t(rect.w) * rect.h;
+    }
+    return put;
+}
+#endif
+
+// converts the rows of rect into the locked texture, gamma encoded like saved images
+static bool uploadRect(SDL_Texture *texture, const RenderTarget &renderTarget, const SDL_Rect &rect)
+{
     void *pixels;
     int pitch;
-    if (SDL_LockTexture(texture, nullptr, &pixels, &pitch) != 0)
+    if (SDL_LockTexture(texture, &rect, &pixels, &pitch) != 0)
     {
         std::cerr << "SDL_LockTexture Error: " << SDL_GetError() << std::endl;
-        return nullptr;
+        return false;
     }
 
-    uint32_t *pixels32 = static_cast<uint32_t *>(pixels);
-    const std::vector<Color>& renderPixels = renderTarget.getPixels();
-    for (int i = 0; i < width * height; ++i)
+    const Color *source = renderTarget.data() + size_t(rect.y) * renderTarget.getWidth() + rect.x;
+    for (int row = 0; row < rect.h; row++)
     {
-        if (i >= renderPixels.size())
+        colors_to_rgba8(source + size_t(row) * renderTarget.getWidth(), rect.w, static_cast<uint8_t *>(pixels) + size_t(row) * pitch);
+    }
+
+    SDL_UnlockTexture(texture);
+    return true;
+}
+
+// brings the texture up to the render target, only the changed tiles when it already shows the frame they changed.
+// Returns the number of pixels uploaded
+size_t updateTexture(ViewportTexture &viewport, const RenderTarget &renderTarget, SDL_Renderer *renderer)
+{
+    int width = renderTarget.getWidth();
+    int height = renderTarget.getHeight();
+    if (width <= 0 || height <= 0)
+    {
+        return 0;
+    }
+
+    std::vector<SDL_Rect> rects = viewport.texture != nullptr ? staleRects(viewport, renderTarget) : std::vector<SDL_Rect>{{0, 0, width, height}};
+    if (viewport.texture == nullptr || viewport.width != width || viewport.height != height)
+    {
+        if (viewport.texture != nullptr)
+        {
+            SDL_DestroyTexture(viewport.texture);
+        }
+        viewport.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, width, height);
+        if (viewport.texture == nullptr)
         {
-            std::cerr << "Index out of bounds: " << i << std::endl;
-            break;
+            std::cerr << "SDL_CreateTexture Error: " << SDL_GetError() << std::endl;
+            return 0;
         }
+        viewport.width = width;
+        viewport.height = height;
+    }
+    viewport.version = renderTarget.getVersion();
 
-        Color pixel = renderPixels[i];
-        pixels32[i] = SDL_MapRGBA(SDL_AllocFormat(SDL_PIXELFORMAT_RGBA8888), 
-                                  static_cast<uint8_t>(pixel.x() * 255.999), 
-                                  static_cast<uint8_t>(pixel.y() * 255.999), 
-                                  static_cast<uint8_t>(pixel.z() * 255.999), 
-                                  255);
+    size_t uploaded = 0;
+    for (const SDL_Rect &rect : rects)
+    {
+        if (uploadRect(viewport.texture, renderTarget, rect))
+        {
+            uploaded += size_t(rect.w) * rect.h;
+        }
     }
+    return uploaded;
+}
 
-    SDL_UnlockTexture(texture);
+// the per-pixel cost of the frame as a translucent overlay, rebuilt when the frame changes
+static void updateHeatmap(ViewportTexture &heatmap, const RenderTarget &frame, SDL_Renderer *renderer)
+{
+    const RenderStats &stats = *frame.stats;
+    if (heatmap.texture == nullptr || heatmap.width != stats.width || heatmap.height != stats.height)
+    {
+        if (heatmap.texture != nullptr)
+        {
+            SDL_DestroyTexture(heatmap.texture);
+        }
+        heatmap.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, stats.width, stats.height);
+        if (heatmap.texture == nullptr)
+        {
+            std::cerr << "SDL_CreateTexture Error: " << SDL_GetError() << std::endl;
+            return;
+        }
+        SDL_SetTextureBlendMode(heatmap.texture, SDL_BLENDMODE_BLEND);
+        heatmap.width = stats.width;
+        heatmap.height = stats.height;
+    }
 
-    return texture;
+    std::vector<uint8_t> rgba = stats.cost_heatmap(180);
+    SDL_UpdateTexture(heatmap.texture, nullptr, rgba.data(), stats.width * 4);
+    heatmap.version = frame.getVersion();
 }
+
 struct MainLoopArgs {
     Uint32 frameStart;
     int frameTime;
@@ -145,9 +279,9 @@ struct MainLoopArgs {
     bool done;
     SDL_Renderer *renderer;
     RayTracerInterface *rayTracerInterface;
-    SDL_Texture *background_texture;
+    ViewportTexture background_texture;
+    ViewportTexture heatmap_texture;
     SDL_Rect &background_rectangle;
-    RenderTarget *renderTarget;
 };
 
 void mainLoop(void *arg)
@@ -159,11 +293,9 @@ void mainLoop(void *arg)
     int frameDelay = args->frameDelay;
     SDL_Renderer *renderer = args->renderer;
     RayTracerInterface &rayTracerInterface = *args->rayTracerInterface;
-    SDL_Texture *&background_texture = args->background_texture; // Reference to the texture
+    ViewportTexture &background_texture = args->background_texture;
+    ViewportTexture &heatmap_texture = args->heatmap_texture;
     SDL_Rect &background_rectangle = args->background_rectangle;
-    RenderTarget *renderTarget = args->renderTarget;
-
-    static std::string previousIdentifier;
 
     frameStart = SDL_GetTicks64();
 
@@ -187,32 +319,55 @@ void mainLoop(void *arg)
     ImGui::SetNextWindowPos(windowPos, ImGuiCond_Once);
     ImGui::SetNextWindowBgAlpha(0.8f);
 
-    rayTracerInterface.ShowMainWindow(background_rectangle, *renderTarget);
+    rayTracerInterface.ShowMainWindow(background_rectangle);
 
     ImGui::Render();
 
+    #ifdef __EMSCRIPTEN__
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0); // the viewport canvas underneath shows through
+    #else
     SDL_SetRenderDrawColor(renderer, 70, 80, 90, 255);
+    #endif
     SDL_RenderClear(renderer);
 
+    // every render publishes a new front frame, previews included; reading it never waits on the render threads
+    if (rayTracerInterface.scene.frames->version() != background_texture.version)
     {
-        std::lock_guard<std::mutex> lock(renderTargetMutex);
-        if (renderTarget != nullptr && renderTarget->getIdentifier() != previousIdentifier)
-        {
-            std::clog << "Updating texture" << std::endl;
-
-            previousIdentifier = renderTarget->getIdentifier();
-            if (background_texture != nullptr)
-            {
-                SDL_DestroyTexture(background_texture);
-            }
+        std::shared_ptr<const RenderTarget> front = rayTracerInterface.scene.getRenderTarget();
+        Uint64 upload_start = SDL_GetPerformanceCounter();
+        #ifdef __EMSCRIPTEN__
+        size_t uploaded = updateCanvas(background_texture, *front);
+        #else
+        size_t uploaded = updateTexture(background_texture, *front, renderer);
+        #endif
+        rayTracerInterface.texture_upload_ms = 1000.0 * (SDL_GetPerformanceCounter() - upload_start) / SDL_GetPerformanceFrequency();
+        rayTracerInterface.texture_upload_pixels = uploaded;
+        #ifdef __EMSCRIPTEN__
+        // dlmalloc's high water mark, what counts against TOTAL_MEMORY
+        rayTracerInterface.heap_peak_bytes = size_t(mallinfo().usmblks);
+        #endif
+    }
 
-            background_texture = loadTexture(*renderTarget, renderer);
-        }
+    if (background_texture.texture != nullptr)
+    {
+        SDL_RenderCopy(renderer, background_texture.texture, NULL, &background_rectangle); // Copy the entire texture to the entire rendering target
     }
 
-    if (background_texture != nullptr)
+    if (rayTracerInterface.show_heatmap)
     {
-        SDL_RenderCopy(renderer, background_texture, NULL, &background_rectangle); // Copy the entire texture to the entire rendering target
+        // previews aren't measured, the overlay only goes over the frame its cost belongs to
+        std::shared_ptr<const RenderTarget> front = rayTracerInterface.scene.getRenderTarget();
+        if (front->stats && !front->stats->cost.empty())
+        {
+            if (front->getVersion() != heatmap_texture.version)
+            {
+                updateHeatmap(heatmap_texture, *front, renderer);
+            }
+            if (heatmap_texture.texture != nullptr)
+            {
+                SDL_RenderCopy(renderer, heatmap_texture.texture, NULL, &background_rectangle);
+            }
+        }
     }
 
     ImGui_ImplSDLRenderer2_RenderDrawData(ImGui::GetDrawData(), renderer);
@@ -227,8 +382,15 @@ void mainLoop(void *arg)
     }
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    // headless tile worker for distributed renders, no window needed
+    if (argc >= 3 && std::string(argv[1]) == "--worker")
+    {
+        bool bind = argc >= 5 && std::string(argv[3]) == "--bind";
+        return run_tile_worker(std::atoi(argv[2]), bind ? argv[4] : "127.0.0.1");
+    }
+
     SDL_Window *window = nullptr;
     SDL_Renderer *renderer = nullptr;
     const char *glsl_version = nullptr;
@@ -270,12 +432,12 @@ int main()
     background_rectangle.h = 900;
     #endif
 
-    SDL_Texture *background_texture = nullptr;
-    RenderTarget *renderTarget = new RenderTarget(std::vector<Color>(), 0, 0);
+    ViewportTexture background_texture = {nullptr, 0, 0, 0};
 
-    Scene scene = Scene(renderTarget, background_rectangle.w, background_rectangle.h).init();
+    Scene scene = Scene(background_rectangle.w, background_rectangle.h).init();
 
     RayTracerInterface rayTracerInterface(scene);
+    rayTracerInterface.frame_budget_ms = frameDelay;
 
     MainLoopArgs args = {
         .frameStart = 0,
@@ -285,8 +447,8 @@ int main()
         .renderer = renderer,
         .rayTracerInterface = &rayTracerInterface,
         .background_texture = background_texture,
+        .heatmap_texture = {nullptr, 0, 0, 0},
         .background_rectangle = background_rectangle,
-        .renderTarget = renderTarget,
     };
 
     #ifdef __EMSCRIPTEN__
@@ -302,7 +464,14 @@ int main()
     ImGui_ImplSDL2_Shutdown();
     ImGui::DestroyContext();
 
-    SDL_DestroyTexture(background_texture);
+    if (args.background_texture.texture != nullptr)
+    {
+        SDL_DestroyTexture(args.background_texture.texture);
+    }
+    if (args.heatmap_texture.texture != nullptr)
+    {
+        SDL_DestroyTexture(args.heatmap_texture.texture);
+    }
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
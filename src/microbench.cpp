@@ -0,0 +1,483 @@
+// microbenchmarks of the hot kernels in isolation. Each case is calibrated to batches of at least --min-batch-ms,
+// warmed up, then timed over --repetitions batches; the median time per call, its median absolute deviation and the
+// cycles per call go to stdout as one JSON line per case
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "raytracer/camera.h"
+#include "raytracer/hittable.h"
+#include "raytracer/material.h"
+#include "raytracer/renderTarget.h"
+#include "raytracer/world.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_CYCLE_COUNTER 1
+#endif
+
+static const size_t pool_size = 1024; // inputs per case, cycled through: small enough to stay in cache
+
+#pragma region harness
+struct Kernel
+{
+    std::string name;
+    std::string params; // a JSON object
+    std::function<double(size_t calls)> run; // returns something derived from every call, so none are optimized away
+};
+
+struct Options
+{
+    std::string filter;
+    int repetitions;
+    double min_batch_ms;
+    double warmup_ms;
+};
+
+struct Result
+{
+    double ns_per_call;
+    double mad_ns;
+    double cycles_per_call; // negative without a cycle counter
+    size_t calls_per_batch;
+};
+
+static volatile double sink;
+
+static uint64_t read_cycles()
+{
+#ifdef HAS_CYCLE_COUNTER
+    return __rdtsc(); // reference cycles at the nominal clock, not the boosted one
+#else
+    return 0;
+#endif
+}
+
+static double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    size_t middle = values.size() / 2;
+    return values.size() % 2 == 1 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+static Result measure(const Kernel &kernel, const Options &options)
+{
+    typedef std::chrono::steady_clock clock;
+
+    // doubling the calls until a batch is long enough to time also warms up caches and branch predictors
+    size_t calls = 1;
+    for (;;)
+    {
+        clock::time_point start = clock::now();
+        sink = sink + kernel.run(calls);
+        double ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        if (ms >= options.min_batch_ms || calls >= (size_t(1) << 32))
+            break;
+        calls *= ms <= 0 ? 16 : std::min<size_t>(16, std::max<size_t>(2, size_t(options.min_batch_ms / ms * 1.2)));
+    }
+
+    clock::time_point warmup_start = clock::now();
+    while (std::chrono::duration<double, std::milli>(clock::now() - warmup_start).count() < options.warmup_ms)
+        sink = sink + kernel.run(calls);
+
+    std::vector<double> ns, cycles;
+    for (int r = 0; r < options.repetitions; r++)
+    {
+        uint64_t cycles_start = read_cycles();
+        clock::time_point start = clock::now();
+        sink = sink + kernel.run(calls);
+        clock::time_point end = clock::now();
+        uint64_t cycles_end = read_cycles();
+        ns.push_back(std::chrono::duration<double, std::nano>(end - start).count() / double(calls));
+        cycles.push_back(double(cycles_end - cycles_start) / double(calls));
+    }
+
+    Result result;
+    result.ns_per_call = median(ns);
+    std::vector<double> deviations;
+    for (double value : ns)
+        deviations.push_back(std::fabs(value - result.ns_per_call));
+    result.mad_ns = median(deviations);
+#ifdef HAS_CYCLE_COUNTER
+    result.cycles_per_call = median(cycles);
+#else
+    result.cycles_per_call = -1;
+#endif
+    result.calls_per_batch = calls;
+    return result;
+}
+#pragma endregion
+
+#pragma region inputs
+static Ray ray_towards(const Point3d &origin, const Point3d &target)
+{
+    return Ray(origin, unit_vector(target - origin));
+}
+
+// rays from 10 units away at a unit sphere in the origin, hit_ratio of them through it and the rest passing it by
+static std::vector<Ray> sphere_rays(double hit_ratio)
+{
+    std::vector<Ray> rays;
+    for (size_t k = 0; k < pool_size; k++)
+    {
+        Point3d origin = 10 * Vector3d::random_unit_vector();
+        Point3d target;
+        if (random_double() < hit_ratio)
+        {
+            target = 0.9 * Vector3d::random_in_unit_sphere();
+        }
+        else
+        {
+            // off to the side across the line of sight, the ray passes the center at more than 1.4
+            Vector3d side = unit_vector(cross(origin, Vector3d::random_unit_vector()));
+            target = random_double(1.5, 3.0) * side;
+        }
+        rays.push_back(ray_towards(origin, target));
+    }
+    return rays;
+}
+
+// count spheres in a cube that grows with them, so they fill the same share of it at every count
+static void fill_world(World &world, int count, shared_ptr<IMaterial> material, double &half_side)
+{
+    half_side = 2 * std::cbrt(double(count));
+    for (int s = 0; s < count; s++)
+    {
+        Point3d center = Vector3d::random(-half_side, half_side);
+        world.add(HittableFactory::createSphere("sphere_" + std::to_string(s), center, 0.5, material));
+    }
+    world.updateBvh();
+}
+
+// surface points to scatter from, with the incoming ray arriving against the normal
+static void scatter_inputs(bool front_face, std::vector<Ray> &rays, std::vector<HitRecord> &records, shared_ptr<IMaterial> material)
+{
+    for (size_t k = 0; k < pool_size; k++)
+    {
+        HitRecord record;
+        record.p = Vector3d::random(-1, 1);
+        Vector3d outwards = Vector3d::random_unit_vector();
+        Vector3d direction = Vector3d::random_on_hemisphere(front_face ? -outwards : outwards);
+        Ray ray(record.p - direction, direction);
+        record.set_face_normal(ray, outwards);
+        record.t = 1;
+        record.material = material;
+        record.object = nullptr;
+        rays.push_back(ray);
+        records.push_back(record);
+    }
+}
+
+// a gradient with noise, compresses about as well as a render
+static FramePixels test_image(int width, int height)
+{
+    FramePixels pixels;
+    for (int j = 0; j < height; j++)
+    {
+        for (int i = 0; i < width; i++)
+        {
+            double noise = random_double(-0.05, 0.05);
+            pixels.push_back(Color(double(i) / width + noise, double(j) / height + noise, 0.5 + noise));
+        }
+    }
+    return pixels;
+}
+#pragma endregion
+
+#pragma region kernels
+static void add_vector_kernels(std::vector<Kernel> &kernels)
+{
+    std::shared_ptr<std::vector<Vector3d>> vectors = std::make_shared<std::vector<Vector3d>>();
+    for (size_t k = 0; k < pool_size; k++)
+        vectors->push_back(Vector3d::random(-1, 1));
+
+    kernels.push_back(Kernel{"vector3d_add_scale", "{}", [vectors](size_t calls)
+                             {
+                                 Vector3d sum;
+                                 for (size_t c = 0; c < calls; c++)
+                                     sum += (*vectors)[c % pool_size] + 0.5 * (*vectors)[(c + 1) % pool_size];
+                                 return sum.x();
+                             }});
+    kernels.push_back(Kernel{"vector3d_dot", "{}", [vectors](size_t calls)
+                             {
+                                 double sum = 0;
+                                 for (size_t c = 0; c < calls; c++)
+                                     sum += dot((*vectors)[c % pool_size], (*vectors)[(c + 1) % pool_size]);
+                                 return sum;
+                             }});
+    kernels.push_back(Kernel{"vector3d_cross", "{}", [vectors](size_t calls)
+                             {
+                                 Vector3d sum;
+                                 for (size_t c = 0; c < calls; c++)
+                                     sum += cross((*vectors)[c % pool_size], (*vectors)[(c + 1) % pool_size]);
+                                 return sum.x();
+                             }});
+    kernels.push_back(Kernel{"vector3d_unit_vector", "{}", [vectors](size_t calls)
+                             {
+                                 Vector3d sum;
+                                 for (size_t c = 0; c < calls; c++)
+                                     sum += unit_vector((*vectors)[c % pool_size]);
+                                 return sum.x();
+                             }});
+    kernels.push_back(Kernel{"random_unit_vector", "{}", [](size_t calls)
+                             {
+                                 Vector3d sum;
+                                 for (size_t c = 0; c < calls; c++)
+                                     sum += Vector3d::random_unit_vector();
+                                 return sum.x();
+                             }});
+}
+
+static void add_hit_kernels(std::vector<Kernel> &kernels, const std::vector<double> &hit_ratios, const std::vector<int> &object_counts)
+{
+    shared_ptr<IMaterial> material = MaterialFactory::createLambertian("matte", Color(0.5, 0.5, 0.5));
+    shared_ptr<IHittable> sphere = HittableFactory::createSphere("sphere", Point3d(0, 0, 0), 1, material);
+
+    for (double hit_ratio : hit_ratios)
+    {
+        std::shared_ptr<std::vector<Ray>> rays = std::make_shared<std::vector<Ray>>(sphere_rays(hit_ratio));
+        std::ostringstream params;
+        params << "{\"hit_ratio\":" << hit_ratio << "}";
+        kernels.push_back(Kernel{"sphere3d_hit", params.str(), [sphere, rays](size_t calls)
+                                 {
+                                     HitRecord record;
+                                     double hits = 0;
+                                     for (size_t c = 0; c < calls; c++)
+                                         hits += sphere->hit((*rays)[c % pool_size], Interval(0.001, infinity), record) ? 1 : 0;
+                                     return hits;
+                                 }});
+    }
+
+    for (int count : object_counts)
+    {
+        std::shared_ptr<World> world = std::make_shared<World>();
+        double half_side;
+        fill_world(*world, count, material, half_side);
+
+        // from outside the cube at points inside it, how many of them hit follows from the count
+        std::shared_ptr<std::vector<Ray>> rays = std::make_shared<std::vector<Ray>>();
+        int hits = 0;
+        for (size_t k = 0; k < pool_size; k++)
+        {
+            Ray ray = ray_towards(4 * half_side * Vector3d::random_unit_vector(), Vector3d::random(-half_side, half_side));
+            HitRecord record;
+            hits += world->hit(ray, Interval(0.001, infinity), record) ? 1 : 0;
+            rays->push_back(ray);
+        }
+
+        std::ostringstream params;
+        params << "{\"objects\":" << count << ",\"hit_ratio\":" << double(hits) / pool_size << "}";
+        kernels.push_back(Kernel{"world_hit", params.str(), [world, rays](size_t calls)
+                                 {
+                                     HitRecord record;
+                                     double hits = 0;
+                                     for (size_t c = 0; c < calls; c++)
+                                         hits += world->hit((*rays)[c % pool_size], Interval(0.001, infinity), record) ? 1 : 0;
+                                     return hits;
+                                 }});
+    }
+}
+
+static void add_scatter_kernel(std::vector<Kernel> &kernels, const std::string &name, const std::string &params,
+                               shared_ptr<IMaterial> material, bool front_face)
+{
+    std::shared_ptr<std::vector<Ray>> rays = std::make_shared<std::vector<Ray>>();
+    std::shared_ptr<std::vector<HitRecord>> records = std::make_shared<std::vector<HitRecord>>();
+    scatter_inputs(front_face, *rays, *records, material);
+    kernels.push_back(Kernel{name, params, [material, rays, records](size_t calls)
+                             {
+                                 Color attenuation;
+                                 Ray scattered;
+                                 double sum = 0;
+                                 for (size_t c = 0; c < calls; c++)
+                                 {
+                                     if (material->scatter((*rays)[c % pool_size], (*records)[c % pool_size], attenuation, scattered))
+                                         sum += scattered.direction().x();
+                                 }
+                                 return sum;
+                             }});
+}
+
+static void add_camera_kernels(std::vector<Kernel> &kernels)
+{
+    for (double defocus_angle : {0.0, 0.6})
+    {
+        std::shared_ptr<Camera> camera = std::make_shared<Camera>(16, 9);
+        camera->image_width = 1920;
+        camera->defocus_angle = defocus_angle;
+        camera->focus_distance = 10;
+        camera->plan_tiles();
+
+        std::ostringstream params;
+        params << "{\"defocus_angle\":" << defocus_angle << "}";
+        kernels.push_back(Kernel{"camera_get_ray", params.str(), [camera](size_t calls)
+                                 {
+                                     double sum = 0;
+                                     int width = camera->image_width, height = camera->image_height;
+                                     for (size_t c = 0; c < calls; c++)
+                                     {
+                                         int i = int(c % size_t(width)), j = int(c / size_t(width) % size_t(height));
+                                         sum += camera->get_ray(i, j).direction().y();
+                                     }
+                                     return sum;
+                                 }});
+    }
+}
+
+static void add_png_kernels(std::vector<Kernel> &kernels, const std::string &png_file)
+{
+    static const int sizes[][2] = {{256, 144}, {1920, 1080}};
+    for (const int *size : sizes)
+    {
+        std::shared_ptr<RenderTarget> target = std::make_shared<RenderTarget>(test_image(size[0], size[1]), size[0], size[1]);
+        std::ostringstream params;
+        params << "{\"width\":" << size[0] << ",\"height\":" << size[1] << "}";
+        kernels.push_back(Kernel{"png_to_memory", params.str(), [target](size_t calls)
+                                 {
+                                     double bytes = 0;
+                                     for (size_t c = 0; c < calls; c++)
+                                         bytes += double(target->save_png_to_memory().size());
+                                     return bytes;
+                                 }});
+        kernels.push_back(Kernel{"png_to_file", params.str(), [target, png_file](size_t calls)
+                                 {
+                                     double written = 0;
+                                     for (size_t c = 0; c < calls; c++)
+                                         written += target->save_png_to_file(png_file) ? 1 : 0;
+                                     return written;
+                                 }});
+    }
+}
+#pragma endregion
+
+// a comma separated list of numbers
+static bool parse_list(const std::string &list, std::vector<double> &values)
+{
+    values.clear();
+    std::stringstream stream(list);
+    std::string value;
+    while (std::getline(stream, value, ','))
+    {
+        char *end = nullptr;
+        values.push_back(std::strtod(value.c_str(), &end));
+        if (end == value.c_str() || *end != '\0')
+            return false;
+    }
+    return !values.empty();
+}
+
+static void print_usage()
+{
+    std::cerr << "usage: raytracer-microbench [options]\n"
+              << "  --filter TEXT        only the kernels whose name contains TEXT\n"
+              << "  --hit-ratios LIST    sphere3d_hit inputs, fractions of rays that hit (0,0.5,1)\n"
+              << "  --objects LIST       world_hit sphere counts (1,64,4096,262144)\n"
+              << "  --repetitions N      timed batches per kernel (21)\n"
+              << "  --min-batch-ms MS    shortest timed batch (5)\n"
+              << "  --warmup-ms MS       untimed batches first (100)\n"
+              << "  --seed N             seed for the inputs and the samples (1)\n"
+              << "  --png-file FILE      where png_to_file writes, removed at the end (microbench.png)\n";
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    options.repetitions = 21;
+    options.min_batch_ms = 5;
+    options.warmup_ms = 100;
+    std::vector<double> hit_ratios = {0, 0.5, 1};
+    std::vector<double> object_counts = {1, 64, 4096, 262144};
+    unsigned int seed = 1;
+    std::string png_file = "microbench.png";
+
+    for (int a = 1; a < argc; a++)
+    {
+        std::string option = argv[a];
+        if (option == "--help" || option == "-h")
+        {
+            print_usage();
+            return 0;
+        }
+        if (a + 1 >= argc)
+        {
+            print_usage();
+            return 1;
+        }
+
+        std::string value = argv[++a];
+        bool valid = true;
+        if (option == "--filter")
+            options.filter = value;
+        else if (option == "--hit-ratios")
+            valid = parse_list(value, hit_ratios);
+        else if (option == "--objects")
+            valid = parse_list(value, object_counts);
+        else if (option == "--repetitions")
+            valid = (options.repetitions = std::atoi(value.c_str())) > 0;
+        else if (option == "--min-batch-ms")
+            valid = (options.min_batch_ms = std::atof(value.c_str())) > 0;
+        else if (option == "--warmup-ms")
+            valid = (options.warmup_ms = std::atof(value.c_str())) >= 0;
+        else if (option == "--seed")
+            seed = static_cast<unsigned int>(std::strtoul(value.c_str(), nullptr, 10));
+        else if (option == "--png-file")
+            png_file = value;
+        else
+            valid = false;
+
+        if (!valid)
+        {
+            std::cerr << "bad option " << option << " " << value << "\n";
+            print_usage();
+            return 1;
+        }
+    }
+
+    std::vector<int> counts;
+    for (double count : object_counts)
+        counts.push_back(std::max(1, int(count)));
+
+    // every input is drawn from the seed, in the same order each run
+    std::srand(seed);
+    std::vector<Kernel> kernels;
+    add_vector_kernels(kernels);
+    add_hit_kernels(kernels, hit_ratios, counts);
+    add_scatter_kernel(kernels, "lambertian_scatter", "{}", MaterialFactory::createLambertian("matte", Color(0.5, 0.5, 0.5)), true);
+    add_scatter_kernel(kernels, "metal_scatter", "{\"fuzz\":0}", MaterialFactory::createMetal("mirror", Color(0.9, 0.9, 0.9), 0), true);
+    add_scatter_kernel(kernels, "metal_scatter", "{\"fuzz\":0.3}", MaterialFactory::createMetal("brushed", Color(0.9, 0.9, 0.9), 0.3), true);
+    add_scatter_kernel(kernels, "dielectric_scatter", "{\"front_face\":true}", MaterialFactory::createDielectric("glass", Color(1, 1, 1), 1.5), true);
+    add_scatter_kernel(kernels, "dielectric_scatter", "{\"front_face\":false}", MaterialFactory::createDielectric("glass", Color(1, 1, 1), 1.5), false);
+    add_camera_kernels(kernels);
+    add_png_kernels(kernels, png_file);
+
+    bool wrote_png = false;
+    for (const Kernel &kernel : kernels)
+    {
+        if (kernel.name.find(options.filter) == std::string::npos)
+            continue;
+
+        Result result = measure(kernel, options);
+        wrote_png |= kernel.name == "png_to_file";
+        std::cout << "{\"kernel\":\"" << kernel.name << "\",\"params\":" << kernel.params
+                  << ",\"ns_per_call\":" << result.ns_per_call << ",\"mad_ns\":" << result.mad_ns << ",\"cycles_per_call\":";
+        if (result.cycles_per_call < 0)
+            std::cout << "null";
+        else
+            std::cout << result.cycles_per_call;
+        std::cout << ",\"calls_per_batch\":" << result.calls_per_batch << ",\"repetitions\":" << options.repetitions << "}" << std::endl;
+    }
+
+    if (wrote_png)
+        std::remove(png_file.c_str());
+    return 0;
+}
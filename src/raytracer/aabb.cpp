@@ -0,0 +1,89 @@
+#include "aabb.h"
+
+#include <utility>
+
+AABB::AABB() : x(Interval::empty), y(Interval::empty), z(Interval::empty) {}
+
+AABB::AABB(const Interval &x, const Interval &y, const Interval &z) : x(x), y(y), z(z) {}
+
+AABB::AABB(const Point3d &a, const Point3d &b)
+    : x(fmin(a[0], b[0]), fmax(a[0], b[0])),
+      y(fmin(a[1], b[1]), fmax(a[1], b[1])),
+      z(fmin(a[2], b[2]), fmax(a[2], b[2]))
+{
+}
+
+AABB::AABB(const AABB &a, const AABB &b)
+    : x(Interval(a.x, b.x)),
+      y(Interval(a.y, b.y)),
+      z(Interval(a.z, b.z))
+{
+}
+
+const Interval &AABB::axis_interval(int n) const
+{
+    if (n == 1)
+        return y;
+    if (n == 2)
+        return z;
+    return x;
+}
+
+bool AABB::is_empty() const
+{
+    return x.min > x.max || y.min > y.max || z.min > z.max;
+}
+
+Point3d AABB::corner(int i) const
+{
+    return Point3d((i & 1) ? x.max : x.min,
+                   (i & 2) ? y.max : y.min,
+                   (i & 4) ? z.max : z.min);
+}
+
+Point3d AABB::center() const
+{
+    return Point3d(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
+}
+
+double AABB::longest_extent() const
+{
+    return fmax(x.size(), fmax(y.size(), z.size()));
+}
+
+int AABB::longest_axis() const
+{
+    if (x.size() >= y.size())
+        return x.size() >= z.size() ? 0 : 2;
+    return y.size() >= z.size() ? 1 : 2;
+}
+
+double AABB::surface_area() const
+{
+    if (is_empty())
+        return 0;
+    return 2 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+}
+
+bool AABB::hit(const Ray &r, Interval ray_t) const
+{
+    const Point3d &origin = r.origin();
+    const Vector3d &direction = r.direction();
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const Interval &slab = axis_interval(axis);
+        double inverse = 1.0 / direction[axis];
+
+        double t0 = (slab.min - origin[axis]) * inverse;
+        double t1 = (slab.max - origin[axis]) * inverse;
+        if (t0 > t1)
+            std::swap(t0, t1);
+
+        ray_t.min = fmax(t0, ray_t.min);
+        ray_t.max = fmin(t1, ray_t.max);
+        if (ray_t.max <= ray_t.min)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "vector3d.h"
+#include "ray.h"
+#include "../utils/math_utils.h"
+
+// axis-aligned bounding box, one interval per axis
+class AABB
+{
+public:
+    Interval x, y, z;
+
+    AABB(); // empty box
+    AABB(const Interval &x, const Interval &y, const Interval &z);
+    AABB(const Point3d &a, const Point3d &b);
+    AABB(const AABB &a, const AABB &b); // union of both boxes
+
+    const Interval &axis_interval(int n) const;
+    bool is_empty() const;
+    Point3d corner(int i) const; // i in [0, 8)
+    Point3d center() const;
+    double longest_extent() const;
+    int longest_axis() const;
+    double surface_area() const;
+    bool hit(const Ray &r, Interval ray_t) const; // slab test, true when the ray enters the box within ray_t
+};
+
+#endif
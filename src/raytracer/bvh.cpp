@@ -0,0 +1,199 @@
+#include "bvh.h"
+#include "render_stats.h"
+#include "../utils/cpu_topology.h"
+
+#include <algorithm>
+
+static const int max_leaf_objects = 2;
+static const double rebuild_area_factor = 2; // refitted trees this much looser than built ones get rebuilt
+
+BVH::BVH() : built_area(0) {}
+
+void BVH::build(const std::vector<shared_ptr<IHittable>> &objects)
+{
+    this->objects = objects;
+    nodes.clear();
+    if (objects.empty())
+    {
+        built_area = 0;
+        return;
+    }
+
+    nodes.reserve(2 * objects.size());
+    std::vector<AABB> boxes;
+    boxes.reserve(objects.size());
+    for (const shared_ptr<IHittable> &object : objects)
+    {
+        boxes.push_back(object->bounding_box());
+    }
+
+    build_node(boxes, 0, static_cast<int>(objects.size()));
+    built_area = total_area();
+}
+
+// median split of the object centers along the longest axis of their spread
+int BVH::build_node(std::vector<AABB> &boxes, int first, int count)
+{
+    int index = static_cast<int>(nodes.size());
+    nodes.push_back(Node{AABB(), 0, first, count});
+
+    AABB bounds, centers;
+    for (int k = first; k < first + count; k++)
+    {
+        bounds = AABB(bounds, boxes[k]);
+        Point3d center = boxes[k].center();
+        centers = AABB(centers, AABB(center, center));
+    }
+    nodes[index].bounds = bounds;
+
+    if (count <= max_leaf_objects)
+        return index;
+
+    int axis = centers.longest_axis();
+    int middle = first + count / 2;
+
+    // sort objects and their boxes together through a permutation
+    std::vector<int> order(count);
+    for (int k = 0; k < count; k++)
+        order[k] = first + k;
+    std::nth_element(order.begin(), order.begin() + (middle - first), order.end(), [&](int a, int b)
+                     { return boxes[a].center()[axis] < boxes[b].center()[axis]; });
+
+    std::vector<AABB> sorted_boxes(count);
+    std::vector<shared_ptr<IHittable>> sorted_objects(count);
+    for (int k = 0; k < count; k++)
+    {
+        sorted_boxes[k] = boxes[order[k]];
+        sorted_objects[k] = objects[order[k]];
+    }
+    std::copy(sorted_boxes.begin(), sorted_boxes.end(), boxes.begin() + first);
+    std::copy(sorted_objects.begin(), sorted_objects.end(), objects.begin() + first);
+
+    nodes[index].count = 0;
+    build_node(boxes, first, middle - first);
+    int right = build_node(boxes, middle, first + count - middle);
+    nodes[index].right = right;
+    return index;
+}
+
+bool BVH::refit()
+{
+    // children come after their parent, so walking backwards sees them first
+    for (int index = static_cast<int>(nodes.size()) - 1; index >= 0; index--)
+    {
+        Node &node = nodes[index];
+        if (node.count > 0)
+        {
+            AABB bounds;
+            for (int k = node.first; k < node.first + node.count; k++)
+            {
+                bounds = AABB(bounds, objects[k]->bounding_box());
+            }
+            node.bounds = bounds;
+        }
+        else
+        {
+            node.bounds = AABB(nodes[index + 1].bounds, nodes[node.right].bounds);
+        }
+    }
+    return total_area() <= rebuild_area_factor * built_area;
+}
+
+void BVH::clear()
+{
+    nodes.clear();
+    objects.clear();
+    built_area = 0;
+}
+
+void BVH::assign(const BVH &source, const std::function<shared_ptr<IHittable>(const IHittable *)> &copy_of)
+{
+    nodes = source.nodes;
+    built_area = source.built_area;
+    objects.clear();
+    objects.reserve(source.objects.size());
+    for (const shared_ptr<IHittable> &object : source.objects)
+    {
+        objects.push_back(copy_of(object.get()));
+    }
+}
+
+bool BVH::empty() const
+{
+    return nodes.empty();
+}
+
+void BVH::advise_huge_pages() const
+{
+    ::advise_huge_pages(const_cast<Node *>(nodes.data()), nodes.size() * sizeof(Node));
+    ::advise_huge_pages(const_cast<shared_ptr<IHittable> *>(objects.data()), objects.size() * sizeof(shared_ptr<IHittable>));
+}
+
+double BVH::total_area() const
+{
+    double area = 0;
+    for (const Node &node : nodes)
+    {
+        area += node.bounds.surface_area();
+    }
+    return area;
+}
+
+bool BVH::hit(const Ray &r, Interval ray_t, HitRecord &record) const
+{
+    if (nodes.empty())
+        return false;
+
+    HitRecord temp_rec;
+    bool hit_anything = false;
+    int stack[64]; // median splits keep the depth near log2 of the object count
+    int depth = 0;
+    stack[depth++] = 0;
+    uint64_t box_tests = 0, primitive_tests = 0; // into trace_counters once, not per node
+
+    while (depth > 0)
+    {
+        const Node &node = nodes[stack[--depth]];
+        box_tests++;
+        if (!node.bounds.hit(r, ray_t))
+            continue;
+
+        if (node.count > 0)
+        {
+            primitive_tests += node.count;
+            for (int k = node.first; k < node.first + node.count; k++)
+            {
+                if (objects[k]->hit(r, ray_t, temp_rec))
+                {
+                    hit_anything = true;
+                    ray_t.max = temp_rec.t; // only closer hits from here on
+                    record = temp_rec;
+                }
+            }
+        }
+        else
+        {
+            int left = static_cast<int>(&node - nodes.data()) + 1;
+            stack[depth++] = node.right;
+            stack[depth++] = left;
+        }
+    }
+    trace_counters.box_tests += box_tests;
+    trace_counters.primitive_tests += primitive_tests;
+    return hit_anything;
+}
+
+AABB BVH::bounding_box() const
+{
+    return nodes.empty() ? AABB() : nodes[0].bounds;
+}
+
+const std::vector<BVH::Node> &BVH::node_list() const
+{
+    return nodes;
+}
+
+const std::vector<shared_ptr<IHittable>> &BVH::leaf_objects() const
+{
+    return objects;
+}
@@ -0,0 +1,54 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "hittable.h"
+#include "aabb.h"
+
+#include <vector>
+#include <memory>
+#include <functional>
+using std::shared_ptr;
+
+// bounding volume hierarchy over a fixed set of objects.
+// Moved objects only need refit(), added or removed ones need a new build()
+class BVH
+{
+public:
+    // nodes are stored depth first, so an inner node's left child follows it
+    struct Node
+    {
+        AABB bounds;
+        int right; // inner nodes: index of the right child
+        int first; // leaves: first object
+        int count; // leaves: number of objects, 0 for inner nodes
+    };
+
+    BVH();
+
+    void build(const std::vector<shared_ptr<IHittable>> &objects);
+    // recomputes the node bounds bottom-up from the objects' current boxes and keeps the tree.
+    // Returns false when the objects moved so far that the tree is worth building again
+    bool refit();
+    void clear();
+    bool empty() const;
+    void advise_huge_pages() const; // for the node and object arrays
+    // source's tree over copies of its objects, copy_of maps each object to its copy
+    void assign(const BVH &source, const std::function<shared_ptr<IHittable>(const IHittable *)> &copy_of);
+
+    bool hit(const Ray &r, Interval ray_t, HitRecord &record) const;
+    AABB bounding_box() const;
+
+    // the built tree, for writing it out
+    const std::vector<Node> &node_list() const;
+    const std::vector<shared_ptr<IHittable>> &leaf_objects() const; // in the order leaves refer to them
+
+private:
+    std::vector<Node> nodes;
+    std::vector<shared_ptr<IHittable>> objects; // in leaf order
+    double built_area; // summed node surface area right after the build, the refit quality baseline
+
+    int build_node(std::vector<AABB> &boxes, int first, int count);
+    double total_area() const;
+};
+
+#endif
@@ -1,14 +1,135 @@
 #include "camera.h"
 #include "../utils/math_utils.h"
 #include "hittable.h"
+#include "../utils/cpu_topology.h"
 
+#include <algorithm>
 #include <iostream>
 #include <thread>
 #include <vector>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <new>
 
 std::atomic<int> finished_pixels{0};
 
+static double luminance(const Color &color)
+{
+    return 0.2126 * color.x() + 0.7152 * color.y() + 0.0722 * color.z();
+}
+
+RenderBudget::RenderBudget() : seconds(0), target_noise(0), max_passes(1024) {}
+
+bool RenderBudget::enabled() const
+{
+    return seconds > 0 || target_noise > 0;
+}
+
+Accumulation::Accumulation()
+    : sum(nullptr), luminance(nullptr), luminance_sq(nullptr), samples(nullptr), passes(nullptr), pixels(0)
+{
+}
+
+size_t Accumulation::bytes(size_t pixels)
+{
+    return pixels * (5 * sizeof(double) + 2 * sizeof(int32_t));
+}
+
+void Accumulation::reset(size_t pixels)
+{
+    storage.assign((bytes(pixels) + sizeof(double) - 1) / sizeof(double), 0);
+    attach(storage.data(), pixels);
+}
+
+void Accumulation::attach(void *memory, size_t pixels)
+{
+    // doubles first so everything stays aligned
+    this->pixels = pixels;
+    sum = static_cast<double *>(memory);
+    luminance = sum + 3 * pixels;
+    luminance_sq = luminance + pixels;
+    samples = reinterpret_cast<int32_t *>(luminance_sq + pixels);
+    passes = samples + pixels;
+}
+
+double Accumulation::estimated_noise() const
+{
+    // standard error of each pixel's mean, from the spread of its pass means
+    double total = 0;
+    size_t counted = 0;
+    for (size_t p = 0; p < pixels; p++)
+    {
+        if (passes[p] < 2)
+            continue;
+
+        double mean = luminance[p] / passes[p];
+        double variance = luminance_sq[p] / passes[p] - mean * mean;
+        total += (variance > 0) ? variance / passes[p] : 0;
+        counted++;
+    }
+
+    return counted ? sqrt(total / counted) : infinity;
+}
+
+void RenderPasses::reset(size_t pixels)
+{
+    depth.assign(pixels, 0);
+    normal.assign(pixels, Vector3d(0, 0, 0));
+    albedo.assign(pixels, Color(0, 0, 0));
+    samples.assign(pixels, 0);
+    hits.assign(pixels, 0);
+}
+
+void RenderPasses::resolve()
+{
+    for (size_t p = 0; p < depth.size(); p++)
+    {
+        depth[p] = hits[p] > 0 ? depth[p] / hits[p] : infinity;
+        normal[p] = normal[p].length_squared() > 0 ? unit_vector(normal[p]) : Vector3d(0, 0, 0);
+        albedo[p] = samples[p] > 0 ? albedo[p] / samples[p] : Color(0, 0, 0);
+    }
+}
+
+std::vector<ImageLayer> RenderPasses::layers(const std::vector<std::string> &names) const
+{
+    std::vector<ImageLayer> layers;
+    auto wanted = [&names](const std::string &name)
+    { return names.empty() || std::find(names.begin(), names.end(), name) != names.end(); };
+
+    if (wanted("depth"))
+    {
+        ImageLayer layer;
+        layer.name = "depth";
+        layer.channels = {"Z"};
+        layer.full_precision = true; // half loses too much of far away depths
+        layer.data.assign(depth.begin(), depth.end());
+        layers.push_back(layer);
+    }
+    if (wanted("normal"))
+    {
+        ImageLayer layer = color_layer("normal", normal);
+        layer.channels = {"X", "Y", "Z"};
+        layers.push_back(layer);
+    }
+    if (wanted("albedo"))
+    {
+        layers.push_back(color_layer("albedo", albedo));
+    }
+    if (wanted("samples"))
+    {
+        ImageLayer layer;
+        layer.name = "samples";
+        layer.channels = {"Y"};
+        layer.full_precision = true; // counts past 2048 aren't exact in half
+        layer.data.assign(samples.begin(), samples.end());
+        layers.push_back(layer);
+    }
+    return layers;
+}
+
+PassSample::PassSample() : depth(0), hits(0), normal(0, 0, 0), albedo(0, 0, 0) {}
+
 Camera::Camera(int initial_width, int initial_height)
     : image_width(1080),
       image_height(0),
@@ -19,46 +140,209 @@ Camera::Camera(int initial_width, int initial_height)
       lookAt(Point3d(0, 0, 0)),
       vector_up(Vector3d(0, 0, 0)),
       defocus_angle(0),
-      focus_distance(10)
+      focus_distance(10),
+      tile_size(32),
+      huge_pages(false),
+      sample_seed(0),
+      row_sink(nullptr),
+      passes(nullptr),
+      checkpoint(nullptr),
+      stats(nullptr),
+      cancel(nullptr),
+      achieved_samples_per_pixel(0),
+      achieved_noise(0),
+      gbuffer(nullptr),
+      reshading(false),
+      accumulation(nullptr),
+      row_progress(nullptr),
+      pass_sums(nullptr),
+      accumulation_pass(0),
+      open_checkpoint(nullptr),
+      has_deadline(false),
+      next_slice_tile(0),
+      untouched_frame(false)
 {
     aspect_ratio_width = initial_width;
     aspect_ratio_height = initial_height;
 }
 
-void Camera::render_multithread(const IHittable &world, std::vector<Color> &image_buffer, int num_threads, std::string &progress)
+void Camera::render_tile(const IHittable &world, Color *image_buffer, const Tile &tile, size_t buffer_offset) const
 {
+    if (sample_seed != 0)
+        random_stream.seed(sample_seed, (uint64_t(accumulation_pass) << 32) | tile_index(tile));
+    for (int j = tile.y0; j < tile.y1; j++)
+    {
+        for (int i = tile.x0; i < tile.x1; i++)
+        {
+            size_t pixel = size_t(j) * image_width + i;
+            // a resumed pass may have reached this pixel before it was interrupted
+            if (accumulation != nullptr && accumulation->passes[pixel] > accumulation_pass)
+                continue;
+
+            PassSample aux;
+            uint64_t tests_before = trace_counters.tests();
+            Color pixel_color = render_pixel(i, j, world, pass_sums != nullptr ? &aux : nullptr);
+            trace_counters.samples += samples_per_pixel;
+            if (stats != nullptr && !stats->cost.empty())
+            {
+                uint32_t cost = uint32_t(trace_counters.tests() - tests_before);
+                stats->cost[pixel] = (accumulation != nullptr) ? stats->cost[pixel] + cost : cost;
+            }
+
+            if (pass_sums != nullptr)
+            {
+                pass_sums->depth[pixel] += aux.depth;
+                pass_sums->normal[pixel] += aux.normal;
+                pass_sums->albedo[pixel] += aux.albedo;
+                pass_sums->samples[pixel] += samples_per_pixel;
+                pass_sums->hits[pixel] += aux.hits;
+            }
+
+            if (accumulation == nullptr)
+            {
+                image_buffer[pixel - buffer_offset] = pixel_color;
+                continue;
+            }
+
+            double pixel_luminance = luminance(pixel_color);
+            for (int c = 0; c < 3; c++)
+                accumulation->sum[3 * pixel + c] += samples_per_pixel * pixel_color[c];
+            accumulation->luminance[pixel] += pixel_luminance;
+            accumulation->luminance_sq[pixel] += pixel_luminance * pixel_luminance;
+            accumulation->samples[pixel] += samples_per_pixel;
+            accumulation->passes[pixel]++;
+        }
+    }
+    random_stream.clear();
+}
+
+size_t Camera::tile_index(const Tile &tile) const
+{
+    int size = (tile_size < 1) ? 1 : tile_size;
+    int columns = (image_width + size - 1) / size;
+    return size_t(tile.y0 / size) * columns + tile.x0 / size;
+}
+
+void Camera::finish_tile(const Color *image_buffer, const Tile &tile)
+{
+    if (open_checkpoint != nullptr)
+        open_checkpoint->finish_tile(tile_index(tile));
+    if (row_progress == nullptr)
+        return;
+
+    std::lock_guard<std::mutex> lock(row_progress->mutex);
+    row_progress->tiles_left[tile.y0 / row_progress->rows_per_tile]--;
+    while (row_progress->next < row_progress->tiles_left.size() && row_progress->tiles_left[row_progress->next] == 0)
+    {
+        int y0 = static_cast<int>(row_progress->next) * row_progress->rows_per_tile;
+        int y1 = (y0 + row_progress->rows_per_tile < image_height) ? y0 + row_progress->rows_per_tile : image_height;
+        row_sink->rows_finished(image_buffer + size_t(y0) * image_width, y0, y1);
+        row_progress->next++;
+    }
+}
+
+void Camera::add_thread_stats(size_t thread, const TraceCounters &before, std::chrono::steady_clock::time_point start)
+{
+    if (stats != nullptr)
+        stats->add_thread(thread, before, trace_counters, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+// black pixels in memory that holds none yet, see FramePixels
+static void construct_pixels(Color *pixels, size_t count)
+{
+    for (size_t p = 0; p < count; p++)
+    {
+        new (&pixels[p]) Color();
+    }
+}
+
+void Camera::render_multithread(const IHittable &world, Color *image_buffer, const std::vector<Tile> &tiles, int num_threads, std::string &progress)
+{
+    const CpuTopology &topology = CpuTopology::get();
+    // the placement plan_threads logged, the same for every pass of a render
+    std::vector<int> placement = (worker_cpus.size() == size_t(num_threads)) ? worker_cpus : topology.place_threads(num_threads);
+    size_t nodes = topology.nodes.size();
+
+    // each NUMA node owns a contiguous band of tiles, workers drain their own node's band before helping the others
+    std::vector<size_t> band_start(nodes + 1);
+    for (size_t n = 0; n <= nodes; n++)
+    {
+        band_start[n] = n * tiles.size() / nodes;
+    }
+    std::vector<std::atomic<size_t>> band_next(nodes);
+    for (size_t n = 0; n < nodes; n++)
+    {
+        band_next[n] = band_start[n];
+    }
+
+    // an untouched frame is constructed first, each node's workers take the rows of its band so the pages land
+    // in its memory. A node without workers of its own has its rows constructed by one of the others
+    std::vector<int> band_row(nodes + 1, image_height);
+    std::vector<std::vector<int>> node_workers(nodes);
+    std::atomic<int> constructed(0);
+    if (untouched_frame)
+    {
+        for (size_t n = 0; n < nodes; n++)
+        {
+            if (band_start[n] < tiles.size())
+                band_row[n] = tiles[band_start[n]].y0;
+        }
+        for (int t = 0; t < num_threads; t++)
+        {
+            node_workers[topology.node_of(placement[t])].push_back(t);
+        }
+        for (size_t n = 0; n < nodes; n++)
+        {
+            if (node_workers[n].empty())
+                node_workers[n].push_back(int(n % num_threads));
+        }
+    }
+
     std::vector<std::thread> threads(num_threads);
-    int total_pixels = image_width * image_height;
+    int total_pixels = count_pixels(tiles);
     finished_pixels = 0;
 
-    std::clog << "Running on " << num_threads << " threads.\n";
-
     for (int t = 0; t < num_threads; ++t)
     {
 
         threads[t] = std::thread([&, t]()
                                  {
-                                        int start = t * image_height / num_threads;
-                                        int end = (t == num_threads - 1) ? image_height : (t + 1) * image_height / num_threads; // last thread gets the rest :)
-
-                                        for (int j = start; j < end; ++j)
+                                        pin_current_thread(placement[t]);
+                                        size_t home = topology.node_of(placement[t]);
+                                        if (untouched_frame)
                                         {
-                                            for (int i = 0; i < image_width; i++)
+                                            for (size_t n = 0; n < nodes; n++)
                                             {
-                                                Color pixel_color(0, 0, 0);
-
-                                                for (int sample = 0; sample < samples_per_pixel; sample++)
-                                                {
-                                                    Ray r = get_ray(i, j);
-                                                    pixel_color += ray_color(r, max_depth, world);
-                                                }
+                                                const std::vector<int> &workers = node_workers[n];
+                                                size_t rank = std::find(workers.begin(), workers.end(), t) - workers.begin();
+                                                if (rank == workers.size())
+                                                    continue;
+                                                size_t first = size_t(band_row[n]) * image_width;
+                                                size_t count = size_t(band_row[n + 1] - band_row[n]) * image_width;
+                                                construct_pixels(image_buffer + first + count * rank / workers.size(),
+                                                                 count * (rank + 1) / workers.size() - count * rank / workers.size());
+                                            }
+                                            // tracing waits for the whole frame, a late constructor would clear rendered pixels
+                                            constructed++;
+                                            while (constructed < num_threads)
+                                                std::this_thread::yield();
+                                        }
+                                        TraceCounters counters_before = trace_counters;
+                                        std::chrono::steady_clock::time_point busy_start = std::chrono::steady_clock::now();
 
-                                                image_buffer[j * image_width + i] = pixel_samples_scale * pixel_color;
+                                        for (size_t d = 0; d < nodes; d++)
+                                        {
+                                            size_t n = (home + d) % nodes;
+                                            for (size_t k = band_next[n]++; k < band_start[n + 1] && !should_stop(); k = band_next[n]++)
+                                            {
+                                                render_tile(world, image_buffer, tiles[k]);
+                                                finish_tile(image_buffer, tiles[k]);
 
-                                                finished_pixels++;
-                                                progress = "Progress " + std::to_string(100 * finished_pixels / total_pixels) + "%";
+                                                finished_pixels += (tiles[k].x1 - tiles[k].x0) * (tiles[k].y1 - tiles[k].y0);
+                                                progress = "Progress " + std::to_string(100 * (long long)finished_pixels / total_pixels) + "%";
                                             }
-                                        } });
+                                        }
+                                        add_thread_stats(t, counters_before, busy_start); });
     }
 
     for (auto &t : threads)
@@ -67,73 +351,635 @@ void Camera::render_multithread(const IHittable &world, std::vector<Color> &imag
     }
 }
 
-void Camera::render_singlethread(const IHittable &world, std::vector<Color> &image_buffer, std::string &progress)
+void Camera::render_singlethread(const IHittable &world, Color *image_buffer, const std::vector<Tile> &tiles, std::string &progress)
 {
-    std::clog << "Running on a single thread.\n";
-    std::clog << "Image dimensions: " << image_width << "x" << image_height << "\n";
-    int total_pixels = image_width * image_height;
+    if (untouched_frame)
+        construct_pixels(image_buffer, size_t(image_width) * image_height);
+    int total_pixels = count_pixels(tiles);
     finished_pixels = 0;
+    TraceCounters counters_before = trace_counters;
+    std::chrono::steady_clock::time_point busy_start = std::chrono::steady_clock::now();
+
+    for (const Tile &tile : tiles)
+    {
+        if (should_stop())
+            break;
+
+        render_tile(world, image_buffer, tile);
+        finish_tile(image_buffer, tile);
+
+        finished_pixels += (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+        progress = "Progress " + std::to_string(100 * (long long)finished_pixels / total_pixels) + "%";
+    }
+    add_thread_stats(0, counters_before, busy_start);
+}
+
+FramePixels Camera::render(const IHittable &world, unsigned int nthreads, std::string &progress, GBuffer *gbuffer, bool reshade)
+{
+    FramePixels image_buffer;
+    render_into(world, nthreads, progress, image_buffer, gbuffer, reshade);
+    return image_buffer;
+}
 
-    for (int j = 0; j < image_height; j++)
+void Camera::render_into(const IHittable &world, unsigned int nthreads, std::string &progress, FramePixels &image_buffer, GBuffer *gbuffer, bool reshade)
+{
+    initialize();
+    if (image_width <= 0 || image_height <= 0)
     {
-        for (int i = 0; i < image_width; i++)
+        std::cerr << "Invalid image dimensions: " << image_width << "x" << image_height << std::endl;
+        image_buffer.clear();
+        return;
+    }
+    if (stats != nullptr)
+        stats->reset(image_width, image_height, true);
+
+    // material-only edits can start from the cached primary hits, anything else traces them again
+    this->gbuffer = gbuffer;
+    reshading = reshade && gbuffer != nullptr && gbuffer->matches(*this);
+    if (!reshading && gbuffer != nullptr)
+    {
+        if (gbuffer->fits(image_width, image_height, samples_per_pixel))
+        {
+            gbuffer->prepare(*this);
+            std::clog << "Primary hit cache: " << (gbuffer->bytes() >> 20) << " MB.\n";
+        }
+        else
+        {
+            std::clog << "Primary hit cache skipped, " << image_width << "x" << image_height << "x" << samples_per_pixel << " samples is over "
+                      << (gbuffer->max_bytes >> 20) << " MB.\n";
+            gbuffer->release();
+            this->gbuffer = nullptr;
+        }
+    }
+
+    std::vector<Tile> tiles = make_tiles();
+    RowProgress progress_rows;
+    if (row_sink != nullptr)
+    {
+        progress_rows.rows_per_tile = (tile_size < 1) ? 1 : tile_size;
+        progress_rows.tiles_left.assign((image_height + progress_rows.rows_per_tile - 1) / progress_rows.rows_per_tile, 0);
+        progress_rows.next = 0;
+        for (const Tile &tile : tiles)
         {
-            Color pixel_color(0, 0, 0);
+            progress_rows.tiles_left[tile.y0 / progress_rows.rows_per_tile]++;
+        }
+        row_progress = &progress_rows;
+    }
 
-            for (int sample = 0; sample < samples_per_pixel; sample++)
+    size_t pixels = size_t(image_width) * image_height;
+    if (passes != nullptr)
+    {
+        passes->reset(pixels);
+        pass_sums = passes;
+    }
+    nthreads = plan_threads(nthreads);
+
+    // a buffer that already fits is rendered over in place, every pixel gets written
+    if (image_buffer.size() == pixels)
+    {
+        run_tiles(world, image_buffer.data(), tiles, nthreads, progress);
+        finish_passes();
+        row_progress = nullptr;
+        return;
+    }
+
+    // a new frame is sized without being written, the render threads construct the pixels and so first touch
+    // their pages. Huge pages are asked for before that
+    FramePixels().swap(image_buffer);
+    image_buffer.resize(pixels);
+    if (huge_pages)
+        advise_huge_pages(image_buffer.data(), pixels * sizeof(Color));
+    untouched_frame = true;
+    run_tiles(world, image_buffer.data(), tiles, nthreads, progress);
+    untouched_frame = false;
+    finish_passes();
+    row_progress = nullptr;
+}
+
+bool Camera::render_streamed(const IHittable &world, unsigned int nthreads, std::string &progress)
+{
+    initialize();
+    if (image_width <= 0 || image_height <= 0 || row_sink == nullptr)
+    {
+        std::cerr << "Invalid image dimensions or no row sink: " << image_width << "x" << image_height << std::endl;
+        return false;
+    }
+#ifdef SINGLE_THREADED_BUILD
+    nthreads = 1;
+#else
+    nthreads = std::max(1u, std::min(nthreads, CpuTopology::get().usable_threads()));
+#endif
+
+    std::vector<Tile> tiles = make_tiles();
+    int rows_per_tile = (tile_size < 1) ? 1 : tile_size;
+    size_t tile_rows = (image_height + rows_per_tile - 1) / rows_per_tile;
+    size_t columns = (image_width + rows_per_tile - 1) / rows_per_tile;
+
+    // one tile row is flushed while the next renders; narrow frames keep more rows going so no thread idles
+    size_t window = std::min(tile_rows, std::max<size_t>(2, (nthreads + columns - 1) / columns + 1));
+    size_t band_pixels = size_t(image_width) * rows_per_tile;
+    std::vector<Color> bands(window * band_pixels);
+    std::clog << "Streaming " << image_width << "x" << image_height << " in " << tile_rows << " tile rows, " << window
+              << " in memory (" << bands.size() * sizeof(Color) / (1024 * 1024) << " MB instead of "
+              << size_t(image_width) * image_height * sizeof(Color) / (1024 * 1024) << " MB).\n";
+
+    std::mutex mutex;
+    std::condition_variable row_flushed;
+    std::vector<int> tiles_left(tile_rows, 0);
+    for (const Tile &tile : tiles)
+        tiles_left[tile.y0 / rows_per_tile]++;
+    size_t flushed = 0;
+    std::atomic<size_t> next_tile(0);
+    long long total_pixels = (long long)image_width * image_height, done_pixels = 0;
+    // no per-pixel cost, it would be a frame of its own
+    if (stats != nullptr)
+        stats->reset(image_width, image_height, false);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    auto work = [&](size_t thread)
+    {
+        TraceCounters counters_before = trace_counters;
+        std::chrono::steady_clock::time_point busy_start = std::chrono::steady_clock::now();
+        for (size_t k = next_tile++; k < tiles.size(); k = next_tile++)
+        {
+            const Tile &tile = tiles[k];
+            size_t row = tile.y0 / rows_per_tile;
             {
-                Ray r = get_ray(i, j);
-                pixel_color += ray_color(r, max_depth, world);
+                // tiles go out in order, so the rows holding this one back are all being rendered
+                std::unique_lock<std::mutex> lock(mutex);
+                row_flushed.wait(lock, [&]()
+                                 { return row < flushed + window; });
             }
 
-            image_buffer[j * image_width + i] = pixel_samples_scale * pixel_color;
+            render_tile(world, &bands[(row % window) * band_pixels], tile, size_t(row) * band_pixels);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            done_pixels += (long long)(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+            progress = "Progress " + std::to_string(100 * done_pixels / total_pixels) + "%";
+            if (--tiles_left[row] > 0)
+                continue;
+            while (flushed < tile_rows && tiles_left[flushed] == 0)
+            {
+                int y0 = static_cast<int>(flushed) * rows_per_tile;
+                row_sink->rows_finished(&bands[(flushed % window) * band_pixels], y0, std::min(y0 + rows_per_tile, image_height));
+                flushed++;
+            }
+            row_flushed.notify_all();
         }
+        add_thread_stats(thread, counters_before, busy_start);
+    };
 
-        finished_pixels += image_width;
-        progress = "Progress " + std::to_string(100 * finished_pixels / total_pixels) + "%";
-    }
+    std::vector<std::thread> threads;
+    for (unsigned int t = 1; t < nthreads; t++)
+        threads.push_back(std::thread(work, size_t(t)));
+    work(0);
+    for (std::thread &thread : threads)
+        thread.join();
+    if (stats != nullptr)
+        stats->elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    return flushed == tile_rows;
 }
 
-std::vector<Color> Camera::render(const IHittable &world, unsigned int nthreads, std::string &progress)
+bool Camera::render_dirty(const IHittable &world, unsigned int nthreads, std::string &progress, FramePixels &image_buffer,
+                          const std::vector<AABB> &dirty_regions, bool conservative, GBuffer *gbuffer, bool reshade)
 {
     initialize();
-    if (image_width <= 0 || image_height <= 0)
+    if (image_width <= 0 || image_height <= 0 || image_buffer.size() != size_t(image_width) * image_height)
     {
-        std::cerr << "Invalid image dimensions: " << image_width << "x" << image_height << std::endl;
-        return {};
+        return false; // nothing to reuse
     }
 
-    // string buffer for the image
-    std::vector<Color> image_buffer(image_width * image_height);
+    // the cache is only kept up to date when it was traced with this exact view
+    this->gbuffer = (gbuffer != nullptr && gbuffer->matches(*this)) ? gbuffer : nullptr;
+    reshading = reshade && this->gbuffer != nullptr;
+    if (this->gbuffer == nullptr && gbuffer != nullptr)
+    {
+        gbuffer->invalidate();
+    }
 
-#ifdef __EMSCRIPTEN__
-    render_singlethread(world, image_buffer, progress);
-    return image_buffer;
-#endif
+    if (stats != nullptr)
+        stats->reset(image_width, image_height, true, true);
+    std::vector<Tile> tiles = tiles_seeing(dirty_regions, this->gbuffer, conservative);
+    std::clog << "Re-rendering " << tiles.size() << " of " << make_tiles().size() << " tiles.\n";
+    dirty_tiles = tiles;
 
-#ifndef __EMSCRIPTEN__
+    run_tiles(world, image_buffer.data(), tiles, plan_threads(nthreads), progress);
+
+    return true;
+}
+
+unsigned int Camera::plan_threads(unsigned int nthreads)
+{
+#ifdef SINGLE_THREADED_BUILD
+    nthreads = 1;
+#else
     if (nthreads < 1)
     {
         nthreads = 1;
     }
 
-    if (nthreads > std::thread::hardware_concurrency())
+    // affinity masks and cgroup quotas can leave far fewer CPUs than the machine has
+    unsigned int usable = CpuTopology::get().usable_threads();
+    if (nthreads > usable)
+    {
+        std::cerr << "Warning: " << nthreads << " threads requested, but only " << usable << " usable.\n";
+        nthreads = usable;
+    }
+#endif
+
+    if (nthreads == 1)
+    {
+        std::clog << "Running on a single thread.\n";
+        std::clog << "Image dimensions: " << image_width << "x" << image_height << "\n";
+        return nthreads;
+    }
+
+    const CpuTopology &topology = CpuTopology::get();
+    worker_cpus = topology.place_threads(nthreads);
+    std::clog << "Running on " << nthreads << " threads, " << topology.describe() << "\n";
+    std::clog << "Worker placement:";
+    for (unsigned int t = 0; t < nthreads; t++)
     {
-        std::cerr << "Warning: " << nthreads << " threads requested, but only " << std::thread::hardware_concurrency() << " available.\n";
-        nthreads = std::thread::hardware_concurrency();
+        std::clog << " " << t << "->cpu" << worker_cpus[t] << "/node" << topology.node_of(worker_cpus[t]);
     }
+    std::clog << "\n";
+    return nthreads;
+}
+
+void Camera::run_tiles(const IHittable &world, Color *image_buffer, const std::vector<Tile> &tiles, unsigned int nthreads, std::string &progress)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+#ifdef SINGLE_THREADED_BUILD
+    nthreads = 1;
+#else
+    nthreads = std::max(1u, std::min(nthreads, CpuTopology::get().usable_threads()));
+#endif
 
     if (nthreads > 1)
     {
-        render_multithread(world, image_buffer, nthreads, progress);
+        render_multithread(world, image_buffer, tiles, nthreads, progress);
     }
     else
     {
-        render_singlethread(world, image_buffer, progress);
+        render_singlethread(world, image_buffer, tiles, progress);
+    }
+
+    double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (stats != nullptr)
+        stats->elapsed_ms += elapsed_ms;
+    if (reshading)
+    {
+        gbuffer->last_reshade_ms = elapsed_ms;
+        std::clog << "Re-shaded from cached primary hits in " << elapsed_ms << " ms, full trace took " << gbuffer->last_trace_ms
+                  << " ms (saved " << gbuffer->last_trace_ms - elapsed_ms << " ms).\n";
+    }
+    else if (gbuffer != nullptr && !gbuffer->valid)
+    {
+        gbuffer->last_trace_ms = elapsed_ms;
+        gbuffer->valid = true;
+    }
+
+    gbuffer = nullptr;
+    reshading = false;
+}
+
+std::vector<Tile> Camera::plan_tiles()
+{
+    initialize();
+    return make_tiles();
+}
+
+std::vector<Color> Camera::render_single_tile(const IHittable &world, const Tile &tile) const
+{
+    std::vector<Color> pixels;
+    pixels.reserve((tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+    if (sample_seed != 0)
+        random_stream.seed(sample_seed, tile_index(tile));
+    for (int j = tile.y0; j < tile.y1; j++)
+    {
+        for (int i = tile.x0; i < tile.x1; i++)
+        {
+            pixels.push_back(render_pixel(i, j, world));
+        }
+    }
+    random_stream.clear();
+    return pixels;
+}
+
+void Camera::render_tiles(const IHittable &world, unsigned int nthreads, std::string &progress, FramePixels &image_buffer, const std::vector<Tile> &tiles)
+{
+    if (tiles.empty() || image_buffer.size() != size_t(image_width) * image_height)
+        return;
+    gbuffer = nullptr;
+    reshading = false;
+    run_tiles(world, image_buffer.data(), tiles, plan_threads(nthreads), progress);
+}
+
+FramePixels Camera::render_budgeted(const IHittable &world, unsigned int nthreads, std::string &progress)
+{
+    initialize();
+    if (image_width <= 0 || image_height <= 0)
+    {
+        std::cerr << "Invalid image dimensions: " << image_width << "x" << image_height << std::endl;
+        return {};
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t pixels = size_t(image_width) * image_height;
+    std::vector<Tile> tiles = make_tiles();
+    FramePixels image_buffer(pixels, Color());
+    if (stats != nullptr)
+        stats->reset(image_width, image_height, true);
+
+    // with a checkpoint the sums live in its file, and a matching file continues where it stopped
+    Accumulation sums;
+    int pass = 0;
+    if (checkpoint != nullptr && checkpoint->open(image_width, image_height, tile_size, samples_per_pixel, tiles.size(), Accumulation::bytes(pixels)))
+    {
+        open_checkpoint = checkpoint;
+        sums.attach(checkpoint->accumulation(), pixels);
+        pass = checkpoint->pass();
+        start -= std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(checkpoint->seconds()));
+    }
+    else
+    {
+        sums.reset(pixels);
+    }
+    accumulation = &sums;
+    if (passes != nullptr)
+    {
+        passes->reset(pixels);
+        pass_sums = passes;
+    }
+    nthreads = plan_threads(nthreads); // logged once, not every pass
+
+    double noise = infinity;
+    auto budget_spent = [&]()
+    {
+        // the first pass always completes so every pixel has samples, later ones may stop between tiles
+        if (budget.seconds > 0)
+        {
+            has_deadline = true;
+            deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(budget.seconds));
+        }
+
+        noise = sums.estimated_noise();
+        progress = "Pass " + std::to_string(pass) + ", noise " + std::to_string(noise);
+
+        // a handful of passes is needed before the spread between them says anything
+        bool noise_reached = budget.target_noise > 0 && pass >= 4 && noise <= budget.target_noise;
+        return should_stop() || noise_reached || (budget.max_passes > 0 && pass >= budget.max_passes) || !budget.enabled();
+    };
+
+    // a resumed render may have spent its budget already
+    bool done = pass > 0 && budget_spent();
+    while (!done)
+    {
+        std::vector<Tile> pending;
+        for (const Tile &tile : tiles)
+        {
+            if (open_checkpoint == nullptr || !open_checkpoint->tile_done(tile_index(tile)))
+                pending.push_back(tile);
+        }
+
+        accumulation_pass = pass;
+        run_tiles(world, image_buffer.data(), pending, nthreads, progress);
+        pass++;
+
+        if (open_checkpoint != nullptr && open_checkpoint->pass_done())
+            open_checkpoint->next_pass(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        done = budget_spent();
+    }
+
+    accumulation = nullptr;
+    has_deadline = false;
+    finish_passes();
+
+    double total_samples = 0;
+    for (size_t p = 0; p < pixels; p++)
+    {
+        image_buffer[p] = Color(sums.sum[3 * p], sums.sum[3 * p + 1], sums.sum[3 * p + 2]) / sums.samples[p];
+        total_samples += sums.samples[p];
+    }
+
+    achieved_samples_per_pixel = total_samples / pixels;
+    achieved_noise = noise;
+    double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::clog << "Budgeted render finished after " << pass << " passes in " << elapsed_s << " s: "
+              << achieved_samples_per_pixel << " spp, estimated error " << achieved_noise << ".\n";
+
+    if (open_checkpoint != nullptr)
+    {
+        open_checkpoint->save_seconds(elapsed_s);
+        open_checkpoint->close();
+        open_checkpoint = nullptr;
     }
 
     return image_buffer;
-#endif
+}
+
+void Camera::begin_slices(const std::vector<AABB> *dirty_regions, bool conservative)
+{
+    initialize();
+    gbuffer = nullptr;
+    reshading = false;
+    slice_plan = dirty_regions != nullptr ? tiles_seeing(*dirty_regions, nullptr, conservative) : make_tiles();
+    next_slice_tile = 0;
+    if (stats != nullptr)
+        stats->reset(image_width, image_height, true, dirty_regions != nullptr);
+    std::clog << "Rendering " << slice_plan.size() << " tiles in slices.\n";
+}
+
+std::vector<Tile> Camera::render_slice(const IHittable &world, Color *image_buffer, double budget_ms, std::string &progress)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point end = start + std::chrono::microseconds(static_cast<long long>(budget_ms * 1000));
+    TraceCounters counters_before = trace_counters;
+
+    std::vector<Tile> rendered;
+    while (next_slice_tile < slice_plan.size() && (rendered.empty() || std::chrono::steady_clock::now() < end))
+    {
+        const Tile &tile = slice_plan[next_slice_tile++];
+        render_tile(world, image_buffer, tile);
+        rendered.push_back(tile);
+    }
+
+    add_thread_stats(0, counters_before, start);
+    if (stats != nullptr)
+        stats->elapsed_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    progress = "Progress " + std::to_string(slice_plan.empty() ? 100 : 100 * next_slice_tile / slice_plan.size()) + "%";
+    return rendered;
+}
+
+bool Camera::slices_left() const
+{
+    return next_slice_tile < slice_plan.size();
+}
+
+void Camera::finish_passes()
+{
+    if (pass_sums != nullptr)
+    {
+        pass_sums->resolve();
+        pass_sums = nullptr;
+    }
+}
+
+bool Camera::should_stop() const
+{
+    return cancelled() || (has_deadline && std::chrono::steady_clock::now() >= deadline);
+}
+
+bool Camera::cancelled() const
+{
+    return cancel != nullptr && cancel->load();
+}
+
+std::vector<Tile> Camera::make_tiles() const
+{
+    int size = (tile_size < 1) ? 1 : tile_size;
+    std::vector<Tile> tiles;
+    for (int y = 0; y < image_height; y += size)
+    {
+        for (int x = 0; x < image_width; x += size)
+        {
+            Tile tile;
+            tile.x0 = x;
+            tile.y0 = y;
+            tile.x1 = (x + size < image_width) ? x + size : image_width;
+            tile.y1 = (y + size < image_height) ? y + size : image_height;
+            tiles.push_back(tile);
+        }
+    }
+    return tiles;
+}
+
+int Camera::count_pixels(const std::vector<Tile> &tiles)
+{
+    int pixels = 0;
+    for (const Tile &tile : tiles)
+    {
+        pixels += (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+    }
+    return (pixels > 0) ? pixels : 1;
+}
+
+bool Camera::project_bounds(const AABB &bounds, double &x0, double &y0, double &x1, double &y1) const
+{
+    double pixel_size = pixel_delta_u.length();
+    double defocus_radius = defocus_disk_u.length();
+    x0 = y0 = infinity;
+    x1 = y1 = -infinity;
+
+    for (int c = 0; c < 8; c++)
+    {
+        Vector3d to_corner = bounds.corner(c) - center;
+        double depth = dot(to_corner, -w);
+        if (depth <= 0)
+        {
+            return false; // straddles the camera plane, could be anywhere on screen
+        }
+
+        // pinhole projection onto the focus plane, in pixel units
+        Vector3d on_plane = (focus_distance / depth) * to_corner - (-focus_distance * w);
+        double px = dot(on_plane, u) / pixel_size + image_width / 2.0;
+        double py = dot(on_plane, -v) / pixel_size + image_height / 2.0;
+
+        // defocus moves the point by up to the disk radius scaled by its distance to the focus plane
+        double blur = defocus_radius * fabs(1 - focus_distance / depth) / pixel_size;
+
+        x0 = fmin(x0, px - blur);
+        y0 = fmin(y0, py - blur);
+        x1 = fmax(x1, px + blur);
+        y1 = fmax(y1, py + blur);
+    }
+
+    // pixel jitter reaches half a pixel on each side
+    x0 -= 1;
+    y0 -= 1;
+    x1 += 1;
+    y1 += 1;
+    return true;
+}
+
+std::vector<Tile> Camera::tiles_seeing(const std::vector<AABB> &regions, const GBuffer *gbuffer, bool conservative) const
+{
+    std::vector<Tile> all_tiles = make_tiles();
+    if (conservative && gbuffer == nullptr)
+    {
+        return all_tiles; // indirect effects can't be bounded without the primary hits
+    }
+
+    struct ScreenRect
+    {
+        double x0, y0, x1, y1;
+    };
+    std::vector<ScreenRect> rects;
+    for (const AABB &region : regions)
+    {
+        ScreenRect rect;
+        if (!project_bounds(region, rect.x0, rect.y0, rect.x1, rect.y1))
+        {
+            return all_tiles;
+        }
+        rects.push_back(rect);
+    }
+
+    // nearby surfaces pick up shadows and bounced light from the edit
+    std::vector<AABB> influence;
+    for (const AABB &region : regions)
+    {
+        double reach = region.longest_extent();
+        influence.push_back(AABB(region.x.expand(2 * reach), region.y.expand(2 * reach), region.z.expand(2 * reach)));
+    }
+
+    std::vector<Tile> tiles;
+    for (const Tile &tile : all_tiles)
+    {
+        bool dirty = false;
+        for (const ScreenRect &rect : rects)
+        {
+            if (rect.x0 < tile.x1 && rect.x1 >= tile.x0 && rect.y0 < tile.y1 && rect.y1 >= tile.y0)
+            {
+                dirty = true;
+                break;
+            }
+        }
+
+        // conservative mode also catches tiles whose primary hits see the edit indirectly
+        for (int j = tile.y0; conservative && !dirty && j < tile.y1; j++)
+        {
+            for (int i = tile.x0; !dirty && i < tile.x1; i++)
+            {
+                for (int sample = 0; !dirty && sample < samples_per_pixel; sample++)
+                {
+                    const PrimaryHit &hit = gbuffer->at(j * image_width + i, sample);
+                    if (hit.object == nullptr)
+                        continue;
+
+                    for (const AABB &box : influence)
+                    {
+                        if (box.x.contains(hit.p[0]) && box.y.contains(hit.p[1]) && box.z.contains(hit.p[2]))
+                            dirty = true;
+                    }
+
+                    // reflections and refractions can show the edit from anywhere
+                    const IMaterial *material = hit.object->material ? hit.object->material.get() : hit.material;
+                    if (dynamic_cast<const Lambertian *>(material) == nullptr)
+                        dirty = true;
+                }
+            }
+        }
+
+        if (dirty)
+        {
+            tiles.push_back(tile);
+        }
+    }
+
+    return tiles;
 }
 
 void Camera::initialize()
@@ -203,30 +1049,164 @@ Point3d Camera::defocus_disk_sample() const
     return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
 }
 
-Color Camera::ray_color(const Ray &r, int depth, const IHittable &world) const
+Color Camera::render_pixel(int i, int j, const IHittable &world, PassSample *aux) const
+{
+    Color pixel_color(0, 0, 0);
+    int pixel = j * image_width + i;
+
+    for (int sample = 0; sample < samples_per_pixel; sample++)
+    {
+        if (reshading)
+        {
+            pixel_color += shade_primary(gbuffer->at(pixel, sample), world, aux);
+        }
+        else if (gbuffer != nullptr)
+        {
+            pixel_color += trace_primary(get_ray(i, j), world, gbuffer->at(pixel, sample), aux);
+        }
+        else
+        {
+            pixel_color += ray_color(get_ray(i, j), max_depth, world, aux);
+        }
+    }
+
+    return pixel_samples_scale * pixel_color;
+}
+
+Color Camera::ray_color(const Ray &r, int depth, const IHittable &world, PassSample *aux) const
 {
     if (depth <= 0)
         return Color(0.5, 0.5, 0.5);
 
     HitRecord rec;
 
+    trace_counters.rays++;
     if (world.hit(r, Interval(0.001, infinity), rec))
     {
-        Ray scattered;
-        Color attenuation;
+        add_first_hit(rec.p, rec.normal, aux);
+        return shade_hit(r, rec, depth, world, aux);
+    }
 
-        if (rec.material->scatter(r, rec, attenuation, scattered))
-            return attenuation * ray_color(scattered, depth - 1, world);
+    Color sky = sky_color(r);
+    if (aux != nullptr)
+        aux->albedo += sky;
+    return sky;
+}
 
-        return Color(0.5, 0.5, 0.5);
+Color Camera::shade_hit(const Ray &r, const HitRecord &record, int depth, const IHittable &world, PassSample *aux) const
+{
+    Ray scattered;
+    Color attenuation;
+
+    if (record.material->scatter(r, record, attenuation, scattered))
+    {
+        if (aux != nullptr)
+            aux->albedo += attenuation;
+        return attenuation * ray_color(scattered, depth - 1, world);
     }
 
+    return Color(0.5, 0.5, 0.5);
+}
+
+void Camera::add_first_hit(const Point3d &p, const Vector3d &normal, PassSample *aux) const
+{
+    if (aux == nullptr)
+        return;
+
+    aux->depth += dot(p - center, -w);
+    aux->normal += normal;
+    aux->hits++;
+}
+
+Color Camera::sky_color(const Ray &r) const
+{
     Vector3d unit_direction = unit_vector(r.direction());
 
     double a = 0.5 * (unit_direction.y() + 1.0);
     return (1.0 - a) * Color(1.0, 1.0, 1.0) + a * Color(0.5, 0.7, 1.0); // sky gradient if no hit
 }
 
+static void store(float *to, const Vector3d &v)
+{
+    to[0] = float(v.e[0]);
+    to[1] = float(v.e[1]);
+    to[2] = float(v.e[2]);
+}
+
+static Vector3d load(const float *from)
+{
+    return Vector3d(from[0], from[1], from[2]);
+}
+
+Color Camera::trace_primary(const Ray &r, const IHittable &world, PrimaryHit &cached, PassSample *aux) const
+{
+    HitRecord rec;
+    cached.object = nullptr;
+    cached.material = nullptr;
+    store(cached.p, r.direction());
+
+    if (max_depth <= 0)
+        return Color(0.5, 0.5, 0.5);
+
+    trace_counters.rays++;
+    if (!world.hit(r, Interval(0.001, infinity), rec))
+    {
+        Color sky = sky_color(r);
+        if (aux != nullptr)
+            aux->albedo += sky;
+        return sky;
+    }
+
+    store(cached.p, rec.p);
+    store(cached.normal, rec.front_face ? rec.normal : -rec.normal);
+    cached.object = rec.object;
+    cached.material = rec.material.get();
+    cached.lens[0] = cached.lens[1] = 0;
+    if (defocus_angle > 0)
+    {
+        // the disk axes are orthogonal and as long as its radius
+        Vector3d offset = r.origin() - center;
+        double radius_squared = defocus_disk_u.length_squared();
+        cached.lens[0] = float(dot(offset, defocus_disk_u) / radius_squared);
+        cached.lens[1] = float(dot(offset, defocus_disk_v) / radius_squared);
+    }
+
+    add_first_hit(rec.p, rec.normal, aux);
+    return shade_hit(r, rec, max_depth, world, aux);
+}
+
+Color Camera::shade_primary(const PrimaryHit &cached, const IHittable &world, PassSample *aux) const
+{
+    if (max_depth <= 0)
+        return Color(0.5, 0.5, 0.5);
+
+    if (cached.object == nullptr)
+    {
+        Color sky = sky_color(Ray(center, load(cached.p)));
+        if (aux != nullptr)
+            aux->albedo += sky;
+        return sky;
+    }
+
+    // only the direction of the incoming ray matters from here on, its length doesn't
+    HitRecord rec;
+    rec.p = load(cached.p);
+    Point3d origin = center + (double(cached.lens[0]) * defocus_disk_u) + (double(cached.lens[1]) * defocus_disk_v);
+    Ray r(origin, rec.p - origin);
+    rec.set_face_normal(r, load(cached.normal));
+    rec.material = cached.object->material; // picks up material reassignments too
+    if (!rec.material)
+    {
+        // objects with a material per part, the cache holds the one that was hit; not owned, the object keeps it
+        rec.material = shared_ptr<IMaterial>(shared_ptr<IMaterial>(), const_cast<IMaterial *>(cached.material));
+    }
+    rec.object = cached.object;
+    rec.t = 0;
+
+    add_first_hit(rec.p, rec.normal, aux);
+    return shade_hit(r, rec, max_depth, world, aux);
+}
+
 void Camera::print_image_header(std::ostream &out, int image_width, int image_height)
 {
     // render
@@ -2,14 +2,99 @@
 #define CAMERA_H
 
 #include <atomic>
+#include <mutex>
+#include <chrono>
 #include <vector>
 #include "vector3d.h"
 #include "material.h"
 #include "color.h"
 #include "ray.h"
+#include "gbuffer.h"
+#include "aabb.h"
+#include "image_writer.h"
+#include "hdr_writer.h"
+#include "checkpoint.h"
+#include "render_stats.h"
 
 extern std::atomic<int> finished_pixels; // for multithread progress tracking
 
+// rectangle of pixels rendered as one unit of work, x1/y1 exclusive
+struct Tile
+{
+    int x0, y0;
+    int x1, y1;
+};
+
+// limits for budgeted rendering, 0 disables a limit
+struct RenderBudget
+{
+    double seconds;      // wall-clock time from the start of the render
+    double target_noise; // estimated standard error of the pixel luminance
+    int max_passes;
+
+    RenderBudget();
+    bool enabled() const;
+};
+
+// running per-pixel sums of progressive sample passes, in its own memory or in a checkpoint file
+struct Accumulation
+{
+    double *sum;          // rgb
+    double *luminance;    // sum of each pass' mean luminance
+    double *luminance_sq; // and of its square, for the noise estimate
+    int32_t *samples;
+    int32_t *passes;
+    size_t pixels;
+
+    Accumulation();
+    Accumulation(const Accumulation &) = delete;
+    Accumulation &operator=(const Accumulation &) = delete;
+
+    static size_t bytes(size_t pixels);
+    void reset(size_t pixels);                // zeroed, in memory
+    void attach(void *memory, size_t pixels); // over bytes(pixels) of memory, keeping what's there
+    double estimated_noise() const;
+
+private:
+    std::vector<double> storage;
+};
+
+// tile rows of a frame still being rendered, so finished rows reach the row sink in order
+struct RowProgress
+{
+    std::mutex mutex;
+    std::vector<int> tiles_left; // per tile row
+    size_t next;                 // first tile row not passed on yet
+    int rows_per_tile;
+};
+
+// per-pixel outputs besides the color, for compositing without re-rendering.
+// Sums while a render runs, averages once it's done
+struct RenderPasses
+{
+    std::vector<double> depth;    // camera-space z of the first hit, over the samples that hit something, infinity if none did
+    FramePixels normal;           // world-space normal of the first hit, zero on a miss
+    FramePixels albedo;    // attenuation of the first surface, the sky color on a miss
+    std::vector<int> samples;     // samples taken, differs per pixel in budgeted renders
+    std::vector<int> hits;        // samples that hit something
+
+    void reset(size_t pixels);
+    void resolve();
+    // depth.Z, normal.XYZ, albedo.RGB and samples.Y, or the named ones of them
+    std::vector<ImageLayer> layers(const std::vector<std::string> &names = {}) const;
+};
+
+// the first hits of one pixel's samples, summed
+struct PassSample
+{
+    double depth;
+    int hits;
+    Vector3d normal;
+    Color albedo;
+
+    PassSample();
+};
+
 class Camera
 {
 public:
@@ -31,9 +116,59 @@ public:
     double defocus_angle;
     double focus_distance;
 
-    void render_multithread(const IHittable &world, std::vector<Color> &image_buffer, int num_threads, std::string &progress);
-    void render_singlethread(const IHittable &world, std::vector<Color> &image_buffer, std::string &progress);
-    std::vector<Color> render(const IHittable &world, unsigned int nthreads, std::string &progress);
+    int tile_size;
+    bool huge_pages; // back new frames, and the scene's BVH and sphere arrays, with transparent huge pages where available
+    // when set, every tile draws its samples from a stream seeded from this, the tile and the pass, so the image
+    // is the same on any number of threads. 0 samples from rand(), which only repeats on one thread
+    uint64_t sample_seed;
+
+    IRowSink *row_sink; // gets the rows of full renders as they finish, to stream them out while the rest traces
+    RenderPasses *passes; // filled by full and budgeted renders when set
+    RenderCheckpoint *checkpoint; // budgeted renders keep their sums in it, and continue what it holds
+    RenderStats *stats; // counts and per-pixel cost of every render when set; render_dirty keeps the cost of tiles it skips
+    const std::atomic<bool> *cancel; // checked between tiles, once it's set the render stops early
+
+    std::vector<Tile> dirty_tiles; // the tiles the last render_dirty re-rendered
+
+    RenderBudget budget;
+    double achieved_samples_per_pixel; // results of the last budgeted render
+    double achieved_noise;
+
+    void render_multithread(const IHittable &world, Color *image_buffer, const std::vector<Tile> &tiles, int num_threads, std::string &progress);
+    void render_singlethread(const IHittable &world, Color *image_buffer, const std::vector<Tile> &tiles, std::string &progress);
+    // with a gbuffer, primary hits are cached into it, or shaded from it when reshade is set and the view still matches
+    FramePixels render(const IHittable &world, unsigned int nthreads, std::string &progress, GBuffer *gbuffer = nullptr, bool reshade = false);
+    // the same into image_buffer, reusing its storage when it already has the frame's size
+    void render_into(const IHittable &world, unsigned int nthreads, std::string &progress, FramePixels &image_buffer,
+                     GBuffer *gbuffer = nullptr, bool reshade = false);
+    // for frames too big to hold: tile rows go to row_sink as they finish, only a few of them are ever in memory.
+    // No gbuffer, passes or budget. False when row_sink isn't set
+    bool render_streamed(const IHittable &world, unsigned int nthreads, std::string &progress);
+    // re-renders only the tiles that can see the dirty regions into a previous image of the same view,
+    // returns false when image_buffer doesn't fit the view. Conservative mode also covers indirect effects
+    bool render_dirty(const IHittable &world, unsigned int nthreads, std::string &progress, FramePixels &image_buffer,
+                      const std::vector<AABB> &dirty_regions, bool conservative, GBuffer *gbuffer = nullptr, bool reshade = false);
+    // tile layout of the next render, for callers that schedule tiles themselves
+    std::vector<Tile> plan_tiles();
+    // renders one tile of the view set up by plan_tiles(), row-major pixels of the tile only.
+    // Safe to call from several threads at once
+    std::vector<Color> render_single_tile(const IHittable &world, const Tile &tile) const;
+    // renders tiles of the view set up by plan_tiles() into a frame sized image_buffer, on nthreads threads like a full render.
+    // The rest of the frame is left as it is
+    void render_tiles(const IHittable &world, unsigned int nthreads, std::string &progress, FramePixels &image_buffer, const std::vector<Tile> &tiles);
+    // a camera ray through pixel (i, j) as the render samples it, jittered and from the defocus disk, of the view
+    // set up by plan_tiles()
+    Ray get_ray(int i, int j) const;
+    // adds passes of samples_per_pixel samples until the budget runs out, stopping between tiles
+    FramePixels render_budgeted(const IHittable &world, unsigned int nthreads, std::string &progress);
+    // a render spread over the frames of a loop that can't block, the single-threaded browser build's.
+    // begin_slices plans every tile, or only those seeing dirty_regions when given; each render_slice renders the next
+    // of them into image_buffer until budget_ms is used up, at least one, and returns them. No gbuffer, passes, row sink or budget
+    void begin_slices(const std::vector<AABB> *dirty_regions = nullptr, bool conservative = false);
+    std::vector<Tile> render_slice(const IHittable &world, Color *image_buffer, double budget_ms, std::string &progress);
+    bool slices_left() const;
+    // the cancel flag stopped the last render before it finished, its image is incomplete
+    bool cancelled() const;
 
 private:
     Point3d center;
@@ -45,11 +180,45 @@ private:
     Vector3d defocus_disk_v;
 
     double pixel_samples_scale;
+    GBuffer *gbuffer;
+    bool reshading;
+    Accumulation *accumulation;
+    RowProgress *row_progress;
+    RenderPasses *pass_sums; // passes of the render in progress
+    int accumulation_pass;   // pixels that already have more passes are skipped, after a resume
+    RenderCheckpoint *open_checkpoint;
+    bool has_deadline;
+    std::chrono::steady_clock::time_point deadline;
+    std::vector<Tile> slice_plan; // of begin_slices
+    size_t next_slice_tile;
+    std::vector<int> worker_cpus; // chosen by plan_threads
+    bool untouched_frame; // the frame's pixels aren't constructed yet, the render threads do it before tracing
+
     void initialize();
+    // the thread count run_tiles will use and the CPUs its workers are pinned to, logged once per render
+    unsigned int plan_threads(unsigned int nthreads);
+    void run_tiles(const IHittable &world, Color *image_buffer, const std::vector<Tile> &tiles, unsigned int nthreads, std::string &progress);
+    // image_buffer holds the frame from pixel buffer_offset on
+    void render_tile(const IHittable &world, Color *image_buffer, const Tile &tile, size_t buffer_offset = 0) const;
+    void finish_tile(const Color *image_buffer, const Tile &tile);
+    void add_thread_stats(size_t thread, const TraceCounters &before, std::chrono::steady_clock::time_point start);
+    size_t tile_index(const Tile &tile) const; // position in make_tiles()
+    std::vector<Tile> make_tiles() const;
+    static int count_pixels(const std::vector<Tile> &tiles);
+    void finish_passes();
+    bool should_stop() const; // out of time or cancelled
+    bool project_bounds(const AABB &bounds, double &x0, double &y0, double &x1, double &y1) const;
+    std::vector<Tile> tiles_seeing(const std::vector<AABB> &regions, const GBuffer *gbuffer, bool conservative) const;
     Vector3d sample_square() const;
-    Ray get_ray(int i, int j) const;
     Point3d defocus_disk_sample() const;
-    Color ray_color(const Ray &r, int depth, const IHittable &world) const;
+    // aux, when given, collects the first hits of the samples for the render passes
+    Color render_pixel(int i, int j, const IHittable &world, PassSample *aux = nullptr) const;
+    Color ray_color(const Ray &r, int depth, const IHittable &world, PassSample *aux = nullptr) const;
+    Color shade_hit(const Ray &r, const HitRecord &record, int depth, const IHittable &world, PassSample *aux = nullptr) const;
+    Color sky_color(const Ray &r) const;
+    Color trace_primary(const Ray &r, const IHittable &world, PrimaryHit &cached, PassSample *aux) const;
+    Color shade_primary(const PrimaryHit &cached, const IHittable &world, PassSample *aux) const;
+    void add_first_hit(const Point3d &p, const Vector3d &normal, PassSample *aux) const;
     void print_image_header(std::ostream &out, int image_width, int image_height);
 
 };
@@ -0,0 +1,229 @@
+#include "checkpoint.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', 0, 0};
+static const uint32_t checkpoint_version = 1;
+
+static size_t align_64(size_t bytes)
+{
+    return (bytes + 63) & ~size_t(63);
+}
+
+uint64_t checkpoint_key(const std::string &scene_text)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : scene_text)
+    {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+RenderCheckpoint::RenderCheckpoint(const std::string &path, uint64_t scene_key)
+    : path(path),
+      sync_seconds(30),
+      scene_key(scene_key),
+      fd(-1),
+      header(nullptr),
+      tiles(nullptr),
+      sums(nullptr),
+      mapped_bytes(0),
+      was_resumed(false),
+      stopping(false)
+{
+}
+
+RenderCheckpoint::~RenderCheckpoint()
+{
+    close();
+}
+
+bool RenderCheckpoint::open(int width, int height, int tile_size, int samples_per_pixel, size_t tile_count, size_t accumulation_bytes)
+{
+    close();
+#ifdef __linux__
+    size_t tiles_offset = align_64(sizeof(Header));
+    size_t sums_offset = tiles_offset + align_64(tile_count);
+    size_t bytes = sums_offset + accumulation_bytes;
+
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Could not open checkpoint " << path << std::endl;
+        return false;
+    }
+
+    Header expected;
+    std::memset(&expected, 0, sizeof(expected));
+    std::memcpy(expected.magic, checkpoint_magic, sizeof(checkpoint_magic));
+    expected.version = checkpoint_version;
+    expected.tile_size = static_cast<uint32_t>(tile_size);
+    expected.scene_key = scene_key;
+    expected.width = width;
+    expected.height = height;
+    expected.samples_per_pixel = samples_per_pixel;
+    expected.tiles = tile_count;
+    expected.accumulation_bytes = accumulation_bytes;
+
+    // anything but the same scene, layout and samples per pass can't be continued
+    Header found;
+    was_resumed = pread(fd, &found, sizeof(found), 0) == ssize_t(sizeof(found)) &&
+                  std::memcmp(found.magic, expected.magic, sizeof(expected.magic)) == 0 && found.version == expected.version &&
+                  found.tile_size == expected.tile_size && found.scene_key == expected.scene_key && found.width == expected.width &&
+                  found.height == expected.height && found.samples_per_pixel == expected.samples_per_pixel &&
+                  found.tiles == expected.tiles && found.accumulation_bytes == expected.accumulation_bytes;
+
+    // a new render starts from a zeroed file, sparse until the tiles write to it
+    if (!was_resumed && (ftruncate(fd, 0) != 0 || ftruncate(fd, off_t(bytes)) != 0))
+    {
+        std::cerr << "Could not size checkpoint " << path << std::endl;
+        close();
+        return false;
+    }
+
+    void *memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED)
+    {
+        std::cerr << "Could not map checkpoint " << path << std::endl;
+        close();
+        return false;
+    }
+    mapped_bytes = bytes;
+    header = static_cast<Header *>(memory);
+    tiles = static_cast<uint8_t *>(memory) + tiles_offset;
+    sums = static_cast<uint8_t *>(memory) + sums_offset;
+
+    if (was_resumed)
+    {
+        size_t done = 0;
+        for (size_t t = 0; t < tile_count; t++)
+            done += tiles[t] ? 1 : 0;
+        std::clog << "Resuming checkpoint " << path << " at pass " << header->pass + 1 << ", " << done << "/" << tile_count
+                  << " tiles of it done, " << header->seconds << " s rendered before.\n";
+    }
+    else
+    {
+        std::clog << "Starting checkpoint " << path << ", synced every " << sync_seconds << " s.\n";
+        *header = expected;
+        sync();
+    }
+
+    stopping = false;
+    syncer = std::thread([this]()
+                         {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping)
+        {
+            stop_syncing.wait_for(lock, std::chrono::duration<double>(sync_seconds));
+            if (!stopping)
+                sync();
+        } });
+    return true;
+#else
+    std::cerr << "Checkpoints need mmap, rendering without " << path << std::endl;
+    return false;
+#endif
+}
+
+void RenderCheckpoint::close()
+{
+#ifdef __linux__
+    if (syncer.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        stop_syncing.notify_all();
+        syncer.join();
+    }
+    if (header != nullptr)
+    {
+        sync();
+        munmap(header, mapped_bytes);
+    }
+    if (fd >= 0)
+        ::close(fd);
+#endif
+    fd = -1;
+    header = nullptr;
+    tiles = nullptr;
+    sums = nullptr;
+    mapped_bytes = 0;
+}
+
+bool RenderCheckpoint::is_open() const
+{
+    return header != nullptr;
+}
+
+bool RenderCheckpoint::resumed() const
+{
+    return was_resumed;
+}
+
+void *RenderCheckpoint::accumulation()
+{
+    return sums;
+}
+
+int RenderCheckpoint::pass() const
+{
+    return header->pass;
+}
+
+double RenderCheckpoint::seconds() const
+{
+    return header->seconds;
+}
+
+bool RenderCheckpoint::tile_done(size_t tile) const
+{
+    return tiles[tile] != 0;
+}
+
+void RenderCheckpoint::finish_tile(size_t tile)
+{
+    tiles[tile] = 1;
+}
+
+bool RenderCheckpoint::pass_done() const
+{
+    for (size_t t = 0; t < header->tiles; t++)
+    {
+        if (!tiles[t])
+            return false;
+    }
+    return true;
+}
+
+void RenderCheckpoint::next_pass(double seconds)
+{
+    std::memset(tiles, 0, header->tiles);
+    header->pass++;
+    header->seconds = seconds;
+}
+
+void RenderCheckpoint::save_seconds(double seconds)
+{
+    header->seconds = seconds;
+}
+
+void RenderCheckpoint::sync()
+{
+#ifdef __linux__
+    if (header != nullptr && msync(header, mapped_bytes, MS_SYNC) != 0)
+        std::cerr << "Could not sync checkpoint " << path << std::endl;
+#endif
+}
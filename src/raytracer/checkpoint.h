@@ -0,0 +1,75 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// what a checkpoint belongs to, from the scene text, so a changed scene starts over
+uint64_t checkpoint_key(const std::string &scene_text);
+
+// keeps the sums of a progressive render, its pass and the tiles finished in that pass in a memory-mapped file.
+// A background thread writes it back every sync_seconds, so a crashed or preempted render loses at most the tiles
+// of that interval. Opening the file again for the same scene and layout resumes where it stopped.
+// Needs mmap, only available on Linux
+class RenderCheckpoint
+{
+public:
+    RenderCheckpoint(const std::string &path, uint64_t scene_key);
+    ~RenderCheckpoint();
+
+    std::string path;
+    double sync_seconds;
+
+    // maps the file for this layout, keeping its contents when they match, false if it can't be mapped
+    bool open(int width, int height, int tile_size, int samples_per_pixel, size_t tiles, size_t accumulation_bytes);
+    void close();
+    bool is_open() const;
+    bool resumed() const; // whether open() found earlier work
+
+    void *accumulation(); // zeroed for a new render
+    int pass() const;     // in progress, earlier ones are complete
+    double seconds() const; // render time of the earlier runs
+
+    bool tile_done(size_t tile) const;
+    void finish_tile(size_t tile);
+    bool pass_done() const;
+    // after every tile of the pass, with the render time so far
+    void next_pass(double seconds);
+    void save_seconds(double seconds);
+    void sync();
+
+private:
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t tile_size;
+        uint64_t scene_key;
+        int32_t width;
+        int32_t height;
+        int32_t samples_per_pixel;
+        int32_t pass;
+        uint64_t tiles;
+        uint64_t accumulation_bytes;
+        double seconds;
+    };
+
+    uint64_t scene_key;
+    int fd;
+    Header *header;
+    uint8_t *tiles;
+    void *sums;
+    size_t mapped_bytes;
+    bool was_resumed;
+
+    std::thread syncer;
+    std::mutex mutex;
+    std::condition_variable stop_syncing;
+    bool stopping;
+};
+
+#endif
@@ -1,6 +1,15 @@
 #include "color.h"
 #include "../utils/math_utils.h"
 
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
 inline double linear_to_gamma(double linear_component)
 {
     if (linear_component > 0)
@@ -28,4 +37,92 @@ void write_ppm_color(std::ostream& out, const Color& pixel_color)
     int bbyte = int(255.999 * intensity.clamp(b));
 
     out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
-}
\ No newline at end of file
+}
+static inline uint8_t component_to_8(double linear)
+{
+    return static_cast<uint8_t>(255.999 * std::min(1.0, sqrt(std::max(0.0, linear))));
+}
+
+uint16_t color_component_to_16(double linear)
+{
+    return static_cast<uint16_t>(65535.999 * std::min(1.0, sqrt(std::max(0.0, linear))));
+}
+
+#if defined(__SSE2__)
+// gamma encoded and scaled, truncated to int32 in the low two lanes
+static inline __m128i encode_pair(__m128d linear)
+{
+    const __m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1.0), scale = _mm_set1_pd(255.999);
+    return _mm_cvttpd_epi32(_mm_mul_pd(_mm_min_pd(_mm_sqrt_pd(_mm_max_pd(linear, zero)), one), scale));
+}
+
+// two pixels as int32 lanes r0 g0 b0 a r1 g1 b1 a, packed to 16-bit
+static inline __m128i encode_two(const Color &p0, const Color &p1)
+{
+    const __m128i alpha = _mm_set1_epi32(255);
+    __m128i rg0 = encode_pair(_mm_loadu_pd(p0.e));
+    __m128i rg1 = encode_pair(_mm_loadu_pd(p1.e));
+    __m128i b = encode_pair(_mm_loadh_pd(_mm_load_sd(&p0.e[2]), &p1.e[2]));
+    __m128i ba = _mm_unpacklo_epi32(b, alpha); // b0 a b1 a
+    return _mm_packs_epi32(_mm_unpacklo_epi64(rg0, ba), _mm_unpacklo_epi64(rg1, _mm_unpackhi_epi64(ba, ba)));
+}
+#elif defined(__wasm_simd128__)
+// the SSE2 steps with wasm SIMD128: pmax and pmin take zero and one for NaN like _mm_max_pd and _mm_min_pd
+static inline v128_t encode_pair(v128_t linear)
+{
+    const v128_t zero = wasm_f64x2_splat(0.0), one = wasm_f64x2_splat(1.0), scale = wasm_f64x2_splat(255.999);
+    return wasm_i32x4_trunc_sat_f64x2_zero(wasm_f64x2_mul(wasm_f64x2_pmin(one, wasm_f64x2_sqrt(wasm_f64x2_pmax(zero, linear))), scale));
+}
+
+static inline v128_t encode_two(const Color &p0, const Color &p1)
+{
+    const v128_t alpha = wasm_i32x4_splat(255);
+    v128_t rg0 = encode_pair(wasm_v128_load(p0.e));
+    v128_t rg1 = encode_pair(wasm_v128_load(p1.e));
+    v128_t b = encode_pair(wasm_f64x2_make(p0.e[2], p1.e[2]));
+    v128_t ba = wasm_i32x4_shuffle(b, alpha, 0, 4, 1, 5); // b0 a b1 a
+    return wasm_i16x8_narrow_i32x4(wasm_i32x4_shuffle(rg0, ba, 0, 1, 4, 5), wasm_i32x4_shuffle(rg1, ba, 0, 1, 6, 7));
+}
+#endif
+
+void colors_to_rgba8(const Color *pixels, size_t count, uint8_t *rgba)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    // four pixels per step. Colors aren't packed, each carries a vtable pointer, so the channels are loaded per pixel
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i bytes = _mm_packus_epi16(encode_two(pixels[i], pixels[i + 1]), encode_two(pixels[i + 2], pixels[i + 3]));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(rgba + 4 * i), bytes);
+    }
+#elif defined(__wasm_simd128__)
+    for (; i + 4 <= count; i += 4)
+    {
+        v128_t bytes = wasm_u8x16_narrow_i16x8(encode_two(pixels[i], pixels[i + 1]), encode_two(pixels[i + 2], pixels[i + 3]));
+        wasm_v128_store(rgba + 4 * i, bytes);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        rgba[4 * i] = component_to_8(pixels[i].e[0]);
+        rgba[4 * i + 1] = component_to_8(pixels[i].e[1]);
+        rgba[4 * i + 2] = component_to_8(pixels[i].e[2]);
+        rgba[4 * i + 3] = 255;
+    }
+}
+
+void colors_to_rgb8(const Color *pixels, size_t count, uint8_t *rgb)
+{
+    // through rgba in chunks, dropping alpha
+    uint8_t rgba[4 * 256];
+    for (size_t first = 0; first < count; first += 256)
+    {
+        size_t chunk = std::min<size_t>(256, count - first);
+        colors_to_rgba8(pixels + first, chunk, rgba);
+        for (size_t k = 0; k < chunk; k++)
+        {
+            std::memcpy(rgb, rgba + 4 * k, 3);
+            rgb += 3;
+        }
+    }
+}
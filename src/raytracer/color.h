@@ -2,12 +2,27 @@
 #define COLOR_H
 
 #include "vector3d.h"
+#include "../utils/cpu_topology.h"
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
+#include <vector>
 
 using Color = Vector3d;
 
+// the pixels of a frame. resize() and the size constructor leave them unconstructed, so the render threads
+// construct the pixels they render and first touch their pages; give a value to get them zeroed
+using FramePixels = std::vector<Color, UntouchedAllocator<Color>>;
+
 inline double linear_to_gamma(double linear_component);
 
 void write_ppm_color(std::ostream& out, const Color& pixel_color);
 
+// linear colors to gamma 2 encoded bytes, clamped to [0, 1] first, as the viewport and 8-bit images show them.
+// rgba is in memory order with opaque alpha. Vectorized where the target has SIMD
+void colors_to_rgba8(const Color *pixels, size_t count, uint8_t *rgba);
+void colors_to_rgb8(const Color *pixels, size_t count, uint8_t *rgb);
+// the same encoding at 16 bits, for 16-bit images
+uint16_t color_component_to_16(double linear);
+
 #endif
\ No newline at end of file
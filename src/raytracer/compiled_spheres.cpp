@@ -0,0 +1,134 @@
+#include "compiled_spheres.h"
+#include "sphere3d.h"
+#include "render_stats.h"
+#include "../utils/cpu_topology.h"
+
+static AABB node_bounds(const CompiledNode &node)
+{
+    return AABB(Interval(node.min[0], node.max[0]), Interval(node.min[1], node.max[1]), Interval(node.min[2], node.max[2]));
+}
+
+CompiledSpheres::CompiledSpheres(const std::string &name, std::shared_ptr<const void> storage, const CompiledSphere *spheres, size_t sphere_count,
+                                 const CompiledNode *nodes, size_t node_count, const std::vector<shared_ptr<IMaterial>> &materials)
+    : spheres(spheres),
+      sphere_count(sphere_count),
+      materials(materials),
+      storage(storage),
+      nodes(nodes),
+      node_count(node_count)
+{
+    this->name = name;
+}
+
+int hit_compiled_spheres(const CompiledNode *nodes, const CompiledSphere *spheres, const Ray &r, Interval &ray_t, HitRecord &record)
+{
+    HitRecord temp_rec;
+    int closest = -1;
+    int stack[64]; // same tree as BVH::hit, same depth bound
+    int depth = 0;
+    stack[depth++] = 0;
+    uint64_t box_tests = 0, primitive_tests = 0;
+
+    while (depth > 0)
+    {
+        const CompiledNode &node = nodes[stack[--depth]];
+        box_tests++;
+        if (!node_bounds(node).hit(r, ray_t))
+            continue;
+
+        if (node.count > 0)
+        {
+            primitive_tests += node.count;
+            for (int k = node.first; k < node.first + node.count; k++)
+            {
+                const CompiledSphere &sphere = spheres[k];
+                if (hit_sphere(Point3d(sphere.center[0], sphere.center[1], sphere.center[2]), sphere.radius, r, ray_t, temp_rec))
+                {
+                    closest = k;
+                    ray_t.max = temp_rec.t; // only closer hits from here on
+                    record = temp_rec;
+                }
+            }
+        }
+        else
+        {
+            int left = static_cast<int>(&node - nodes) + 1;
+            stack[depth++] = node.right;
+            stack[depth++] = left;
+        }
+    }
+    trace_counters.box_tests += box_tests;
+    trace_counters.primitive_tests += primitive_tests;
+    return closest;
+}
+
+CompiledTreeCheck::CompiledTreeCheck(size_t node_count, size_t sphere_count)
+    : next(0), sphere_count(int64_t(sphere_count)), damaged(false)
+{
+    if (node_count > 0)
+        pending.push_back(Subtree{0, int64_t(node_count), 1});
+}
+
+bool CompiledTreeCheck::add(const CompiledNode &node)
+{
+    if (damaged || pending.empty() || pending.back().first != next)
+    {
+        damaged = true;
+        return false;
+    }
+
+    Subtree subtree = pending.back();
+    pending.pop_back();
+    next++;
+    if (node.count > 0)
+    {
+        damaged = subtree.end != subtree.first + 1 || node.first < 0 || int64_t(node.first) + node.count > sphere_count;
+    }
+    else if (node.count < 0 || subtree.level >= max_levels || node.right <= subtree.first + 1 || node.right >= subtree.end)
+    {
+        damaged = true;
+    }
+    else
+    {
+        // the left subtree comes next, then the right one
+        pending.push_back(Subtree{node.right, subtree.end, subtree.level + 1});
+        pending.push_back(Subtree{subtree.first + 1, node.right, subtree.level + 1});
+    }
+    return !damaged;
+}
+
+bool CompiledTreeCheck::complete() const
+{
+    return !damaged && pending.empty();
+}
+
+bool CompiledSpheres::hit(const Ray &r, Interval ray_t, HitRecord &record) const
+{
+    if (node_count == 0)
+        return false;
+
+    int closest = hit_compiled_spheres(nodes, spheres, r, ray_t, record);
+    if (closest < 0)
+        return false;
+
+    // the material only for the closest hit, copying it is an atomic increment
+    record.material = materials[spheres[closest].material];
+    record.object = this;
+    return true;
+}
+
+AABB CompiledSpheres::bounding_box() const
+{
+    return node_count == 0 ? AABB() : node_bounds(nodes[0]);
+}
+
+void CompiledSpheres::advise_huge_pages() const
+{
+    ::advise_huge_pages(const_cast<CompiledSphere *>(spheres), sphere_count * sizeof(CompiledSphere));
+    ::advise_huge_pages(const_cast<CompiledNode *>(nodes), node_count * sizeof(CompiledNode));
+}
+
+void CompiledSpheres::accept(IVisitor *visitor)
+{
+    visitor->visit(this);
+}
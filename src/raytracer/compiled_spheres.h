@@ -0,0 +1,88 @@
+#ifndef COMPILED_SPHERES_H
+#define COMPILED_SPHERES_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "hittable.h"
+
+// records of a compiled scene file, plain data so they're used straight from the mapped file
+struct CompiledSphere
+{
+    double center[3];
+    double radius;
+    uint32_t material; // index into the scene's materials, in name order
+    uint32_t reserved;
+};
+
+// a BVH::Node, right/first/count as there
+struct CompiledNode
+{
+    double min[3];
+    double max[3];
+    int32_t right;
+    int32_t first;
+    int32_t count;
+    int32_t reserved;
+};
+
+// traces a tree of records from its root at nodes[0], fills record but for material and object.
+// Returns the index of the closest sphere hit or -1, with ray_t.max moved to it
+int hit_compiled_spheres(const CompiledNode *nodes, const CompiledSphere *spheres, const Ray &r, Interval &ray_t, HitRecord &record);
+
+// checks a tree of records before it's traced, fed its nodes in the order they're stored. hit_compiled_spheres
+// relies on the layout BVH writes: depth first with every subtree contiguous, so an inner node's right child lies
+// past its left subtree and inside its own, leaves within sphere_count, and no more than 64 levels
+class CompiledTreeCheck
+{
+public:
+    static const int max_levels = 64; // the traversal stacks hold one entry per level
+
+    CompiledTreeCheck(size_t node_count, size_t sphere_count);
+
+    bool add(const CompiledNode &node); // false once the tree is damaged
+    bool complete() const;              // every node was added and the tree is whole
+
+private:
+    // a subtree still to come, nodes [first, end)
+    struct Subtree
+    {
+        int64_t first;
+        int64_t end;
+        int level;
+    };
+
+    std::vector<Subtree> pending;
+    int64_t next;
+    int64_t sphere_count;
+    bool damaged;
+};
+
+// all spheres of a compiled scene as one object, traced through the prebuilt tree in place.
+// Read-only: the spheres can't be edited one by one, saving the scene as text turns them back into sphere lines
+class CompiledSpheres : public IHittable
+{
+public:
+    // storage keeps the records alive, typically the file mapping
+    CompiledSpheres(const std::string &name, std::shared_ptr<const void> storage, const CompiledSphere *spheres, size_t sphere_count,
+                    const CompiledNode *nodes, size_t node_count, const std::vector<shared_ptr<IMaterial>> &materials);
+
+    const CompiledSphere *spheres;
+    size_t sphere_count;
+    std::vector<shared_ptr<IMaterial>> materials;
+
+    bool hit(const Ray &r, Interval ray_t, HitRecord &record) const override;
+    AABB bounding_box() const override;
+    // for the sphere and node records. Mapped from a file they only get them where the kernel backs file pages
+    // with huge pages
+    void advise_huge_pages() const;
+
+    void accept(IVisitor *visitor) override;
+
+private:
+    std::shared_ptr<const void> storage;
+    const CompiledNode *nodes;
+    size_t node_count;
+};
+
+#endif
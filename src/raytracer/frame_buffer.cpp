@@ -0,0 +1,56 @@
+#include "frame_buffer.h"
+
+FrameBuffer::FrameBuffer()
+    : front_target(std::make_shared<RenderTarget>(FramePixels(), 0, 0)),
+      back_taken(false),
+      front_version(front_target->getVersion())
+{
+}
+
+std::shared_ptr<RenderTarget> FrameBuffer::back()
+{
+    // a reader still holding the old front keeps it, the next frame goes to a new target instead
+    if (!back_target || back_target.use_count() > 1)
+    {
+        back_target = std::make_shared<RenderTarget>(FramePixels(), 0, 0);
+    }
+    else if (back_taken)
+    {
+        back_target->version = 0; // no longer the frame it was published as
+    }
+    back_taken = true;
+    return back_target;
+}
+
+long FrameBuffer::publish(int width, int height, const std::vector<Tile> *changed, long base_version, std::shared_ptr<const RenderStats> stats)
+{
+    // not through back(), the renderer's own reference to the target would look like a reader's
+    if (!back_target)
+    {
+        back_target = std::make_shared<RenderTarget>(FramePixels(), 0, 0);
+    }
+    RenderTarget &target = *back_target;
+    target.width = width;
+    target.height = height;
+    target.pixels.resize(size_t(width) * height, Color()); // readers can count on a full frame, black where a render failed
+    target.changed_tiles = (changed != nullptr) ? *changed : std::vector<Tile>();
+    target.base_version = (changed != nullptr) ? base_version : 0;
+    target.stats = stats;
+    target.version = RenderTarget::next_version();
+
+    std::shared_ptr<RenderTarget> previous = std::atomic_exchange(&front_target, back_target);
+    front_version = target.version;
+    back_target = previous;
+    back_taken = false;
+    return target.version;
+}
+
+std::shared_ptr<const RenderTarget> FrameBuffer::front() const
+{
+    return std::atomic_load(&front_target);
+}
+
+long FrameBuffer::version() const
+{
+    return front_version;
+}
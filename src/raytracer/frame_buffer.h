@@ -0,0 +1,38 @@
+#ifndef FRAME_BUFFER_H
+#define FRAME_BUFFER_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "renderTarget.h"
+
+// the pair of render targets between the renderer and whoever shows its frames.
+// The renderer fills the back target in place and publish() swaps it to the front. Readers take the front target
+// and keep it as long as they need, it's never written again while anyone holds it, and they never block the renderer.
+// One renderer at a time, any number of readers
+class FrameBuffer
+{
+public:
+    FrameBuffer();
+
+    FrameBuffer(const FrameBuffer &) = delete;
+    FrameBuffer &operator=(const FrameBuffer &) = delete;
+
+    // the target to render the next frame into, its pixels are whatever frame it held before
+    std::shared_ptr<RenderTarget> back();
+    // the back target becomes the front one as a width x height frame. changed, when given, lists the only tiles
+    // that differ from the frame of base_version. Returns the version of the new front target
+    long publish(int width, int height, const std::vector<Tile> *changed = nullptr, long base_version = 0,
+                 std::shared_ptr<const RenderStats> stats = nullptr);
+
+    std::shared_ptr<const RenderTarget> front() const;
+    long version() const; // of the front target, for polling without taking it
+
+private:
+    std::shared_ptr<RenderTarget> front_target; // only through std::atomic_load and std::atomic_exchange
+    std::shared_ptr<RenderTarget> back_target;
+    bool back_taken; // by back() since the last publish, a render that didn't finish may have left it half written
+    std::atomic<long> front_version;
+};
+
+#endif
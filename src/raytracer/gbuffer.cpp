@@ -0,0 +1,96 @@
+#include "gbuffer.h"
+#include "camera.h"
+
+static bool same_vector(const Vector3d &a, const Vector3d &b)
+{
+    return a.e[0] == b.e[0] && a.e[1] == b.e[1] && a.e[2] == b.e[2];
+}
+
+// the wasm heap is 64 MB in all, frame included
+#ifdef __EMSCRIPTEN__
+static const size_t default_max_bytes = size_t(16) << 20;
+#else
+static const size_t default_max_bytes = size_t(128) << 20;
+#endif
+
+GBuffer::GBuffer()
+    : valid(false),
+      max_bytes(default_max_bytes),
+      last_trace_ms(0),
+      last_reshade_ms(0),
+      width(0),
+      height(0),
+      samples_per_pixel(0),
+      vfov(0),
+      defocus_angle(0),
+      focus_distance(0)
+{
+}
+
+void GBuffer::invalidate()
+{
+    valid = false;
+}
+
+void GBuffer::release()
+{
+    valid = false;
+    std::vector<PrimaryHit>().swap(hits);
+}
+
+size_t GBuffer::bytes() const
+{
+    return hits.capacity() * sizeof(PrimaryHit);
+}
+
+bool GBuffer::fits(int width, int height, int samples_per_pixel) const
+{
+    // in double, the product can overflow a 32-bit size_t
+    return double(width) * height * samples_per_pixel * sizeof(PrimaryHit) <= double(max_bytes);
+}
+
+void GBuffer::prepare(const Camera &camera)
+{
+    width = camera.image_width;
+    height = camera.image_height;
+    samples_per_pixel = camera.samples_per_pixel;
+    vfov = camera.vfov;
+    lookFrom = camera.lookFrom;
+    lookAt = camera.lookAt;
+    vector_up = camera.vector_up;
+    defocus_angle = camera.defocus_angle;
+    focus_distance = camera.focus_distance;
+
+    // a smaller frame doesn't keep the hits of a bigger one around
+    size_t count = size_t(width) * height * samples_per_pixel;
+    if (hits.capacity() > count)
+    {
+        std::vector<PrimaryHit>().swap(hits);
+    }
+    hits.resize(count);
+    valid = false; // until the render filling it completes
+}
+
+bool GBuffer::matches(const Camera &camera) const
+{
+    return valid &&
+           width == camera.image_width &&
+           height == camera.image_height &&
+           samples_per_pixel == camera.samples_per_pixel &&
+           vfov == camera.vfov &&
+           same_vector(lookFrom, camera.lookFrom) &&
+           same_vector(lookAt, camera.lookAt) &&
+           same_vector(vector_up, camera.vector_up) &&
+           defocus_angle == camera.defocus_angle &&
+           focus_distance == camera.focus_distance;
+}
+
+PrimaryHit &GBuffer::at(int pixel, int sample)
+{
+    return hits[size_t(pixel) * samples_per_pixel + sample];
+}
+
+const PrimaryHit &GBuffer::at(int pixel, int sample) const
+{
+    return hits[size_t(pixel) * samples_per_pixel + sample];
+}
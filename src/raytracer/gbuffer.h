@@ -0,0 +1,58 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include <vector>
+#include "vector3d.h"
+
+class IHittable;
+class IMaterial;
+class Camera;
+
+// what a primary ray hit, enough to resume shading without re-tracing it. Plain floats, 48 bytes: the ray is
+// rebuilt from the camera, the lens position and p, and front_face from the ray and the outwards normal
+struct PrimaryHit
+{
+    const IHittable *object; // nullptr when the ray missed everything
+    const IMaterial *material;
+    float p[3];      // on a miss the ray direction, for the sky
+    float normal[3]; // outwards
+    float lens[2];   // where the ray left the defocus disk, in units of its radius
+};
+
+// per-sample primary hits of the last full render
+class GBuffer
+{
+public:
+    GBuffer();
+
+    std::vector<PrimaryHit> hits; // pixel-major, samples_per_pixel entries per pixel
+    bool valid;
+    size_t max_bytes; // caching is skipped for renders whose hits would take more
+
+    double last_trace_ms;   // full render that filled the cache
+    double last_reshade_ms; // last render that started from the cache
+
+    void invalidate();
+    void release(); // invalidates and frees the hits
+    size_t bytes() const; // held now
+    bool fits(int width, int height, int samples_per_pixel) const;
+    void prepare(const Camera &camera);
+    bool matches(const Camera &camera) const;
+
+    PrimaryHit &at(int pixel, int sample);
+    const PrimaryHit &at(int pixel, int sample) const;
+
+private:
+    // view the cache was traced with
+    int width;
+    int height;
+    int samples_per_pixel;
+    double vfov;
+    Point3d lookFrom;
+    Point3d lookAt;
+    Vector3d vector_up;
+    double defocus_angle;
+    double focus_distance;
+};
+
+#endif
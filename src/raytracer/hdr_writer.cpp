@@ -0,0 +1,332 @@
+#include "hdr_writer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <zlib.h>
+
+ImageLayer::ImageLayer() : full_precision(false) {}
+
+ImageLayer color_layer(const std::string &name, const FramePixels &pixels)
+{
+    ImageLayer layer;
+    layer.name = name;
+    layer.channels = {"R", "G", "B"};
+    layer.data.resize(pixels.size() * 3);
+    for (size_t i = 0; i < pixels.size(); i++)
+    {
+        for (int c = 0; c < 3; c++)
+            layer.data[i * 3 + c] = static_cast<float>(pixels[i][c]);
+    }
+    return layer;
+}
+
+ExrOptions::ExrOptions() : half(false), compress(true) {}
+
+static void put_le32(std::vector<uint8_t> &out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        out.push_back(uint8_t(value >> (8 * i)));
+}
+
+static void put_le64(std::vector<uint8_t> &out, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        out.push_back(uint8_t(value >> (8 * i)));
+}
+
+static void put_float(std::vector<uint8_t> &out, float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, 4);
+    put_le32(out, bits);
+}
+
+static void put_string(std::vector<uint8_t> &out, const std::string &text)
+{
+    out.insert(out.end(), text.begin(), text.end());
+    out.push_back(0);
+}
+
+// round to nearest even, overflow goes to infinity
+static uint16_t float_to_half(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, 4);
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t mantissa = bits & 0x7fffff;
+    int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+
+    if (((bits >> 23) & 0xff) == 0xff)
+        return uint16_t(sign | 0x7c00 | (mantissa ? 0x200 : 0)); // infinity, nan
+    if (exponent >= 31)
+        return uint16_t(sign | 0x7c00);
+
+    uint32_t half;
+    uint32_t rest;
+    uint32_t halfway;
+    if (exponent <= 0)
+    {
+        // subnormal, in units of 2^-24
+        if (exponent < -10)
+            return uint16_t(sign);
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        half = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    }
+    else
+    {
+        half = (uint32_t(exponent) << 10) | (mantissa >> 13);
+        rest = mantissa & 0x1fff;
+        halfway = 0x1000;
+    }
+
+    if (rest > halfway || (rest == halfway && (half & 1)))
+        half++; // a carry into the exponent is still the right value
+    return uint16_t(sign | half);
+}
+
+#pragma region exr
+struct ExrChannel
+{
+    std::string name;
+    const ImageLayer *layer;
+    size_t index; // within the layer
+    bool half;
+};
+
+// the zip codec's preprocessing: bytes split into even and odd halves, then delta coded
+static std::vector<uint8_t> exr_zip_predict(const std::vector<uint8_t> &raw)
+{
+    std::vector<uint8_t> out(raw.size());
+    size_t half = (raw.size() + 1) / 2;
+    for (size_t i = 0; i < raw.size(); i++)
+        out[(i & 1) ? half + i / 2 : i / 2] = raw[i];
+
+    int previous = out.empty() ? 0 : out[0];
+    for (size_t i = 1; i < out.size(); i++)
+    {
+        int current = out[i];
+        out[i] = uint8_t(current - previous + 128 + 256);
+        previous = current;
+    }
+    return out;
+}
+
+std::vector<uint8_t> encode_exr(const std::vector<ImageLayer> &layers, int width, int height, const ExrOptions &options)
+{
+    std::vector<ExrChannel> channels;
+    size_t pixels = size_t(width) * height;
+    for (const ImageLayer &layer : layers)
+    {
+        if (layer.channels.empty() || layer.data.size() != pixels * layer.channels.size())
+            return {};
+
+        for (size_t c = 0; c < layer.channels.size(); c++)
+        {
+            ExrChannel channel;
+            channel.name = layer.name.empty() ? layer.channels[c] : layer.name + "." + layer.channels[c];
+            channel.layer = &layer;
+            channel.index = c;
+            channel.half = options.half && !layer.full_precision;
+            channels.push_back(channel);
+        }
+    }
+    if (channels.empty() || width <= 0 || height <= 0)
+        return {};
+
+    // readers expect the channel list sorted by name
+    std::sort(channels.begin(), channels.end(), [](const ExrChannel &a, const ExrChannel &b)
+              { return a.name < b.name; });
+
+    std::vector<uint8_t> header = {0x76, 0x2f, 0x31, 0x01};
+    put_le32(header, 2); // version 2, single part scanline
+
+    auto attribute = [&header](const std::string &name, const std::string &type, const std::vector<uint8_t> &value)
+    {
+        put_string(header, name);
+        put_string(header, type);
+        put_le32(header, static_cast<uint32_t>(value.size()));
+        header.insert(header.end(), value.begin(), value.end());
+    };
+
+    std::vector<uint8_t> value;
+    for (const ExrChannel &channel : channels)
+    {
+        put_string(value, channel.name);
+        put_le32(value, channel.half ? 1 : 2); // half, float
+        put_le32(value, 0);                    // not perceptually linear, reserved
+        put_le32(value, 1);                    // x sampling
+        put_le32(value, 1);                    // y sampling
+    }
+    value.push_back(0);
+    attribute("channels", "chlist", value);
+
+    attribute("compression", "compression", {uint8_t(options.compress ? 3 : 0)}); // zip or none
+
+    value.clear();
+    put_le32(value, 0);
+    put_le32(value, 0);
+    put_le32(value, width - 1);
+    put_le32(value, height - 1);
+    attribute("dataWindow", "box2i", value);
+    attribute("displayWindow", "box2i", value);
+
+    attribute("lineOrder", "lineOrder", {0}); // increasing y
+
+    value.clear();
+    put_float(value, 1);
+    attribute("pixelAspectRatio", "float", value);
+
+    value.clear();
+    put_float(value, 0);
+    put_float(value, 0);
+    attribute("screenWindowCenter", "v2f", value);
+
+    value.clear();
+    put_float(value, 1);
+    attribute("screenWindowWidth", "float", value);
+    header.push_back(0);
+
+    int lines_per_block = options.compress ? 16 : 1;
+    int blocks = (height + lines_per_block - 1) / lines_per_block;
+    std::vector<std::vector<uint8_t>> chunks(blocks);
+
+    for (int block = 0; block < blocks; block++)
+    {
+        int y0 = block * lines_per_block;
+        int y1 = std::min(height, y0 + lines_per_block);
+
+        // per scanline, each channel's whole row in turn
+        std::vector<uint8_t> raw;
+        for (int y = y0; y < y1; y++)
+        {
+            for (const ExrChannel &channel : channels)
+            {
+                size_t stride = channel.layer->channels.size();
+                const float *row = &channel.layer->data[size_t(y) * width * stride + channel.index];
+                for (int x = 0; x < width; x++)
+                {
+                    float sample = row[size_t(x) * stride];
+                    if (channel.half)
+                    {
+                        uint16_t bits = float_to_half(sample);
+                        raw.push_back(uint8_t(bits));
+                        raw.push_back(uint8_t(bits >> 8));
+                    }
+                    else
+                    {
+                        put_float(raw, sample);
+                    }
+                }
+            }
+        }
+
+        std::vector<uint8_t> data;
+        if (options.compress)
+        {
+            std::vector<uint8_t> predicted = exr_zip_predict(raw);
+            uLongf size = compressBound(static_cast<uLong>(predicted.size()));
+            data.resize(size);
+            if (compress2(data.data(), &size, predicted.data(), static_cast<uLong>(predicted.size()), Z_DEFAULT_COMPRESSION) != Z_OK)
+                return {};
+            data.resize(size);
+        }
+
+        // a block that doesn't shrink is stored as is, readers tell by its size
+        if (!options.compress || data.size() >= raw.size())
+            data.swap(raw);
+
+        std::vector<uint8_t> &chunk = chunks[block];
+        put_le32(chunk, static_cast<uint32_t>(y0));
+        put_le32(chunk, static_cast<uint32_t>(data.size()));
+        chunk.insert(chunk.end(), data.begin(), data.end());
+    }
+
+    std::vector<uint8_t> out;
+    out.swap(header);
+    uint64_t offset = out.size() + size_t(blocks) * 8;
+    for (const std::vector<uint8_t> &chunk : chunks)
+    {
+        put_le64(out, offset);
+        offset += chunk.size();
+    }
+    for (const std::vector<uint8_t> &chunk : chunks)
+        out.insert(out.end(), chunk.begin(), chunk.end());
+    return out;
+}
+#pragma endregion
+
+static bool write_bytes(const std::string &path, const std::vector<uint8_t> &bytes)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        std::cerr << "Could not open file for writing: " << path << std::endl;
+        return false;
+    }
+
+    bool ok = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    ok = (fclose(file) == 0) && ok;
+    if (!ok)
+        std::cerr << "Could not write image: " << path << std::endl;
+    return ok;
+}
+
+bool write_exr_file(const std::string &path, const std::vector<ImageLayer> &layers, int width, int height, const ExrOptions &options)
+{
+    std::vector<uint8_t> bytes = encode_exr(layers, width, height, options);
+    if (bytes.empty())
+    {
+        std::cerr << "Could not encode EXR: " << path << std::endl;
+        return false;
+    }
+    return write_bytes(path, bytes);
+}
+
+std::vector<uint8_t> encode_pfm(const ImageLayer &layer, int width, int height)
+{
+    size_t count = layer.channels.size();
+    if ((count != 1 && count != 3) || width <= 0 || height <= 0 || layer.data.size() != size_t(width) * height * count)
+        return {};
+
+    // negative scale for little endian, rows bottom to top
+    std::string header = std::string(count == 3 ? "PF" : "Pf") + "\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+    std::vector<uint8_t> bytes(header.begin(), header.end());
+    bytes.reserve(bytes.size() + layer.data.size() * 4);
+    for (int y = height - 1; y >= 0; y--)
+    {
+        const float *row = &layer.data[size_t(y) * width * count];
+        for (size_t i = 0; i < size_t(width) * count; i++)
+            put_float(bytes, row[i]);
+    }
+    return bytes;
+}
+
+bool write_pfm_file(const std::string &path, const std::vector<ImageLayer> &layers, int width, int height)
+{
+    bool ok = !layers.empty();
+    for (size_t l = 0; l < layers.size(); l++)
+    {
+        std::vector<uint8_t> bytes = encode_pfm(layers[l], width, height);
+        if (bytes.empty())
+        {
+            std::cerr << "PFM can't hold layer " << layers[l].name << std::endl;
+            ok = false;
+            continue;
+        }
+
+        std::string layer_path = path;
+        if (l > 0)
+        {
+            size_t dot = path.rfind('.');
+            size_t slash = path.find_last_of('/');
+            size_t at = (dot == std::string::npos || (slash != std::string::npos && dot < slash)) ? path.size() : dot;
+            layer_path.insert(at, "." + layers[l].name);
+        }
+        ok = write_bytes(layer_path, bytes) && ok;
+    }
+    return ok;
+}
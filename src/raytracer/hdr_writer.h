@@ -0,0 +1,39 @@
+#ifndef HDR_WRITER_H
+#define HDR_WRITER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "color.h"
+
+// one named layer of a linear float image, channels interleaved per pixel
+struct ImageLayer
+{
+    std::string name;                  // empty for the beauty layer
+    std::vector<std::string> channels; // e.g. "R", "G", "B" or "Z"
+    std::vector<float> data;
+    bool full_precision;               // stays 32-bit in half precision files, for depths and counts
+
+    ImageLayer();
+};
+
+ImageLayer color_layer(const std::string &name, const FramePixels &pixels);
+
+struct ExrOptions
+{
+    bool half;     // 16-bit float for the color channels
+    bool compress; // zip, 16 scanlines per block
+
+    ExrOptions();
+};
+
+// single part, scanline EXR with every layer's channels as "layer.channel"
+std::vector<uint8_t> encode_exr(const std::vector<ImageLayer> &layers, int width, int height, const ExrOptions &options);
+bool write_exr_file(const std::string &path, const std::vector<ImageLayer> &layers, int width, int height, const ExrOptions &options);
+
+// one layer of one or three channels
+std::vector<uint8_t> encode_pfm(const ImageLayer &layer, int width, int height);
+// PFM holds one layer, the first goes to path and the others next to it as name.layer.pfm
+bool write_pfm_file(const std::string &path, const std::vector<ImageLayer> &layers, int width, int height);
+
+#endif
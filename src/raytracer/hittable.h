@@ -6,10 +6,12 @@
 using std::shared_ptr;
 #include "ray.h"
 #include "material.h"
+#include "aabb.h"
 #include "../utils/visitor.h"
 #include "../utils/math_utils.h"
 
 class Sphere3d;
+class IHittable;
 
 class HitRecord
 {
@@ -17,6 +19,7 @@ public:
     Point3d p;
     Vector3d normal;
     shared_ptr<IMaterial> material;
+    const IHittable *object;
     double t;
     bool front_face;
 
@@ -30,6 +33,7 @@ public:
     shared_ptr<IMaterial> material;
     virtual ~IHittable() = default;
     virtual bool hit(const Ray &r, Interval ray_t, HitRecord &record) const = 0;
+    virtual AABB bounding_box() const = 0;
 };
 
 
@@ -0,0 +1,478 @@
+#include "image_writer.h"
+#include "hdr_writer.h"
+#include "../utils/cpu_topology.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <zlib.h>
+
+static const size_t png_band_bytes = 512 << 10; // raw bytes deflated per task
+
+bool image_format_for_path(const std::string &path, ImageFormat &format)
+{
+    size_t dot = path.rfind('.');
+    std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    if (extension == "png")
+        format = IMAGE_FORMAT_PNG;
+    else if (extension == "qoi")
+        format = IMAGE_FORMAT_QOI;
+    else if (extension == "ppm")
+        format = IMAGE_FORMAT_PPM;
+    else if (extension == "pfm")
+        format = IMAGE_FORMAT_PFM;
+    else if (extension == "exr")
+        format = IMAGE_FORMAT_EXR;
+    else
+        return false;
+    return true;
+}
+
+const char *image_format_extension(ImageFormat format)
+{
+    switch (format)
+    {
+    case IMAGE_FORMAT_QOI:
+        return "qoi";
+    case IMAGE_FORMAT_PPM:
+        return "ppm";
+    case IMAGE_FORMAT_PFM:
+        return "pfm";
+    case IMAGE_FORMAT_EXR:
+        return "exr";
+    default:
+        return "png";
+    }
+}
+
+bool image_format_is_float(ImageFormat format)
+{
+    return format == IMAGE_FORMAT_PFM || format == IMAGE_FORMAT_EXR;
+}
+
+// 16-bit samples big-endian, as PNG and PPM store them
+static void to_rgb16(const Color *pixels, int count, uint8_t *rgb)
+{
+    for (int i = 0; i < count; i++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            uint16_t value = color_component_to_16(pixels[i][c]);
+            *rgb++ = uint8_t(value >> 8);
+            *rgb++ = uint8_t(value);
+        }
+    }
+}
+
+static void put_u32(uint8_t *out, uint32_t value)
+{
+    out[0] = uint8_t(value >> 24);
+    out[1] = uint8_t(value >> 16);
+    out[2] = uint8_t(value >> 8);
+    out[3] = uint8_t(value);
+}
+
+#pragma region png bands
+static uint8_t paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return uint8_t(a);
+    return uint8_t(pb <= pc ? b : c);
+}
+
+// per row the filter with the smallest sum of absolute differences, as libpng does by default
+static std::vector<uint8_t> filter_rows(const std::vector<uint8_t> &raw, const std::vector<uint8_t> &above, int width, int pixel_bytes)
+{
+    size_t stride = size_t(width) * pixel_bytes;
+    size_t count = raw.size() / stride;
+    std::vector<uint8_t> filtered;
+    filtered.reserve(count * (stride + 1));
+
+    std::vector<uint8_t> zero(stride, 0);
+    std::vector<uint8_t> candidates[4];
+    for (std::vector<uint8_t> &candidate : candidates)
+        candidate.resize(stride);
+    const uint8_t types[4] = {0, 1, 2, 4}; // none, sub, up, paeth
+
+    for (size_t row = 0; row < count; row++)
+    {
+        const uint8_t *line = &raw[row * stride];
+        const uint8_t *up = row > 0 ? &raw[(row - 1) * stride] : (above.empty() ? zero.data() : above.data());
+
+        for (size_t i = 0; i < stride; i++)
+        {
+            int left = i >= size_t(pixel_bytes) ? line[i - pixel_bytes] : 0;
+            int upper_left = i >= size_t(pixel_bytes) ? up[i - pixel_bytes] : 0;
+            candidates[0][i] = line[i];
+            candidates[1][i] = uint8_t(line[i] - left);
+            candidates[2][i] = uint8_t(line[i] - up[i]);
+            candidates[3][i] = uint8_t(line[i] - paeth(left, up[i], upper_left));
+        }
+
+        int best = 0;
+        unsigned long best_sum = ~0ul;
+        for (int f = 0; f < 4; f++)
+        {
+            unsigned long sum = 0;
+            for (size_t i = 0; i < stride; i++)
+                sum += candidates[f][i] < 128 ? candidates[f][i] : 256 - candidates[f][i];
+            if (sum < best_sum)
+            {
+                best_sum = sum;
+                best = f;
+            }
+        }
+
+        filtered.push_back(types[best]);
+        filtered.insert(filtered.end(), candidates[best].begin(), candidates[best].end());
+    }
+    return filtered;
+}
+
+// a raw deflate piece that ends on a byte boundary, so pieces concatenate into one stream. Only the last one is final
+static bool deflate_band(const std::vector<uint8_t> &raw, bool last, std::vector<uint8_t> &out)
+{
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    out.resize(deflateBound(&stream, raw.size()) + 16);
+    stream.next_in = const_cast<Bytef *>(raw.data());
+    stream.avail_in = static_cast<uInt>(raw.size());
+    stream.next_out = out.data();
+    stream.avail_out = static_cast<uInt>(out.size());
+
+    int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    bool ok = last ? result == Z_STREAM_END : (result == Z_OK && stream.avail_in == 0);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return ok;
+}
+#pragma endregion
+
+ImageWriter::ImageWriter(ImageFormat format, int width, int height, int nthreads, std::function<bool(const uint8_t *, size_t)> sink, int bit_depth)
+    : format(format),
+      width(width),
+      height(height),
+      nthreads(std::max(1, nthreads)),
+      pixel_bytes(bit_depth == 16 ? 6 : 3),
+      sink(sink),
+      ok(width > 0 && height > 0 && !image_format_is_float(format) && (bit_depth == 8 || (bit_depth == 16 && format != IMAGE_FORMAT_QOI))),
+      finished(false),
+      rows(0),
+      rows_per_band(std::max<int>(1, png_band_bytes / (size_t(std::max(1, width)) * pixel_bytes + 1))),
+      adler(1),
+      zlib_started(false),
+      qoi_run(0)
+{
+    std::memset(qoi_index, 0, sizeof(qoi_index));
+    std::memset(qoi_previous, 0, sizeof(qoi_previous));
+
+    if (format == IMAGE_FORMAT_PNG)
+    {
+        static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        emit(signature, sizeof(signature));
+
+        uint8_t header[13];
+        put_u32(header, width);
+        put_u32(header + 4, height);
+        header[8] = uint8_t(pixel_bytes * 8 / 3); // bits per channel
+        header[9] = 2;  // rgb
+        header[10] = 0; // deflate
+        header[11] = 0; // adaptive filtering
+        header[12] = 0; // not interlaced
+        emit_chunk("IHDR", header, sizeof(header));
+    }
+    else if (format == IMAGE_FORMAT_QOI)
+    {
+        uint8_t header[14] = {'q', 'o', 'i', 'f'};
+        put_u32(header + 4, width);
+        put_u32(header + 8, height);
+        header[12] = 3; // rgb
+        header[13] = 0; // srgb
+        emit(header, sizeof(header));
+    }
+    else if (format == IMAGE_FORMAT_PPM)
+    {
+        std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + (pixel_bytes == 6 ? "\n65535\n" : "\n255\n");
+        emit(reinterpret_cast<const uint8_t *>(header.data()), header.size());
+    }
+}
+
+ImageWriter::~ImageWriter()
+{
+    // bands still in flight reference nothing of ours, but their results must be collected
+    for (std::future<Band> &band : compressing)
+    {
+        band.wait();
+    }
+}
+
+void ImageWriter::emit(const uint8_t *data, size_t size)
+{
+    if (ok && size > 0 && !sink(data, size))
+    {
+        ok = false;
+    }
+}
+
+void ImageWriter::emit_chunk(const char *type, const uint8_t *data, size_t size)
+{
+    std::vector<uint8_t> chunk(12 + size);
+    put_u32(chunk.data(), static_cast<uint32_t>(size));
+    std::memcpy(&chunk[4], type, 4);
+    if (size > 0)
+        std::memcpy(&chunk[8], data, size);
+    put_u32(&chunk[8 + size], static_cast<uint32_t>(crc32(0, &chunk[4], static_cast<uInt>(size + 4))));
+    emit(chunk.data(), chunk.size());
+}
+
+int ImageWriter::rows_written() const
+{
+    return rows;
+}
+
+void ImageWriter::rows_finished(const Color *rows, int y0, int y1)
+{
+    if (y0 != this->rows)
+    {
+        ok = false; // rows must arrive in order
+        return;
+    }
+    write_rows(rows, y1 - y0);
+}
+
+bool ImageWriter::write_rows(const Color *pixels, int count)
+{
+    count = std::min(count, height - rows);
+    if (!ok || finished || count <= 0)
+        return ok;
+
+    std::vector<uint8_t> rgb(size_t(width) * pixel_bytes * count);
+    if (pixel_bytes == 6)
+        to_rgb16(pixels, width * count, rgb.data());
+    else
+        colors_to_rgb8(pixels, size_t(width) * count, rgb.data()); // the viewport's encoding
+    rows += count;
+
+    if (format == IMAGE_FORMAT_PPM)
+    {
+        emit(rgb.data(), rgb.size());
+    }
+    else if (format == IMAGE_FORMAT_QOI)
+    {
+        for (int row = 0; row < count; row++)
+            encode_qoi_row(&rgb[size_t(row) * width * 3]);
+    }
+    else
+    {
+        size_t stride = size_t(width) * pixel_bytes;
+        for (int row = 0; row < count; row++)
+        {
+            band_rows.insert(band_rows.end(), rgb.begin() + row * stride, rgb.begin() + (row + 1) * stride);
+            if (band_rows.size() / stride == size_t(rows_per_band))
+            {
+                start_band(false);
+                drain_bands(nthreads); // bounded memory, and bytes leave as soon as they're in order
+            }
+        }
+    }
+    return ok;
+}
+
+void ImageWriter::start_band(bool last)
+{
+    std::vector<uint8_t> raw;
+    raw.swap(band_rows);
+    std::vector<uint8_t> above = previous_row;
+    size_t stride = size_t(width) * pixel_bytes;
+    if (raw.size() >= stride)
+        previous_row.assign(raw.end() - stride, raw.end());
+
+    int width = this->width, pixel_bytes = this->pixel_bytes;
+    auto compress = [raw, above, width, pixel_bytes, last]()
+    {
+        std::vector<uint8_t> filtered = filter_rows(raw, above, width, pixel_bytes);
+        Band band;
+        band.raw_size = filtered.size();
+        band.adler = static_cast<uint32_t>(adler32(1, filtered.data(), static_cast<uInt>(filtered.size())));
+        if (!deflate_band(filtered, last, band.deflated))
+            band.deflated.clear();
+        return band;
+    };
+
+#ifdef SINGLE_THREADED_BUILD
+    compressing.push_back(std::async(std::launch::deferred, compress));
+#else
+    compressing.push_back(std::async(nthreads > 1 ? std::launch::async : std::launch::deferred, compress));
+#endif
+}
+
+// writes finished bands in order until at most keep are still compressing
+void ImageWriter::drain_bands(size_t keep)
+{
+    while (compressing.size() > keep)
+    {
+        Band band = compressing.front().get();
+        compressing.pop_front();
+        bool last = finished && compressing.empty();
+
+        if (band.deflated.empty())
+            ok = false;
+        adler = static_cast<uint32_t>(adler32_combine(adler, band.adler, band.raw_size));
+
+        std::vector<uint8_t> data;
+        if (!zlib_started)
+        {
+            data.push_back(0x78); // zlib header: deflate, 32K window
+            data.push_back(0x9c);
+            zlib_started = true;
+        }
+        data.insert(data.end(), band.deflated.begin(), band.deflated.end());
+        if (last)
+        {
+            uint8_t trailer[4];
+            put_u32(trailer, adler);
+            data.insert(data.end(), trailer, trailer + 4);
+        }
+        emit_chunk("IDAT", data.data(), data.size());
+    }
+}
+
+// the QOI operations for one row, the run and index carry over to the next row
+void ImageWriter::encode_qoi_row(const uint8_t *rgb)
+{
+    std::vector<uint8_t> out;
+    out.reserve(size_t(width) * 4);
+
+    for (int x = 0; x < width; x++, rgb += 3)
+    {
+        if (std::memcmp(rgb, qoi_previous, 3) == 0)
+        {
+            if (++qoi_run == 62)
+            {
+                out.push_back(uint8_t(0xc0 | (qoi_run - 1)));
+                qoi_run = 0;
+            }
+            continue;
+        }
+
+        if (qoi_run > 0)
+        {
+            out.push_back(uint8_t(0xc0 | (qoi_run - 1)));
+            qoi_run = 0;
+        }
+
+        int hash = (rgb[0] * 3 + rgb[1] * 5 + rgb[2] * 7 + 255 * 11) % 64;
+        if (qoi_index[hash][3] == 255 && std::memcmp(qoi_index[hash], rgb, 3) == 0)
+        {
+            out.push_back(uint8_t(hash));
+        }
+        else
+        {
+            std::memcpy(qoi_index[hash], rgb, 3);
+            qoi_index[hash][3] = 255;
+
+            int dr = int8_t(rgb[0] - qoi_previous[0]);
+            int dg = int8_t(rgb[1] - qoi_previous[1]);
+            int db = int8_t(rgb[2] - qoi_previous[2]);
+            int dr_dg = dr - dg;
+            int db_dg = db - dg;
+
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+            {
+                out.push_back(uint8_t(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+            }
+            else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7)
+            {
+                out.push_back(uint8_t(0x80 | (dg + 32)));
+                out.push_back(uint8_t((dr_dg + 8) << 4 | (db_dg + 8)));
+            }
+            else
+            {
+                out.push_back(0xfe);
+                out.insert(out.end(), rgb, rgb + 3);
+            }
+        }
+        std::memcpy(qoi_previous, rgb, 3);
+    }
+    emit(out.data(), out.size());
+}
+
+bool ImageWriter::finish()
+{
+    if (finished)
+        return ok;
+    finished = true;
+
+    if (rows != height)
+        ok = false;
+
+    if (format == IMAGE_FORMAT_PNG)
+    {
+        start_band(true);
+        drain_bands(0);
+        emit_chunk("IEND", nullptr, 0);
+    }
+    else if (format == IMAGE_FORMAT_QOI)
+    {
+        if (qoi_run > 0)
+        {
+            uint8_t run = uint8_t(0xc0 | (qoi_run - 1));
+            emit(&run, 1);
+            qoi_run = 0;
+        }
+        static const uint8_t end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+        emit(end, sizeof(end));
+    }
+    return ok;
+}
+
+std::vector<uint8_t> encode_image(ImageFormat format, const FramePixels &pixels, int width, int height, int nthreads)
+{
+    if (format == IMAGE_FORMAT_EXR)
+        return encode_exr({color_layer("", pixels)}, width, height, ExrOptions());
+    if (format == IMAGE_FORMAT_PFM)
+        return encode_pfm(color_layer("", pixels), width, height);
+
+    std::vector<uint8_t> bytes;
+    ImageWriter writer(format, width, height, nthreads, [&bytes](const uint8_t *data, size_t size)
+                       {
+                           bytes.insert(bytes.end(), data, data + size);
+                           return true; });
+    if (pixels.size() < size_t(width) * height || !writer.write_rows(pixels.data(), height) || !writer.finish())
+        bytes.clear();
+    return bytes;
+}
+
+bool write_image_file(const std::string &path, ImageFormat format, const FramePixels &pixels, int width, int height, int nthreads)
+{
+    if (format == IMAGE_FORMAT_EXR)
+        return write_exr_file(path, {color_layer("", pixels)}, width, height, ExrOptions());
+    if (format == IMAGE_FORMAT_PFM)
+        return write_pfm_file(path, {color_layer("", pixels)}, width, height);
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        std::cerr << "Could not open file for writing: " << path << std::endl;
+        return false;
+    }
+
+    bool ok;
+    {
+        ImageWriter writer(format, width, height, nthreads, [file](const uint8_t *data, size_t size)
+                           { return fwrite(data, 1, size, file) == size; });
+        ok = pixels.size() >= size_t(width) * height && writer.write_rows(pixels.data(), height) && writer.finish();
+    }
+    ok = (fclose(file) == 0) && ok;
+    if (!ok)
+        std::cerr << "Could not write image: " << path << std::endl;
+    return ok;
+}
@@ -0,0 +1,93 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+#include "color.h"
+
+enum ImageFormat
+{
+    IMAGE_FORMAT_PNG,
+    IMAGE_FORMAT_QOI, // lossless and several times faster than PNG, for large intermediates
+    IMAGE_FORMAT_PPM, // binary P6, no compression at all
+    IMAGE_FORMAT_PFM, // linear 32-bit float, see hdr_writer.h
+    IMAGE_FORMAT_EXR, // linear half or float, zip compressed, with render pass layers
+};
+
+// by file extension, false when it isn't one of the formats
+bool image_format_for_path(const std::string &path, ImageFormat &format);
+const char *image_format_extension(ImageFormat format);
+// linear float formats keep the full range, they are written whole instead of streamed
+bool image_format_is_float(ImageFormat format);
+
+// receives the rows of a frame in order as the tiles covering them finish
+class IRowSink
+{
+public:
+    virtual ~IRowSink() = default;
+    virtual void rows_finished(const Color *rows, int y0, int y1) = 0;
+};
+
+// encodes an 8- or 16-bit image as its rows arrive, in order, and hands the bytes to a sink as soon as they're final.
+// PNG rows are filtered and deflated in bands on up to nthreads threads, and joined into one stream.
+// Float formats can't be streamed and fail here, and QOI has no 16-bit mode
+class ImageWriter : public IRowSink
+{
+public:
+    // sink returns false on a write error, which fails the rest of the image
+    ImageWriter(ImageFormat format, int width, int height, int nthreads, std::function<bool(const uint8_t *, size_t)> sink, int bit_depth = 8);
+    ~ImageWriter();
+
+    void rows_finished(const Color *rows, int y0, int y1) override;
+    bool write_rows(const Color *rows, int count);
+    int rows_written() const;
+    // after the last row, false if any write failed
+    bool finish();
+
+private:
+    struct Band
+    {
+        std::vector<uint8_t> deflated;
+        uint32_t adler;
+        size_t raw_size;
+    };
+
+    ImageFormat format;
+    int width;
+    int height;
+    int nthreads;
+    int pixel_bytes; // 3 or 6 at 16 bits
+    std::function<bool(const uint8_t *, size_t)> sink;
+    bool ok;
+    bool finished;
+    int rows;
+
+    // png: raw rows of the band being filled, the row above it for the filters, bands being compressed
+    std::vector<uint8_t> band_rows;
+    std::vector<uint8_t> previous_row;
+    int rows_per_band;
+    std::deque<std::future<Band>> compressing;
+    uint32_t adler;
+    bool zlib_started;
+
+    // qoi: encoder state carried across rows
+    uint8_t qoi_index[64][4]; // rgba, alpha 0 marks unused entries
+    uint8_t qoi_previous[3];
+    int qoi_run;
+
+    void emit(const uint8_t *data, size_t size);
+    void emit_chunk(const char *type, const uint8_t *data, size_t size);
+    void start_band(bool last);
+    void drain_bands(size_t keep);
+    void encode_qoi_row(const uint8_t *rgb);
+};
+
+// the whole image at once, into memory or a file. Float formats hold just these pixels as their beauty layer
+std::vector<uint8_t> encode_image(ImageFormat format, const FramePixels &pixels, int width, int height, int nthreads);
+bool write_image_file(const std::string &path, ImageFormat format, const FramePixels &pixels, int width, int height, int nthreads);
+
+#endif
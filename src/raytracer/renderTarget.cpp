@@ -1,4 +1,6 @@
 #include "renderTarget.h"
+#include <algorithm>
+#include <atomic>
 #include <random>
 #include <sstream>
 
@@ -6,27 +8,38 @@
 #include <emscripten.h>
 #endif
 
-#include <fstream>
-#include <png.h>
+#include "image_writer.h"
+#include "../utils/cpu_topology.h"
 
 #ifdef __EMSCRIPTEN__
-EM_JS(void, download_image_js, (const char *format, const uint8_t *data, size_t size), {
-    console.log('Downloading image...');
-    var data = new Uint8Array(HEAPU8.buffer, data, size);
-    var blob = new Blob([data], { type: 'application/octet-stream' });
-    var url = URL.createObjectURL(blob);
-    var a = document.createElement('a');
-    a.href = url;
-    a.download = 'image.' + UTF8ToString(format);
-    document.body.appendChild(a);
-    a.click();
-    document.body.removeChild(a);
-    URL.revokeObjectURL(url);
-});
+// views also save from the render thread, in the pthreads build that's a worker without a document.
+// The bytes are copied out of the heap, a Blob won't take a view of shared memory
+static void download_image(const char *format, const uint8_t *data, size_t size)
+{
+    MAIN_THREAD_EM_ASM({
+        console.log('Downloading image...');
+        var blob = new Blob([HEAPU8.slice($1, $1 + $2)], { type: 'application/octet-stream' });
+        var url = URL.createObjectURL(blob);
+        var a = document.createElement('a');
+        a.href = url;
+        a.download = 'image.' + UTF8ToString($0);
+        document.body.appendChild(a);
+        a.click();
+        document.body.removeChild(a);
+        URL.revokeObjectURL(url);
+    }, format, data, size);
+}
 #endif
 
-RenderTarget::RenderTarget(std::vector<Color> pixels, int width, int height)
-    : width(width), height(height), pixels(pixels)
+static std::atomic<long> render_target_versions{0};
+
+long RenderTarget::next_version()
+{
+    return ++render_target_versions;
+}
+
+RenderTarget::RenderTarget(FramePixels pixels, int width, int height)
+    : base_version(0), pixels(std::move(pixels)), width(width), height(height), version(next_version())
 {
     std::stringstream ss;
     std::random_device rd;
@@ -63,182 +76,88 @@ int RenderTarget::getHeight() const
     return height;
 }
 
-std::vector<Color> RenderTarget::getPixels() const
+const FramePixels &RenderTarget::getPixels() const
 {
     return pixels;
 }
 
+const Color *RenderTarget::data() const
+{
+    return pixels.data();
+}
+
 std::string RenderTarget::getIdentifier() const
 {
     return identifier;
 }
 
-
-
-#pragma region images
-void RenderTarget::save_image(const std::string &format)
+long RenderTarget::getVersion() const
 {
-    std::clog << "Saving image..." << std::endl;
-
-    std::string path = "/tmp/image_" + std::to_string(rand()) + "." + format;
-
-    if (format == "png")
-    {
-        std::vector<uint8_t> imageData;
-        imageData = save_png_to_memory();
-
-        #ifdef __EMSCRIPTEN__
-        download_image_js(format.c_str(), imageData.data(), imageData.size());
-        #else
-        save_png_to_file(path);
-        #endif
-    }
-    else
-    {
-        std::cerr << "Unsupported image format: " << format << std::endl;
-    }
-
-    std::clog << "Image saved to " << path << std::endl;
+    return version;
 }
 
-
-
-std::vector<uint8_t> RenderTarget::save_png_to_memory()
+FramePixels &RenderTarget::pixel_buffer()
 {
-    std::vector<uint8_t> imageData;
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    png_infop info = png_create_info_struct(png);
+    return pixels;
+}
 
-    if (!png || !info)
+void RenderTarget::copy_frame(const RenderTarget &frame)
+{
+    bool same_size = width == frame.width && height == frame.height && pixels.size() == frame.pixels.size();
+    if (!same_size || frame.base_version == 0 || frame.base_version != version)
     {
-        std::cerr << "Could not initialize PNG write struct." << std::endl;
-        return imageData;
+        pixels = frame.pixels;
+        width = frame.width;
+        height = frame.height;
+        version = frame.version;
+        return;
     }
 
-    png_set_IHDR(
-        png,
-        info,
-        width,
-        height,
-        8,
-        PNG_COLOR_TYPE_RGB,
-        PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_DEFAULT,
-        PNG_FILTER_TYPE_DEFAULT);
-
-    png_byte **row_pointers = new png_byte *[height];
-    for (int y = 0; y < height; y++)
+    for (const Tile &tile : frame.changed_tiles)
     {
-        row_pointers[y] = new png_byte[3 * width];
-        for (int x = 0; x < width; x++)
+        for (int y = tile.y0; y < tile.y1; y++)
         {
-            int i = y * width + x;
-            Color pixel = pixels[i];
-            row_pointers[y][x * 3] = static_cast<uint8_t>(255.99 * pixel.x());
-            row_pointers[y][x * 3 + 1] = static_cast<uint8_t>(255.99 * pixel.y());
-            row_pointers[y][x * 3 + 2] = static_cast<uint8_t>(255.99 * pixel.z());
+            size_t row = size_t(y) * width;
+            std::copy(frame.pixels.begin() + row + tile.x0, frame.pixels.begin() + row + tile.x1, pixels.begin() + row + tile.x0);
         }
     }
-
-    png_set_rows(png, info, row_pointers);
-
-    png_set_write_fn(png, &imageData, [](png_structp png, png_bytep data, png_size_t length) {
-        std::vector<uint8_t> *p = static_cast<std::vector<uint8_t> *>(png_get_io_ptr(png));
-        p->insert(p->end(), data, data + length);
-    }, nullptr);
-
-    png_write_png(png, info, PNG_TRANSFORM_IDENTITY, nullptr);
-
-    for (int y = 0; y < height; y++)
-    {
-        delete[] row_pointers[y];
-    }
-    delete[] row_pointers;
-
-    png_destroy_write_struct(&png, &info);
-
-    return imageData;
+    version = frame.version;
 }
 
-void RenderTarget::save_png_to_file(const std::string &filename)
-{
-    FILE *fp = fopen(filename.c_str(), "wb");
-
-    if (!fp)
-    {
-        std::cerr << "Could not open file for writing: " << filename << std::endl;
-        return;
-    }
-
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png)
-    {
-        std::cerr << "Could not create write struct." << std::endl;
-        fclose(fp);
-        return;
-    }
 
-    png_infop info = png_create_info_struct(png);
-    if (!info)
-    {
-        std::cerr << "Could not create info struct." << std::endl;
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
-        return;
-    }
+#pragma region images
+void RenderTarget::save_image(const std::string &format) const
+{
+    std::clog << "Saving image..." << std::endl;
 
-    if (setjmp(png_jmpbuf(png)))
+    ImageFormat image_format;
+    if (!image_format_for_path("." + format, image_format))
     {
-        std::cerr << "Error during png creation." << std::endl;
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
+        std::cerr << "Unsupported image format: " << format << std::endl;
         return;
     }
 
-    png_init_io(png, fp);
-
-    png_set_IHDR(
-        png,
-        info,
-        width,
-        height,
-        8,
-        PNG_COLOR_TYPE_RGB,
-        PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_DEFAULT,
-        PNG_FILTER_TYPE_DEFAULT);
-
-    png_write_info(png, info);
-
-    png_bytep row = (png_bytep) malloc(3 * width * sizeof(png_byte));
-    if (!row)
+    #ifdef __EMSCRIPTEN__
+    std::vector<uint8_t> imageData = encode_image(image_format, pixels, width, height, CpuTopology::get().usable_threads());
+    download_image(format.c_str(), imageData.data(), imageData.size());
+    std::clog << "Image downloaded" << std::endl;
+    #else
+    std::string path = "/tmp/image_" + std::to_string(rand()) + "." + format;
+    if (write_image_file(path, image_format, pixels, width, height, CpuTopology::get().usable_threads()))
     {
-        std::cerr << "Could not allocate memory for row." << std::endl;
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
-        return;
-    }
-
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int i = y * width + x;
-            if (i >= (int)pixels.size()) {
-                std::cerr << "Index out of bounds: " << i << std::endl;
-                break;
-            }
-            Color pixel = pixels[i];
-            row[x*3] = (unsigned char)(255.99 * pixel.x());
-            row[x*3 + 1] = (unsigned char)(255.99 * pixel.y());
-            row[x*3 + 2] = (unsigned char)(255.99 * pixel.z());
-        }
-        png_write_row(png, row);
+        std::clog << "Image saved to " << path << std::endl;
     }
+    #endif
+}
 
-    free(row);
-    png_write_end(png, NULL);
-    fclose(fp);
+std::vector<uint8_t> RenderTarget::save_png_to_memory() const
+{
+    return encode_image(IMAGE_FORMAT_PNG, pixels, width, height, CpuTopology::get().usable_threads());
+}
 
-    png_destroy_write_struct(&png, &info);
+bool RenderTarget::save_png_to_file(const std::string &filename) const
+{
+    return write_image_file(filename, IMAGE_FORMAT_PNG, pixels, width, height, CpuTopology::get().usable_threads());
 }
 
 #pragma endregion
\ No newline at end of file
@@ -2,30 +2,51 @@
 #define RENDERTARGET_H
 
 #include "color.h"
+#include "camera.h"
 #include <stdint.h>
+#include <memory>
+#include <string>
 #include <vector>
 
 class RenderTarget //has a vector of Color, width and height
 {
 public :
-    RenderTarget(std::vector<Color> pixels, int width, int height);
+    RenderTarget(FramePixels pixels, int width, int height);
     ~RenderTarget();
     void setPixel(int x, int y, Color color);
     Color getPixel(int x, int y) const;
     int getWidth() const;
     int getHeight() const;
-    std::vector<Color> getPixels() const;
+    const FramePixels &getPixels() const;
+    const Color *data() const;
     std::string getIdentifier() const;
+    long getVersion() const; // increases with every render target made or published
 
-    void save_image(const std::string &format);
-    void save_png_to_file(const std::string &filename);
-    std::vector<uint8_t> save_png_to_memory();
+    // the pixels in place, for the renderer filling a back buffer, see FrameBuffer
+    FramePixels &pixel_buffer();
+    // becomes a copy of frame; only its changed tiles when this still holds the frame it changed
+    void copy_frame(const RenderTarget &frame);
+
+    // the tiles that differ from the render target of base_version, when set by whoever made this one.
+    // A viewport still showing base_version only needs to update these
+    std::vector<Tile> changed_tiles;
+    long base_version;
+    std::shared_ptr<const RenderStats> stats; // of the render that made it, none for previews
+
+    void save_image(const std::string &format) const;
+    bool save_png_to_file(const std::string &filename) const; // false when the file could not be written
+    std::vector<uint8_t> save_png_to_memory() const;
 
 private:
-    std::vector<Color> pixels;
+    friend class FrameBuffer;
+
+    FramePixels pixels;
     int width;
     int height;
     std::string identifier;
+    long version;
+
+    static long next_version();
 };
 
 #endif
\ No newline at end of file
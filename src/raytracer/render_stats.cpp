@@ -0,0 +1,119 @@
+#include "render_stats.h"
+
+#include <algorithm>
+#include <sstream>
+
+thread_local TraceCounters trace_counters = {0, 0, 0, 0};
+
+uint64_t TraceCounters::tests() const
+{
+    return box_tests + primitive_tests;
+}
+
+RenderStats::RenderStats()
+    : width(0), height(0), elapsed_ms(0), samples(0), rays(0), box_tests(0), primitive_tests(0)
+{
+}
+
+void RenderStats::reset(int width, int height, bool with_cost, bool keep_cost)
+{
+    size_t pixels = size_t(width) * height;
+    if (!with_cost)
+        cost.clear();
+    else if (!keep_cost || cost.size() != pixels)
+        cost.assign(pixels, 0);
+
+    this->width = width;
+    this->height = height;
+    elapsed_ms = 0;
+    samples = rays = box_tests = primitive_tests = 0;
+    thread_busy_ms.clear();
+}
+
+void RenderStats::add_thread(size_t thread, const TraceCounters &before, const TraceCounters &after, double busy_ms)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    samples += after.samples - before.samples;
+    rays += after.rays - before.rays;
+    box_tests += after.box_tests - before.box_tests;
+    primitive_tests += after.primitive_tests - before.primitive_tests;
+    // budgeted renders run the tiles several times, their threads add up
+    if (thread_busy_ms.size() <= thread)
+        thread_busy_ms.resize(thread + 1, 0);
+    thread_busy_ms[thread] += busy_ms;
+}
+
+double RenderStats::rays_per_second() const
+{
+    return elapsed_ms > 0 ? rays / (elapsed_ms / 1000) : 0;
+}
+
+double RenderStats::samples_per_second() const
+{
+    return elapsed_ms > 0 ? samples / (elapsed_ms / 1000) : 0;
+}
+
+double RenderStats::average_path_length() const
+{
+    return samples > 0 ? double(rays) / samples : 0;
+}
+
+double RenderStats::tests_per_ray() const
+{
+    return rays > 0 ? double(box_tests + primitive_tests) / rays : 0;
+}
+
+double RenderStats::thread_utilization(size_t thread) const
+{
+    if (thread >= thread_busy_ms.size() || elapsed_ms <= 0)
+        return 0;
+    return std::min(1.0, thread_busy_ms[thread] / elapsed_ms);
+}
+
+uint32_t RenderStats::max_cost() const
+{
+    return cost.empty() ? 0 : *std::max_element(cost.begin(), cost.end());
+}
+
+std::vector<uint8_t> RenderStats::cost_heatmap(uint8_t alpha) const
+{
+    std::vector<uint8_t> rgba(cost.size() * 4);
+    double scale = 1.0 / std::max<uint32_t>(max_cost(), 1);
+    for (size_t p = 0; p < cost.size(); p++)
+    {
+        // thirds of the ramp: red rises, then green, then blue
+        double t = 3 * cost[p] * scale;
+        rgba[4 * p + 0] = uint8_t(255 * std::min(t, 1.0));
+        rgba[4 * p + 1] = uint8_t(255 * std::min(std::max(t - 1, 0.0), 1.0));
+        rgba[4 * p + 2] = uint8_t(255 * std::min(std::max(t - 2, 0.0), 1.0));
+        rgba[4 * p + 3] = alpha;
+    }
+    return rgba;
+}
+
+ImageLayer RenderStats::cost_layer() const
+{
+    ImageLayer layer;
+    layer.name = "cost";
+    layer.channels = {"Y"};
+    layer.full_precision = true; // counts past 2048 aren't exact in half
+    layer.data.assign(cost.begin(), cost.end());
+    return layer;
+}
+
+std::string RenderStats::to_json() const
+{
+    std::ostringstream json;
+    json << "{\"width\":" << width << ",\"height\":" << height << ",\"elapsed_ms\":" << elapsed_ms
+         << ",\"samples\":" << samples << ",\"rays\":" << rays
+         << ",\"rays_per_sec\":" << rays_per_second() << ",\"samples_per_sec\":" << samples_per_second()
+         << ",\"path_length\":" << average_path_length()
+         << ",\"box_tests\":" << box_tests << ",\"primitive_tests\":" << primitive_tests << ",\"tests_per_ray\":" << tests_per_ray()
+         << ",\"max_cost\":" << max_cost() << ",\"thread_utilization\":[";
+    for (size_t t = 0; t < thread_busy_ms.size(); t++)
+    {
+        json << (t > 0 ? "," : "") << thread_utilization(t);
+    }
+    json << "]}";
+    return json.str();
+}
@@ -0,0 +1,65 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "hdr_writer.h"
+
+// work done by the thread tracing, counted per thread so every count is a plain increment.
+// They only ever grow, a render takes the difference
+struct TraceCounters
+{
+    uint64_t samples;
+    uint64_t rays;            // segments traced through the world, camera rays and bounces
+    uint64_t box_tests;       // bounding boxes tested on the way down a BVH
+    uint64_t primitive_tests; // objects intersected
+
+    uint64_t tests() const;
+};
+
+extern thread_local TraceCounters trace_counters;
+
+// what a render did, filled in by Camera when its stats are set. Cheap enough to always collect:
+// counts are per thread and summed once per thread, the per-pixel cost is one store per pixel
+class RenderStats
+{
+public:
+    RenderStats();
+    RenderStats(const RenderStats &) = delete;
+    RenderStats &operator=(const RenderStats &) = delete;
+
+    int width, height;
+    double elapsed_ms;
+    uint64_t samples;
+    uint64_t rays;
+    uint64_t box_tests;
+    uint64_t primitive_tests;
+    std::vector<double> thread_busy_ms; // time each render thread spent in tiles, against elapsed_ms
+    // box and primitive tests per pixel, summed over the samples. Pixels a render skipped keep what they had,
+    // empty for renders that don't hold the frame
+    std::vector<uint32_t> cost;
+
+    // zeroes the counts; the cost too unless keep_cost is set and it already has the frame's size
+    void reset(int width, int height, bool with_cost, bool keep_cost = false);
+    // one thread's share of a run of tiles, from its counters before and after
+    void add_thread(size_t thread, const TraceCounters &before, const TraceCounters &after, double busy_ms);
+
+    double rays_per_second() const;
+    double samples_per_second() const;
+    double average_path_length() const; // rays per sample
+    double tests_per_ray() const;
+    double thread_utilization(size_t thread) const; // 0 to 1
+
+    uint32_t max_cost() const;
+    // cost scaled by max_cost through a black, red, yellow, white ramp, RGBA8 rows for an overlay
+    std::vector<uint8_t> cost_heatmap(uint8_t alpha) const;
+    ImageLayer cost_layer() const; // cost.Y for .exr and .pfm files
+    std::string to_json() const;
+
+private:
+    std::mutex mutex; // for add_thread
+};
+
+#endif
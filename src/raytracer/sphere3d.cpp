@@ -9,7 +9,7 @@ Sphere3d::Sphere3d(const std::string& name, const Point3d& center, double radius
     this->material = material;
 }
 
-bool Sphere3d::hit(const Ray &r, Interval ray_t, HitRecord &record) const
+bool hit_sphere(const Point3d &center, double radius, const Ray &r, Interval ray_t, HitRecord &record)
 {
     Vector3d oc = center - r.origin();
     double a = r.direction().length_squared();
@@ -40,15 +40,32 @@ bool Sphere3d::hit(const Ray &r, Interval ray_t, HitRecord &record) const
     record.t = root;
     record.p = r.at(record.t);
     Vector3d outwards_normal = (record.p - center) / radius;
-    if (outwards_normal.length() < 1 - tolerance || outwards_normal.length() > 1 + tolerance)
+    double length = outwards_normal.length();
+    if (length < 1 - tolerance || length > 1 + tolerance)
     {
         return false;
     }
     record.set_face_normal(r, outwards_normal);
+    return true;
+}
+
+bool Sphere3d::hit(const Ray &r, Interval ray_t, HitRecord &record) const
+{
+    if (!hit_sphere(center, radius, r, ray_t, record))
+    {
+        return false;
+    }
     record.material = this->material;
+    record.object = this;
     return true;
 }
 
+AABB Sphere3d::bounding_box() const
+{
+    Vector3d radius_vector(fabs(radius), fabs(radius), fabs(radius));
+    return AABB(center - radius_vector, center + radius_vector);
+}
+
 void Sphere3d::accept(IVisitor *visitor)
 {
     visitor->visit(this);
@@ -6,6 +6,9 @@
 #include <memory>
 using std::shared_ptr;
 
+// ray against a sphere, fills everything in record but the material and object
+bool hit_sphere(const Point3d &center, double radius, const Ray &r, Interval ray_t, HitRecord &record);
+
 class Sphere3d : public IHittable
 {
 public:
@@ -15,6 +18,7 @@ public:
     double radius;
 
     bool hit(const Ray &r, Interval ray_t, HitRecord &record) const override;
+    AABB bounding_box() const override;
 
     void accept(IVisitor *visitor) override;
 
@@ -0,0 +1,434 @@
+#include "streamed_spheres.h"
+#include "render_stats.h"
+
+#include <algorithm>
+#include <iostream>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const int max_candidates = 64; // clusters one ray can defer, more are traced right away
+
+double GeometryCacheStats::hit_rate() const
+{
+    return hits + loads == 0 ? 1.0 : double(hits) / double(hits + loads);
+}
+
+// distance where the ray enters the box within ray_t, false when it misses
+static bool entry_distance(const double min[3], const double max[3], const Ray &r, Interval ray_t, double &t)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double inverse = 1.0 / r.direction()[axis];
+        double t0 = (min[axis] - r.origin()[axis]) * inverse;
+        double t1 = (max[axis] - r.origin()[axis]) * inverse;
+        if (t0 > t1)
+            std::swap(t0, t1);
+
+        ray_t.min = fmax(t0, ray_t.min);
+        ray_t.max = fmin(t1, ray_t.max);
+        if (ray_t.max <= ray_t.min)
+            return false;
+    }
+    t = ray_t.min;
+    return true;
+}
+
+StreamedSpheres::ClusterSlot::ClusterSlot(int first_node, int node_count)
+    : first_node(first_node), node_count(node_count), referenced(false), unreadable(false)
+{
+}
+
+StreamedSpheres::StreamedSpheres(const std::string &name, const std::string &path, uint64_t nodes_offset, size_t node_count,
+                                 uint64_t spheres_offset, size_t sphere_count, const std::vector<shared_ptr<IMaterial>> &materials,
+                                 size_t cache_bytes)
+    : sphere_count(sphere_count),
+      materials(materials),
+      path(path),
+      nodes_offset(nodes_offset),
+      spheres_offset(spheres_offset),
+      node_count(node_count),
+      cache_bytes(cache_bytes),
+      fd(-1),
+      file(nullptr),
+      hand(0),
+      resident_count(0),
+      resident_bytes(0),
+      loads(0),
+      evictions(0),
+      bytes_read(0),
+      peak_bytes(0)
+{
+    this->name = name;
+}
+
+StreamedSpheres::~StreamedSpheres()
+{
+#ifdef __linux__
+    if (fd >= 0)
+        close(fd);
+#endif
+    if (file != nullptr)
+        fclose(file);
+}
+
+bool StreamedSpheres::open(std::string &error)
+{
+#ifdef __linux__
+    fd = ::open(path.c_str(), O_RDONLY);
+    bool opened = fd >= 0;
+#else
+    file = fopen(path.c_str(), "rb");
+    bool opened = file != nullptr;
+#endif
+    if (!opened)
+    {
+        error = "could not open " + path;
+        return false;
+    }
+
+    top.clear();
+    slots.clear();
+    if (!check_tree(error))
+        return false;
+    if (node_count > 0 && build_top(0, static_cast<int>(node_count), error) < 0)
+        return false;
+    return true;
+}
+
+#pragma region reading
+bool StreamedSpheres::read_at(uint64_t offset, void *data, size_t bytes) const
+{
+#ifdef __linux__
+    uint8_t *out = static_cast<uint8_t *>(data);
+    while (bytes > 0)
+    {
+        ssize_t read = pread(fd, out, bytes, off_t(offset));
+        if (read <= 0)
+            return false;
+        out += read;
+        offset += uint64_t(read);
+        bytes -= size_t(read);
+    }
+    return true;
+#else
+    std::lock_guard<std::mutex> lock(file_mutex);
+    return fseek(file, long(offset), SEEK_SET) == 0 && fread(data, 1, bytes, file) == bytes;
+#endif
+}
+
+bool StreamedSpheres::read_node(int index, CompiledNode &node) const
+{
+    return read_at(nodes_offset + uint64_t(index) * sizeof(CompiledNode), &node, sizeof(node));
+}
+
+// every node once up front, in chunks, so loading a cluster never finds a tree that doesn't fit the records
+bool StreamedSpheres::check_tree(std::string &error) const
+{
+    CompiledTreeCheck tree(node_count, sphere_count);
+    std::vector<CompiledNode> chunk(4096);
+    bool intact = true;
+    for (size_t first = 0; first < node_count && intact; first += chunk.size())
+    {
+        size_t count = std::min(chunk.size(), node_count - first);
+        if (!read_at(nodes_offset + uint64_t(first) * sizeof(CompiledNode), chunk.data(), count * sizeof(CompiledNode)))
+        {
+            error = "could not read the tree of " + path;
+            return false;
+        }
+        for (size_t n = 0; n < count && intact; n++)
+            intact = tree.add(chunk[n]);
+    }
+    if (!tree.complete())
+    {
+        error = "compiled scene is truncated or damaged";
+        return false;
+    }
+    return true;
+}
+
+// the subtree at nodes [first, end): one cluster when it's small enough, otherwise an inner node above two more
+int StreamedSpheres::build_top(int first, int end, std::string &error)
+{
+    CompiledNode node;
+    if (!read_node(first, node))
+    {
+        error = "could not read the tree of " + path;
+        return -1;
+    }
+
+    int index = static_cast<int>(top.size());
+    TopNode top_node;
+    std::copy(node.min, node.min + 3, top_node.min);
+    std::copy(node.max, node.max + 3, top_node.max);
+    top_node.right = 0;
+    top_node.cluster = -1;
+
+    if (node.count > 0 || end - first <= cluster_nodes)
+    {
+        top_node.cluster = static_cast<int>(slots.size());
+        slots.emplace_back(first, end - first);
+        top.push_back(top_node);
+        return index;
+    }
+
+    if (node.right <= first + 1 || node.right >= end)
+    {
+        error = path + " has a damaged tree";
+        return -1;
+    }
+
+    top.push_back(top_node);
+    if (build_top(first + 1, node.right, error) < 0)
+        return -1;
+    int right = build_top(node.right, end, error);
+    if (right < 0)
+        return -1;
+    top[index].right = right;
+    return index;
+}
+#pragma endregion
+
+#pragma region cache
+shared_ptr<const StreamedSpheres::Cluster> StreamedSpheres::resident(int cluster) const
+{
+    ClusterSlot &slot = slots[cluster];
+    shared_ptr<const Cluster> data = std::atomic_load(&slot.data);
+    if (!data)
+        return nullptr;
+
+    // only written when it changes, so lookups of a hot cluster don't keep pulling its line between threads
+    if (!slot.referenced.load(std::memory_order_relaxed))
+        slot.referenced.store(true, std::memory_order_relaxed);
+    static std::atomic<unsigned> next_stripe(0);
+    static thread_local unsigned stripe = next_stripe++ % hit_stripes;
+    hits[stripe].hits.fetch_add(1, std::memory_order_relaxed);
+    return data;
+}
+
+shared_ptr<const StreamedSpheres::Cluster> StreamedSpheres::load(int cluster) const
+{
+    shared_ptr<const Cluster> found = resident(cluster);
+    if (found)
+        return found;
+    if (slots[cluster].unreadable)
+        return nullptr;
+
+    // read outside the lock, other threads keep tracing resident clusters meanwhile
+    int first_node = slots[cluster].first_node;
+    std::shared_ptr<Cluster> data = std::make_shared<Cluster>();
+    data->nodes.resize(slots[cluster].node_count);
+    size_t node_bytes = data->nodes.size() * sizeof(CompiledNode);
+    if (!read_at(nodes_offset + uint64_t(first_node) * sizeof(CompiledNode), data->nodes.data(), node_bytes))
+        return fail(cluster, "could not read geometry from " + path);
+
+    // the subtree's spheres are contiguous, from its leftmost leaf to its rightmost. open() checked the tree,
+    // unless the file changed since
+    int sphere_first = static_cast<int>(sphere_count), sphere_end = 0;
+    for (const CompiledNode &node : data->nodes)
+    {
+        if (node.count > 0)
+        {
+            sphere_first = std::min(sphere_first, node.first);
+            sphere_end = std::max(sphere_end, node.first + node.count);
+        }
+    }
+    if (sphere_first >= sphere_end || size_t(sphere_end) > sphere_count)
+        return fail(cluster, path + " has a damaged cluster");
+
+    for (CompiledNode &node : data->nodes)
+    {
+        if (node.count > 0)
+            node.first -= sphere_first;
+        else
+            node.right -= first_node;
+        if (node.count == 0 && (node.right <= 0 || size_t(node.right) >= data->nodes.size()))
+            return fail(cluster, path + " has a damaged cluster");
+    }
+
+    data->spheres.resize(size_t(sphere_end - sphere_first));
+    size_t sphere_bytes = data->spheres.size() * sizeof(CompiledSphere);
+    if (!read_at(spheres_offset + uint64_t(sphere_first) * sizeof(CompiledSphere), data->spheres.data(), sphere_bytes))
+        return fail(cluster, "could not read geometry from " + path);
+    // the spheres are only read here, so are their materials
+    for (const CompiledSphere &sphere : data->spheres)
+    {
+        if (sphere.material >= materials.size())
+            return fail(cluster, path + " has a damaged cluster");
+    }
+    data->bytes = sizeof(Cluster) + node_bytes + sphere_bytes;
+    bytes_read += node_bytes + sphere_bytes;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ClusterSlot &slot = slots[cluster];
+    loads++;
+    slot.referenced = true;
+    found = std::atomic_load(&slot.data);
+    if (found)
+        return found; // another thread read it first
+
+    std::atomic_store(&slot.data, shared_ptr<const Cluster>(data));
+    resident_count++;
+    resident_bytes += data->bytes;
+    peak_bytes = std::max(peak_bytes, resident_bytes);
+    evict(cluster);
+    return data;
+}
+
+// the clock: a referenced cluster loses its bit and stays for another turn, one without it goes. After two turns
+// the bits are ignored, so threads that keep looking clusters up can't hold the hand off forever.
+// Rays still tracing an evicted cluster hold their own reference until they're done with it
+void StreamedSpheres::evict(int loaded) const
+{
+    size_t steps = 0;
+    while (resident_bytes > cache_bytes && resident_count > 1)
+    {
+        int index = static_cast<int>(hand);
+        ClusterSlot &slot = slots[hand];
+        hand = (hand + 1) % slots.size();
+        bool second_chance = steps++ < 2 * slots.size();
+        if (index == loaded)
+            continue;
+        shared_ptr<const Cluster> data = std::atomic_load(&slot.data);
+        if (!data || (second_chance && slot.referenced.exchange(false, std::memory_order_relaxed)))
+            continue;
+
+        std::atomic_store(&slot.data, shared_ptr<const Cluster>());
+        resident_count--;
+        resident_bytes -= data->bytes;
+        evictions++;
+    }
+}
+
+// hit() runs on render threads, where throwing would end the process: the error is kept for the caller instead
+shared_ptr<const StreamedSpheres::Cluster> StreamedSpheres::fail(int cluster, const std::string &message) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    slots[cluster].unreadable = true;
+    if (failure.empty())
+    {
+        std::cerr << message << ", tracing on without it" << std::endl;
+        failure = message;
+    }
+    return nullptr;
+}
+
+std::string StreamedSpheres::error() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return failure;
+}
+
+GeometryCacheStats StreamedSpheres::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    GeometryCacheStats stats;
+    stats.hits = 0;
+    for (const HitStripe &stripe : hits)
+        stats.hits += stripe.hits;
+    stats.loads = loads;
+    stats.evictions = evictions;
+    stats.bytes_read = bytes_read;
+    stats.peak_bytes = peak_bytes;
+    stats.clusters = slots.size();
+    return stats;
+}
+#pragma endregion
+
+bool StreamedSpheres::hit_cluster(const Cluster &cluster, const Ray &r, Interval &ray_t, HitRecord &record) const
+{
+    int closest = hit_compiled_spheres(cluster.nodes.data(), cluster.spheres.data(), r, ray_t, record);
+    if (closest < 0)
+        return false;
+
+    record.material = materials[cluster.spheres[closest].material];
+    record.object = this;
+    return true;
+}
+
+bool StreamedSpheres::hit(const Ray &r, Interval ray_t, HitRecord &record) const
+{
+    if (top.empty())
+        return false;
+
+    struct Candidate
+    {
+        double t;
+        int cluster;
+    };
+    Candidate candidates[max_candidates];
+    int candidate_count = 0;
+    bool hit_anything = false;
+
+    int stack[64];
+    int depth = 0;
+    stack[depth++] = 0;
+    uint64_t box_tests = 0;
+    while (depth > 0)
+    {
+        const TopNode &node = top[stack[--depth]];
+        box_tests++;
+        double t;
+        if (!entry_distance(node.min, node.max, r, ray_t, t))
+            continue;
+
+        if (node.cluster < 0)
+        {
+            stack[depth++] = node.right;
+            stack[depth++] = static_cast<int>(&node - top.data()) + 1;
+        }
+        else if (candidate_count < max_candidates)
+        {
+            candidates[candidate_count++] = Candidate{t, node.cluster};
+        }
+        else if (shared_ptr<const Cluster> data = load(node.cluster))
+        {
+            hit_anything |= hit_cluster(*data, r, ray_t, record);
+        }
+    }
+
+    trace_counters.box_tests += box_tests;
+
+    std::sort(candidates, candidates + candidate_count, [](const Candidate &a, const Candidate &b)
+              { return a.t < b.t; });
+
+    // resident clusters first: a hit there shortens the ray, and the clusters behind it are never read
+    for (int c = 0; c < candidate_count; c++)
+    {
+        if (candidates[c].t >= ray_t.max)
+            break;
+        shared_ptr<const Cluster> data = resident(candidates[c].cluster);
+        if (data)
+        {
+            hit_anything |= hit_cluster(*data, r, ray_t, record);
+            candidates[c].cluster = -1;
+        }
+    }
+    for (int c = 0; c < candidate_count; c++)
+    {
+        if (candidates[c].t >= ray_t.max)
+            break;
+        if (candidates[c].cluster < 0)
+            continue;
+        shared_ptr<const Cluster> data = load(candidates[c].cluster);
+        if (data)
+            hit_anything |= hit_cluster(*data, r, ray_t, record);
+    }
+    return hit_anything;
+}
+
+AABB StreamedSpheres::bounding_box() const
+{
+    if (top.empty())
+        return AABB();
+    const TopNode &root = top[0];
+    return AABB(Interval(root.min[0], root.max[0]), Interval(root.min[1], root.max[1]), Interval(root.min[2], root.max[2]));
+}
+
+void StreamedSpheres::accept(IVisitor *visitor)
+{
+    // not expanded into sphere lines, the whole point is never holding them all
+    visitor->visit(static_cast<IHittable *>(this));
+}
@@ -0,0 +1,131 @@
+#ifndef STREAMED_SPHERES_H
+#define STREAMED_SPHERES_H
+
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "hittable.h"
+#include "compiled_spheres.h"
+
+struct GeometryCacheStats
+{
+    uint64_t hits;      // cluster lookups that found it resident
+    uint64_t loads;     // cluster lookups that read it from disk
+    uint64_t evictions;
+    uint64_t bytes_read;
+    size_t peak_bytes; // most cluster bytes resident at once
+    size_t clusters;
+
+    double hit_rate() const;
+};
+
+// the spheres of a compiled scene file, left on disk and paged in by cluster while tracing.
+// A cluster is a subtree of the file's BVH with its spheres; the tree above the clusters stays in memory.
+// Resident clusters are kept up to cache_bytes. Looking one up takes no lock, only reading one from disk does;
+// a clock hand evicts the ones no ray looked up since it last passed
+class StreamedSpheres : public IHittable
+{
+public:
+    // node and sphere records as laid out in the file, see scene_compiler.cpp
+    StreamedSpheres(const std::string &name, const std::string &path, uint64_t nodes_offset, size_t node_count,
+                    uint64_t spheres_offset, size_t sphere_count, const std::vector<shared_ptr<IMaterial>> &materials,
+                    size_t cache_bytes);
+    ~StreamedSpheres();
+
+    StreamedSpheres(const StreamedSpheres &) = delete;
+    StreamedSpheres &operator=(const StreamedSpheres &) = delete;
+
+    // subtrees of at most this many nodes are paged as one cluster
+    static const int cluster_nodes = 2048;
+
+    size_t sphere_count;
+    std::vector<shared_ptr<IMaterial>> materials;
+
+    // checks the whole tree and reads the part above the clusters, before any tracing
+    bool open(std::string &error);
+
+    bool hit(const Ray &r, Interval ray_t, HitRecord &record) const override;
+    AABB bounding_box() const override;
+
+    void accept(IVisitor *visitor) override;
+
+    GeometryCacheStats stats() const;
+    // the first cluster that couldn't be read while tracing, empty when there was none. Rays miss such clusters
+    std::string error() const;
+
+private:
+    struct Cluster
+    {
+        std::vector<CompiledNode> nodes; // rebased to the cluster's root
+        std::vector<CompiledSphere> spheres;
+        size_t bytes;
+    };
+
+    struct ClusterSlot
+    {
+        ClusterSlot(int first_node, int node_count);
+
+        int first_node;
+        int node_count;
+        shared_ptr<const Cluster> data; // null while on disk, only through std::atomic_load and std::atomic_store
+        std::atomic<bool> referenced;   // set by lookups, cleared by the clock hand passing
+        std::atomic<bool> unreadable;   // a read failed, it's never tried again
+    };
+
+    // hits are counted by every lookup, spread over lines so threads don't share one
+    struct HitStripe
+    {
+        HitStripe() : hits(0) {}
+        std::atomic<uint64_t> hits;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    static const int hit_stripes = 16;
+
+    // the tree above the clusters, depth first like the file's
+    struct TopNode
+    {
+        double min[3], max[3];
+        int right;
+        int cluster; // -1 for inner nodes
+    };
+
+    std::string path;
+    uint64_t nodes_offset, spheres_offset;
+    size_t node_count;
+    size_t cache_bytes;
+    int fd;     // Linux reads with pread
+    FILE *file; // elsewhere under file_mutex
+
+    std::vector<TopNode> top;
+    mutable std::deque<ClusterSlot> slots; // a deque, the slots hold atomics and never move
+    mutable size_t hand;                   // next slot the clock looks at, under mutex
+    mutable size_t resident_count, resident_bytes; // under mutex
+    mutable std::mutex mutex;                      // loads and evictions, lookups don't take it
+    mutable std::mutex file_mutex;                 // where reads aren't positional
+
+    mutable HitStripe hits[hit_stripes];
+    mutable std::atomic<uint64_t> loads, evictions, bytes_read;
+    mutable size_t peak_bytes;
+    mutable std::string failure; // under mutex
+
+
+    bool read_at(uint64_t offset, void *data, size_t bytes) const;
+    bool read_node(int index, CompiledNode &node) const;
+    bool check_tree(std::string &error) const;
+    int build_top(int first, int end, std::string &error);
+
+    // lock free, null when the cluster is on disk
+    shared_ptr<const Cluster> resident(int cluster) const;
+    // null when the cluster can't be read, see error()
+    shared_ptr<const Cluster> load(int cluster) const;
+    shared_ptr<const Cluster> fail(int cluster, const std::string &message) const;
+    void evict(int loaded) const; // under mutex
+    bool hit_cluster(const Cluster &cluster, const Ray &r, Interval &ray_t, HitRecord &record) const;
+};
+
+#endif
@@ -1,19 +1,36 @@
 #include "world.h"
+#include "render_stats.h"
+#include "compiled_spheres.h"
 
-World::World() {}
+World::World() : bvh_copied(false) {}
 
-void World::clear() { objects.clear(); }
+void World::clear()
+{
+    objects.clear();
+    dirty_bounds.clear();
+    bvh.clear();
+    bvh_copied = false;
+}
 
 void World::add(shared_ptr<IHittable> object)
 {
     objects.insert({object->name, object});
+    markDirty(object->bounding_box());
+    bvh.clear();
+    bvh_copied = false;
 }
 
 bool World::hit(const Ray &r, Interval ray_t, HitRecord &record) const
 {
+    if (!bvh.empty())
+    {
+        return bvh.hit(r, ray_t, record);
+    }
+
     HitRecord temp_rec;
     bool hit_anything = false;
     double closest_so_far = ray_t.max;
+    trace_counters.primitive_tests += objects.size();
 
     for (const auto &pair : objects)
     {
@@ -30,9 +47,72 @@ bool World::hit(const Ray &r, Interval ray_t, HitRecord &record) const
     return hit_anything;
 }
 
+AABB World::bounding_box() const
+{
+    AABB bounds;
+    for (const auto &pair : objects)
+    {
+        bounds = AABB(bounds, pair.second->bounding_box());
+    }
+    return bounds;
+}
+
+void World::markDirty(const AABB &bounds)
+{
+    if (!bounds.is_empty())
+    {
+        dirty_bounds.push_back(bounds);
+    }
+}
+
+std::vector<AABB> World::takeDirtyBounds()
+{
+    std::vector<AABB> taken;
+    taken.swap(dirty_bounds);
+    return taken;
+}
+
 void World::remove(const std::string& name)
 {
-    objects.erase(name);
+    auto it = objects.find(name);
+    if (it != objects.end())
+    {
+        markDirty(it->second->bounding_box());
+        objects.erase(it);
+        bvh.clear();
+        bvh_copied = false;
+    }
+}
+
+bool World::updateBvh()
+{
+    if (bvh_copied)
+    {
+        return false;
+    }
+    if (!bvh.empty() && bvh.refit())
+    {
+        return false;
+    }
+    bvh.build(getObjectsArray());
+    return true;
+}
+
+void World::copyBvh(const World &source, const std::function<shared_ptr<IHittable>(const IHittable *)> &copy_of)
+{
+    bvh.assign(source.bvh, copy_of);
+    bvh_copied = true;
+}
+
+void World::adviseHugePages() const
+{
+    bvh.advise_huge_pages();
+    for (const auto &pair : objects)
+    {
+        const CompiledSpheres *spheres = dynamic_cast<const CompiledSpheres *>(pair.second.get());
+        if (spheres != nullptr)
+            spheres->advise_huge_pages();
+    }
 }
 
 std::vector<std::string> World::getObjectKeys() const
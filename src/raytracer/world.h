@@ -4,6 +4,7 @@
 #include "material.h"
 #include "hittable.h"
 #include "ray.h"
+#include "bvh.h"
 #include "../utils/math_utils.h"
 
 #include <vector>
@@ -16,6 +17,7 @@ class World : public IHittable
 {
 public:
     std::map<std::string, shared_ptr<IHittable>> objects;
+    std::vector<AABB> dirty_bounds; // where objects were added or removed since the last takeDirtyBounds
 
     World();
 
@@ -25,6 +27,21 @@ public:
 
     bool hit(const Ray &r, Interval ray_t, HitRecord &record) const override;
 
+    AABB bounding_box() const override;
+
+    void markDirty(const AABB &bounds);
+
+    std::vector<AABB> takeDirtyBounds();
+
+    // call before rendering: builds the BVH after objects were added or removed, refits it otherwise.
+    // Until then hit() tests every object. Returns true when it had to build
+    bool updateBvh();
+    // source's up to date BVH over copies of its objects, as objects holds them now. updateBvh() keeps it
+    // as is until objects are added or removed
+    void copyBvh(const World &source, const std::function<shared_ptr<IHittable>(const IHittable *)> &copy_of);
+    // asks for transparent huge pages on the BVH and on compiled sphere records, see Camera::huge_pages
+    void adviseHugePages() const;
+
     void remove(const std::string& name);
 
     std::vector<std::string> getObjectKeys() const;
@@ -38,6 +55,10 @@ public:
     void updateObjectName(const std::string& oldName, const std::string& newName);
 
     virtual ~World() override;
+
+private:
+    BVH bvh;
+    bool bvh_copied; // by copyBvh, and nothing changed since
 };
 
 #endif
\ No newline at end of file
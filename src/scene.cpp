@@ -1,10 +1,15 @@
 #include "scene.h"
+#include "distributed.h"
+#include "raytracer/streamed_spheres.h"
 
+#include <atomic>
+#include <chrono>
 #include <mutex>
+#include <thread>
 
-extern std::mutex renderTargetMutex;
+#include "utils/cpu_topology.h"
 
-Scene::Scene(RenderTarget *renderTarget, int camera_initial_width, int camera_initial_height) : world(World()), renderTarget(renderTarget), camera(Camera(camera_initial_width, camera_initial_height))
+Scene::Scene(int camera_initial_width, int camera_initial_height) : world(World()), camera(Camera(camera_initial_width, camera_initial_height)), frames(std::make_shared<FrameBuffer>()), pending_changes(SCENE_CHANGE_ALL), pending_full_frame(true), conservative_dirty_regions(false)
 {
     materials = std::map<std::string, shared_ptr<IMaterial>>();
     addMaterial(MaterialFactory::createLambertian("default", Color(1, 1, 1)));
@@ -40,8 +45,34 @@ int Scene::getCameraHeight() const
 
 #pragma region world operations
 
+void Scene::markChanged(int changes)
+{
+    pending_changes |= changes;
+    pending_full_frame = true;
+}
+
+void Scene::markChanged(int changes, const AABB &region)
+{
+    pending_changes |= changes;
+    world.markDirty(region);
+}
+
+void Scene::markMaterialChanged(const IMaterial *material)
+{
+    pending_changes |= SCENE_CHANGE_MATERIAL;
+    for (const auto &pair : world.objects)
+    {
+        if (pair.second->material.get() == material)
+        {
+            world.markDirty(pair.second->bounding_box());
+        }
+    }
+}
+
 void Scene::addMaterial(shared_ptr<IMaterial> material)
 {
+    // not used by any object yet, so nothing on screen changes
+
     if (materials.find(material->name) != materials.end())
     {
         materials[material->name] = material;
@@ -52,9 +83,16 @@ void Scene::addMaterial(shared_ptr<IMaterial> material)
 
 void Scene::addObject(shared_ptr<IHittable> object)
 {
+    pending_changes |= SCENE_CHANGE_GEOMETRY; // the world tracks where
     world.add(object);
 }
 
+void Scene::removeObject(const std::string &name)
+{
+    pending_changes |= SCENE_CHANGE_GEOMETRY;
+    world.remove(name);
+}
+
 #pragma endregion
 
 #pragma region material operations
@@ -82,10 +120,11 @@ void Scene::deleteMaterial(const std::string &name)
     }
 
     // set the material of all objects with this material to the default material
+    markMaterialChanged(materials[name].get());
     for (const auto &pair : world.objects)
     {
         shared_ptr<IHittable> object = pair.second;
-        if (object->material->name == name)
+        if (object->material && object->material->name == name)
         {
             object->material = materials["default"];
         }
@@ -105,6 +144,7 @@ void Scene::setMaterialForObject(std::string object_name, std::string material_n
     shared_ptr<IMaterial> material = materials[material_name];
 
     object->material = material;
+    markChanged(SCENE_CHANGE_MATERIAL, object->bounding_box());
 }
 
 int Scene::getMaterialIndexForName(std::string material_name)
@@ -142,26 +182,353 @@ void Scene::render(std::string &progress_string, int nthreads)
 {
     std::clog << "Rendering..." << std::endl;
 
-    std::vector<Color> rendered_image = camera.render(world, nthreads, progress_string);
+    int changes = pending_changes;
+    bool full_frame = pending_full_frame || (changes & SCENE_CHANGE_CAMERA) != 0;
+    std::vector<AABB> dirty_regions = world.takeDirtyBounds();
+    pending_changes = SCENE_CHANGE_NONE;
+    pending_full_frame = false;
 
+    // material-only edits keep every primary hit valid, so shading can resume from the cache
+    bool material_only = (changes & ~SCENE_CHANGE_MATERIAL) == 0;
+    world.updateBvh();
+    if (camera.huge_pages)
     {
-        std::lock_guard<std::mutex> lock(renderTargetMutex);
-        delete renderTarget;
-        renderTarget = new RenderTarget(rendered_image, camera.image_width, camera.image_height);
+        world.adviseHugePages();
     }
 
-    std::clog << "Rendering complete." << std::endl;
+    // rendered straight into the back target, the frame on screen stays untouched until it's published
+    shared_ptr<RenderTarget> target = frames->back();
+    shared_ptr<RenderStats> stats = std::make_shared<RenderStats>();
+    camera.stats = stats.get();
+    // checkpointed renders go through the passes too, their sums live in the checkpoint file
+    bool budgeted = camera.budget.enabled() || camera.checkpoint != nullptr;
+    const std::vector<Tile> *changed = nullptr;
+    // localized edits only re-render the tiles that can see them, the rest of the last frame is kept
+    if (!budgeted && !full_frame && last_frame && last_frame->getWidth() == camera.image_width)
+    {
+        target->copy_frame(*last_frame);
+        if (last_frame->stats)
+        {
+            stats->cost = last_frame->stats->cost; // tiles that aren't re-rendered keep their cost
+        }
+        if (camera.render_dirty(world, nthreads, progress_string, target->pixel_buffer(), dirty_regions, conservative_dirty_regions, &gbuffer, material_only))
+        {
+            changed = &camera.dirty_tiles;
+        }
+    }
+
+    if (budgeted)
+    {
+        // progressive passes don't keep per-sample primary hits
+        gbuffer.invalidate();
+        target->pixel_buffer() = camera.render_budgeted(world, nthreads, progress_string);
+    }
+    else if (changed == nullptr)
+    {
+        camera.render_into(world, nthreads, progress_string, target->pixel_buffer(), &gbuffer, material_only);
+    }
+    camera.stats = nullptr;
+    if (camera.cancelled())
+    {
+        // only some tiles are new, the next render starts over
+        gbuffer.invalidate();
+        pending_full_frame = true;
+        std::clog << "Rendering cancelled." << std::endl;
+        return;
+    }
+    frames->publish(camera.image_width, camera.image_height, changed, last_frame ? last_frame->getVersion() : 0, stats);
+    last_frame = target;
+    last_stats = stats;
+
+    log_completion();
+}
+
+bool Scene::render_streamed(std::string &progress_string, int nthreads)
+{
+    std::clog << "Rendering..." << std::endl;
+
+    pending_changes = SCENE_CHANGE_NONE;
+    pending_full_frame = false;
+    world.takeDirtyBounds();
+    gbuffer.invalidate(); // nothing of the frame is kept to reuse
+    last_frame.reset();
+    world.updateBvh();
+
+    shared_ptr<RenderStats> stats = std::make_shared<RenderStats>();
+    camera.stats = stats.get();
+    bool ok = camera.render_streamed(world, nthreads, progress_string);
+    camera.stats = nullptr;
+    last_stats = stats;
+    log_completion();
+    return ok;
 }
 
-RenderTarget *Scene::getRenderTarget() const
+void Scene::render_preview(std::string &progress_string, int nthreads, int downscale, int max_depth)
 {
-    return renderTarget;
+    // render a copy of the camera so the user's settings are left untouched
+    Camera preview_camera = camera;
+    preview_camera.image_width = camera.image_width / (downscale < 1 ? 1 : downscale);
+    preview_camera.image_width = (preview_camera.image_width < 1) ? 1 : preview_camera.image_width;
+    preview_camera.samples_per_pixel = 1;
+    preview_camera.max_depth = (max_depth < camera.max_depth) ? max_depth : camera.max_depth;
+    preview_camera.row_sink = nullptr;
+    preview_camera.passes = nullptr;
+    preview_camera.stats = nullptr;
+    world.updateBvh();
+
+    shared_ptr<RenderTarget> target = frames->back();
+    preview_camera.render_into(world, nthreads, progress_string, target->pixel_buffer());
+    if (preview_camera.cancelled())
+    {
+        return;
+    }
+    frames->publish(preview_camera.image_width, preview_camera.image_height);
+}
+
+void Scene::render_distributed(std::string &progress_string, const std::vector<std::string> &workers)
+{
+    std::clog << "Rendering on " << workers.size() << " workers..." << std::endl;
+
+    pending_changes = SCENE_CHANGE_NONE;
+    pending_full_frame = false;
+    world.takeDirtyBounds();
+    gbuffer.invalidate(); // primary hits stay on the workers
+    world.updateBvh();    // for tiles rendered locally
+
+    TileCoordinator coordinator(workers);
+    shared_ptr<RenderTarget> target = frames->back();
+    target->pixel_buffer() = coordinator.render(*this, progress_string);
+    frames->publish(camera.image_width, camera.image_height);
+    last_frame = target;
+
+    log_completion();
+}
+
+std::vector<FramePixels> Scene::render_views(std::vector<Camera> &cameras, std::string &progress_string, int nthreads)
+{
+    std::clog << "Rendering " << cameras.size() << " views..." << std::endl;
+    world.updateBvh();
+
+    // one flat list of (view, tile) so threads move on to the next view instead of idling at the end of one
+    std::vector<FramePixels> images(cameras.size());
+    std::vector<std::pair<size_t, Tile>> work;
+    for (size_t v = 0; v < cameras.size(); v++)
+    {
+        for (const Tile &tile : cameras[v].plan_tiles())
+        {
+            work.push_back(std::make_pair(v, tile));
+        }
+        images[v].assign(size_t(cameras[v].image_width) * cameras[v].image_height, Color());
+    }
+
+    std::atomic<size_t> next(0), done(0);
+    auto render_tiles = [&]()
+    {
+        for (size_t k = next++; k < work.size() && !camera.cancelled(); k = next++)
+        {
+            const Camera &view = cameras[work[k].first];
+            const Tile &tile = work[k].second;
+            std::vector<Color> pixels = view.render_single_tile(world, tile);
+
+            Color *image = images[work[k].first].data();
+            const Color *pixel = pixels.data();
+            for (int j = tile.y0; j < tile.y1; j++)
+            {
+                for (int i = tile.x0; i < tile.x1; i++)
+                {
+                    image[size_t(j) * view.image_width + i] = *pixel++;
+                }
+            }
+            done++;
+        }
+    };
+
+#ifdef SINGLE_THREADED_BUILD
+    nthreads = 1;
+#else
+    unsigned int usable = CpuTopology::get().usable_threads();
+    nthreads = (nthreads > int(usable)) ? int(usable) : nthreads;
+#endif
+    if (nthreads > 1)
+    {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < nthreads; t++)
+        {
+            threads.push_back(std::thread(render_tiles));
+        }
+        while (done < work.size() && !camera.cancelled())
+        {
+            progress_string = "Progress " + std::to_string(100 * done / work.size()) + "%";
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+    }
+    else
+    {
+        render_tiles();
+    }
+    progress_string = "Progress 100%";
+    if (camera.cancelled())
+    {
+        std::clog << "Rendering cancelled." << std::endl;
+        return std::vector<FramePixels>();
+    }
+
+    if (!images.empty())
+    {
+        frames->back()->pixel_buffer() = images[0];
+        frames->publish(cameras[0].image_width, cameras[0].image_height);
+    }
+
+    log_completion();
+    return images;
+}
+
+void Scene::begin_render()
+{
+    std::clog << "Rendering in steps..." << std::endl;
+
+    bool full_frame = pending_full_frame || (pending_changes & SCENE_CHANGE_CAMERA) != 0;
+    std::vector<AABB> dirty_regions = world.takeDirtyBounds();
+    pending_changes = SCENE_CHANGE_NONE;
+    pending_full_frame = false;
+    world.updateBvh();
+    gbuffer.invalidate(); // steps don't keep primary hits
+
+    // a copy, the camera stays editable between steps
+    sliced_camera = std::make_shared<Camera>(camera);
+    sliced_camera->row_sink = nullptr;
+    sliced_camera->passes = nullptr;
+    sliced_camera->checkpoint = nullptr;
+    sliced_stats = std::make_shared<RenderStats>();
+    sliced_camera->stats = sliced_stats.get();
+
+    // localized edits only re-render the tiles that can see them, over the last frame
+    bool localized = !full_frame && last_frame && last_frame->getWidth() == camera.image_width;
+    sliced_base = localized ? last_frame : nullptr;
+    if (localized && last_frame->stats)
+    {
+        sliced_stats->cost = last_frame->stats->cost;
+    }
+    sliced_camera->begin_slices(localized ? &dirty_regions : nullptr, conservative_dirty_regions);
+}
+
+bool Scene::render_step(std::string &progress_string, double budget_ms)
+{
+    if (!sliced_camera)
+    {
+        return true;
+    }
+
+    int width = sliced_camera->image_width, height = sliced_camera->image_height;
+    shared_ptr<RenderTarget> target = frames->back();
+    // the first step paints over the frame it's based on, later ones over the previous step's, which is on screen
+    shared_ptr<const RenderTarget> base = sliced_base ? sliced_base : frames->front();
+    bool over_base = base->getWidth() == width && base->getHeight() == height;
+    if (over_base)
+    {
+        target->copy_frame(*base); // only the tiles of the last step once the targets alternate
+    }
+    else
+    {
+        target->pixel_buffer().assign(size_t(width) * height, Color());
+    }
+    sliced_base = nullptr;
+
+    std::vector<Tile> tiles = sliced_camera->render_slice(world, target->pixel_buffer().data(), budget_ms, progress_string);
+    bool done = !sliced_camera->slices_left();
+    frames->publish(width, height, over_base ? &tiles : nullptr, base->getVersion(), done ? sliced_stats : nullptr);
+    if (!done)
+    {
+        return false;
+    }
+
+    last_frame = target;
+    last_stats = sliced_stats;
+    sliced_camera.reset();
+    sliced_stats.reset();
+    log_completion();
+    return true;
+}
+
+void Scene::cancel_render()
+{
+    if (!sliced_camera)
+    {
+        return;
+    }
+
+    // the edits it took are only partly on screen
+    pending_full_frame = true;
+    sliced_camera.reset();
+    sliced_stats.reset();
+    sliced_base.reset();
+    std::clog << "Rendering cancelled." << std::endl;
+}
+
+bool Scene::render_in_progress() const
+{
+    return sliced_camera != nullptr;
+}
+
+std::string Scene::geometry_error() const
+{
+    for (const auto &pair : world.objects)
+    {
+        const StreamedSpheres *streamed = dynamic_cast<const StreamedSpheres *>(pair.second.get());
+        if (streamed != nullptr && !streamed->error().empty())
+        {
+            return streamed->error();
+        }
+    }
+    return "";
+}
+
+void Scene::log_completion() const
+{
+    std::string error = geometry_error();
+    if (error.empty())
+        std::clog << "Rendering complete." << std::endl;
+    else
+        std::cerr << "Rendering complete, without geometry that couldn't be read: " << error << std::endl;
+}
+
+void Scene::snapshot_into(Scene &render_scene, WorldMirror &mirror)
+{
+    // built or refit here, on the thread that edits the objects, the render only reads its copy
+    world.updateBvh();
+    mirror.update(world, materials, render_scene.world, render_scene.materials);
+    for (const AABB &bounds : world.takeDirtyBounds())
+    {
+        render_scene.world.markDirty(bounds);
+    }
+    render_scene.pending_changes |= pending_changes;
+    render_scene.pending_full_frame = render_scene.pending_full_frame || pending_full_frame;
+    pending_changes = SCENE_CHANGE_NONE;
+    pending_full_frame = false;
+
+    render_scene.camera = camera;
+    render_scene.views = views;
+    render_scene.conservative_dirty_regions = conservative_dirty_regions;
+    render_scene.frames = frames;
+}
+
+shared_ptr<const RenderTarget> Scene::getRenderTarget() const
+{
+    return frames->front();
 }
 #pragma endregion
 
 #pragma region init
 Scene &Scene::init()
 {
+    markChanged(SCENE_CHANGE_ALL);
+    gbuffer.invalidate();
+    last_frame.reset();
+
     // clear the world
     world.clear();
 
@@ -5,6 +5,7 @@
 #include <string>
 #include <iostream>
 #include <memory>
+#include <mutex>
 using std::shared_ptr;
 
 #include "raytracer/camera.h"
@@ -13,16 +14,37 @@ using std::shared_ptr;
 #include "raytracer/hittable.h"
 #include "raytracer/vector3d.h"
 #include "raytracer/renderTarget.h"
+#include "raytracer/frame_buffer.h"
+#include "raytracer/gbuffer.h"
+#include "world_mirror.h"
+
+// what changed since the last full render, combined as flags
+enum SceneChange
+{
+    SCENE_CHANGE_NONE = 0,
+    SCENE_CHANGE_CAMERA = 1 << 0,
+    SCENE_CHANGE_GEOMETRY = 1 << 1,
+    SCENE_CHANGE_MATERIAL = 1 << 2,
+    SCENE_CHANGE_ALL = SCENE_CHANGE_CAMERA | SCENE_CHANGE_GEOMETRY | SCENE_CHANGE_MATERIAL
+};
 
 class Scene
 {
 public:
     World world;
     Camera camera;
-    RenderTarget* renderTarget;
+    shared_ptr<FrameBuffer> frames; // renders go to its back target, the window reads the front one. Shared by copies of the scene
     std::map<std::string, shared_ptr<IMaterial>> materials;
 
-    Scene(RenderTarget* renderTarget, int camera_initial_width, int camera_initial_height);
+    int pending_changes;
+    bool pending_full_frame; // an edit of unknown extent, nothing from the last frame can be kept
+    bool conservative_dirty_regions; // also re-render tiles that may see edits through reflections or bounces
+    GBuffer gbuffer; // primary hits of the last full render
+    shared_ptr<const RenderTarget> last_frame; // last full quality frame as published, reused around localized edits
+    shared_ptr<const RenderStats> last_stats;  // of the last render or render_streamed, also attached to its frame
+    std::vector<Camera> views; // saved viewpoints for render_views
+
+    Scene(int camera_initial_width, int camera_initial_height);
     Scene& init();
 
 #pragma region camera settings
@@ -35,8 +57,12 @@ public:
 #pragma endregion
 
 #pragma region world operations
+    void markChanged(int changes);
+    void markChanged(int changes, const AABB &region);
+    void markMaterialChanged(const IMaterial *material);
     void addMaterial(shared_ptr<IMaterial> material);
     void addObject(shared_ptr<IHittable> object);
+    void removeObject(const std::string &name);
 #pragma endregion
 
 #pragma region material operations
@@ -50,8 +76,39 @@ public:
 
 #pragma region rendering
     void render(std::string &progress_string, int nthreads);
-    RenderTarget* getRenderTarget() const;
+    // the frame only goes to camera.row_sink, nothing is published, see Camera::render_streamed
+    bool render_streamed(std::string &progress_string, int nthreads);
+    void render_preview(std::string &progress_string, int nthreads, int downscale, int max_depth);
+    void render_distributed(std::string &progress_string, const std::vector<std::string> &workers);
+    // renders every view against this one world and BVH, tiles of all views share the thread pool.
+    // One image per view, in order; the first one is published. None when camera.cancel stopped it
+    std::vector<FramePixels> render_views(std::vector<Camera> &cameras, std::string &progress_string, int nthreads);
+    // the last published frame, held as long as the caller needs it without blocking renders
+    shared_ptr<const RenderTarget> getRenderTarget() const;
+    // streamed geometry that couldn't be read while tracing, empty when all of it could. Rays miss what's
+    // unreadable, so a render with an error here is incomplete
+    std::string geometry_error() const;
+
+    // render() in steps, for a main loop that can't block on it. begin_render takes the pending changes and a copy
+    // of the camera; every render_step renders tiles for up to budget_ms and publishes the frame so far, true once
+    // the frame is finished. Edits made meanwhile wait for the next render. No time budget or checkpoint
+    void begin_render();
+    bool render_step(std::string &progress_string, double budget_ms);
+    void cancel_render(); // the partial frame stays on screen, the next render starts from scratch
+    bool render_in_progress() const;
+
+    // brings render_scene up to date with this scene and hands it the pending changes, for rendering it on another
+    // thread while this one is edited. Neither scene may be rendering
+    void snapshot_into(Scene &render_scene, WorldMirror &mirror);
 #pragma endregion 
+
+private:
+    shared_ptr<Camera> sliced_camera;        // of the stepped render in progress, null when there's none
+    shared_ptr<RenderStats> sliced_stats;
+    shared_ptr<const RenderTarget> sliced_base; // the frame its tiles go over, last_frame for localized edits
+
+    void log_completion() const;
+
 };
 
 #endif
\ No newline at end of file
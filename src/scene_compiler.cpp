@@ -0,0 +1,368 @@
+#include "scene_compiler.h"
+#include "scene_serializer.h"
+#include "raytracer/bvh.h"
+#include "raytracer/sphere3d.h"
+#include "raytracer/compiled_spheres.h"
+#include "raytracer/streamed_spheres.h"
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char compiled_magic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', 0};
+static const uint32_t compiled_version = 1;
+static const uint32_t byte_order_mark = 0x01020304; // written natively, a file from the other endianness won't match
+
+struct CompiledHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t settings_offset;
+    uint64_t settings_bytes;
+    uint64_t spheres_offset;
+    uint64_t sphere_count;
+    uint64_t nodes_offset;
+    uint64_t node_count;
+    uint64_t material_count;
+};
+
+static size_t align_64(size_t bytes)
+{
+    return (bytes + 63) & ~size_t(63);
+}
+
+#pragma region compiling
+std::vector<uint8_t> compile_scene(Scene &scene, std::string &error)
+{
+    std::map<const IMaterial *, uint32_t> material_index;
+    for (const auto &pair : scene.materials)
+    {
+        uint32_t index = static_cast<uint32_t>(material_index.size());
+        material_index[pair.second.get()] = index;
+    }
+
+    // compiled spheres from an earlier load are split up again so one tree covers everything
+    std::vector<shared_ptr<IHittable>> spheres;
+    for (const auto &pair : scene.world.objects)
+    {
+        if (dynamic_cast<Sphere3d *>(pair.second.get()) != nullptr)
+        {
+            spheres.push_back(pair.second);
+        }
+        else if (CompiledSpheres *compiled = dynamic_cast<CompiledSpheres *>(pair.second.get()))
+        {
+            for (size_t k = 0; k < compiled->sphere_count; k++)
+            {
+                const CompiledSphere &sphere = compiled->spheres[k];
+                spheres.push_back(HittableFactory::createSphere(compiled->name + "/" + std::to_string(k),
+                                                                Point3d(sphere.center[0], sphere.center[1], sphere.center[2]),
+                                                                sphere.radius, compiled->materials[sphere.material]));
+            }
+        }
+        else if (dynamic_cast<StreamedSpheres *>(pair.second.get()) != nullptr)
+        {
+            error = "can't compile object " + pair.first + ", it's streamed from disk; compile the text scene instead";
+            return {};
+        }
+        else
+        {
+            error = "can't compile object " + pair.first + ", only spheres";
+            return {};
+        }
+    }
+
+    BVH bvh;
+    bvh.build(spheres);
+    const std::vector<BVH::Node> &nodes = bvh.node_list();
+    const std::vector<shared_ptr<IHittable>> &ordered = bvh.leaf_objects();
+
+    std::string settings = serialize_scene_settings(scene);
+    CompiledHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, compiled_magic, sizeof(compiled_magic));
+    header.version = compiled_version;
+    header.byte_order = byte_order_mark;
+    header.settings_offset = align_64(sizeof(header));
+    header.settings_bytes = settings.size();
+    header.spheres_offset = align_64(header.settings_offset + settings.size());
+    header.sphere_count = ordered.size();
+    header.nodes_offset = align_64(header.spheres_offset + ordered.size() * sizeof(CompiledSphere));
+    header.node_count = nodes.size();
+    header.material_count = scene.materials.size();
+
+    std::vector<uint8_t> bytes(header.nodes_offset + nodes.size() * sizeof(CompiledNode), 0);
+    std::memcpy(bytes.data(), &header, sizeof(header));
+    std::memcpy(&bytes[header.settings_offset], settings.data(), settings.size());
+
+    CompiledSphere *sphere_records = reinterpret_cast<CompiledSphere *>(&bytes[header.spheres_offset]);
+    for (size_t k = 0; k < ordered.size(); k++)
+    {
+        const Sphere3d *sphere = static_cast<const Sphere3d *>(ordered[k].get());
+        std::map<const IMaterial *, uint32_t>::const_iterator it = material_index.find(sphere->material.get());
+        if (it == material_index.end())
+        {
+            error = "object " + sphere->name + " has a material the scene doesn't list";
+            return {};
+        }
+
+        CompiledSphere &record = sphere_records[k];
+        for (int c = 0; c < 3; c++)
+            record.center[c] = sphere->center[c];
+        record.radius = sphere->radius;
+        record.material = it->second;
+    }
+
+    CompiledNode *node_records = reinterpret_cast<CompiledNode *>(&bytes[header.nodes_offset]);
+    for (size_t n = 0; n < nodes.size(); n++)
+    {
+        CompiledNode &record = node_records[n];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            record.min[axis] = nodes[n].bounds.axis_interval(axis).min;
+            record.max[axis] = nodes[n].bounds.axis_interval(axis).max;
+        }
+        record.right = nodes[n].right;
+        record.first = nodes[n].first;
+        record.count = nodes[n].count;
+    }
+
+    return bytes;
+}
+
+bool write_compiled_scene(Scene &scene, const std::string &path, std::string &error)
+{
+    std::vector<uint8_t> bytes = compile_scene(scene, error);
+    if (bytes.empty())
+        return false;
+
+    FILE *file = fopen(path.c_str(), "wb");
+    bool ok = file != nullptr && fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    ok = file != nullptr && fclose(file) == 0 && ok;
+    if (!ok)
+        error = "could not write " + path;
+    return ok;
+}
+#pragma endregion
+
+#pragma region loading
+bool is_compiled_scene(const std::string &path)
+{
+    char magic[sizeof(compiled_magic)] = {};
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr)
+        return false;
+    bool compiled = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && std::memcmp(magic, compiled_magic, sizeof(magic)) == 0;
+    fclose(file);
+    return compiled;
+}
+
+// the whole file, mapped where possible and read into memory otherwise
+static std::shared_ptr<const void> map_file(const std::string &path, size_t &size)
+{
+#ifdef __linux__
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size <= 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return nullptr;
+    }
+
+    size = static_cast<size_t>(info.st_size);
+    void *memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (memory == MAP_FAILED)
+        return nullptr;
+    return std::shared_ptr<const void>(memory, [size](const void *memory)
+                                       { munmap(const_cast<void *>(memory), size); });
+#else
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr)
+        return nullptr;
+
+    // doubles for alignment
+    std::shared_ptr<std::vector<double>> buffer = std::make_shared<std::vector<double>>();
+    size = 0;
+    char chunk[1 << 16];
+    std::vector<char> bytes;
+    for (size_t read; (read = fread(chunk, 1, sizeof(chunk), file)) > 0;)
+        bytes.insert(bytes.end(), chunk, chunk + read);
+    fclose(file);
+
+    size = bytes.size();
+    buffer->resize((size + sizeof(double) - 1) / sizeof(double));
+    std::memcpy(buffer->data(), bytes.data(), size);
+    return std::shared_ptr<const void>(buffer, buffer->data());
+#endif
+}
+
+// count records of record_bytes from offset on end within size, without overflowing
+static bool fits(uint64_t offset, uint64_t count, uint64_t record_bytes, uint64_t size)
+{
+    return offset <= size && count <= (size - offset) / record_bytes;
+}
+
+static bool check_header(const CompiledHeader &header, uint64_t size, std::string &error)
+{
+    if (std::memcmp(header.magic, compiled_magic, sizeof(compiled_magic)) != 0 || header.byte_order != byte_order_mark)
+    {
+        error = "not a compiled scene, or from a machine of the other byte order";
+        return false;
+    }
+    if (header.version != compiled_version)
+    {
+        error = "compiled scene version " + std::to_string(header.version) + ", this build reads " + std::to_string(compiled_version);
+        return false;
+    }
+    // the records index nodes and spheres with int32
+    if (!fits(header.settings_offset, header.settings_bytes, 1, size) ||
+        !fits(header.spheres_offset, header.sphere_count, sizeof(CompiledSphere), size) ||
+        !fits(header.nodes_offset, header.node_count, sizeof(CompiledNode), size) ||
+        header.sphere_count > INT32_MAX || header.node_count > INT32_MAX ||
+        header.spheres_offset % 8 != 0 || header.nodes_offset % 8 != 0 ||
+        (header.node_count == 0) != (header.sphere_count == 0))
+    {
+        error = "compiled scene is truncated or damaged";
+        return false;
+    }
+    return true;
+}
+
+// the tree and the spheres' materials, so tracing never reads past the records
+static bool check_records(const CompiledHeader &header, const CompiledSphere *spheres, const CompiledNode *nodes, std::string &error)
+{
+    CompiledTreeCheck tree(header.node_count, header.sphere_count);
+    bool intact = true;
+    for (uint64_t n = 0; n < header.node_count && intact; n++)
+        intact = tree.add(nodes[n]);
+    intact = intact && tree.complete();
+    for (uint64_t s = 0; s < header.sphere_count && intact; s++)
+        intact = spheres[s].material < header.material_count;
+
+    if (!intact)
+        error = "compiled scene is truncated or damaged";
+    return intact;
+}
+
+// the settings text replaces the scene, then the materials the sphere records index, in name order
+static bool load_settings(const CompiledHeader &header, const std::string &settings, Scene &scene,
+                          std::vector<shared_ptr<IMaterial>> &materials, std::string &error)
+{
+    if (!deserialize_scene(settings, scene, error))
+    {
+        return false;
+    }
+    if (scene.materials.size() != header.material_count)
+    {
+        error = "compiled scene lists " + std::to_string(scene.materials.size()) + " materials, its spheres use " + std::to_string(header.material_count);
+        return false;
+    }
+
+    for (const auto &pair : scene.materials)
+        materials.push_back(pair.second);
+    return true;
+}
+
+static std::string object_name(const std::string &path)
+{
+    size_t slash = path.find_last_of('/');
+    std::string name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+    name = name.substr(0, name.find('.'));
+    return name.empty() ? "compiled" : name;
+}
+
+// only the header and settings are read, the spheres stay on disk for StreamedSpheres
+static bool load_streamed_scene(const std::string &path, Scene &scene, size_t geometry_cache_bytes, std::string &error)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    CompiledHeader header;
+    uint64_t size = 0;
+    bool read = file != nullptr && fread(&header, 1, sizeof(header), file) == sizeof(header) &&
+                fseek(file, 0, SEEK_END) == 0 && (size = uint64_t(ftell(file))) > 0;
+    if (!read)
+    {
+        if (file != nullptr)
+            fclose(file);
+        error = "could not read " + path;
+        return false;
+    }
+    if (!check_header(header, size, error))
+    {
+        fclose(file);
+        return false;
+    }
+
+    std::string settings(header.settings_bytes, '\0');
+    read = fseek(file, long(header.settings_offset), SEEK_SET) == 0 && fread(&settings[0], 1, settings.size(), file) == settings.size();
+    fclose(file);
+    if (!read)
+    {
+        error = "could not read " + path;
+        return false;
+    }
+
+    std::vector<shared_ptr<IMaterial>> materials;
+    if (!load_settings(header, settings, scene, materials, error))
+        return false;
+
+    if (header.sphere_count > 0)
+    {
+        std::shared_ptr<StreamedSpheres> spheres = std::make_shared<StreamedSpheres>(object_name(path), path, header.nodes_offset, header.node_count,
+                                                                                     header.spheres_offset, header.sphere_count, materials, geometry_cache_bytes);
+        if (!spheres->open(error))
+            return false;
+        scene.addObject(spheres);
+    }
+    return true;
+}
+
+bool load_compiled_scene(const std::string &path, Scene &scene, std::string &error, size_t geometry_cache_bytes)
+{
+    if (geometry_cache_bytes > 0)
+        return load_streamed_scene(path, scene, geometry_cache_bytes, error);
+
+    size_t size = 0;
+    std::shared_ptr<const void> storage = map_file(path, size);
+    if (!storage)
+    {
+        error = "could not read " + path;
+        return false;
+    }
+
+    const uint8_t *bytes = static_cast<const uint8_t *>(storage.get());
+    CompiledHeader header;
+    if (size < sizeof(header))
+    {
+        error = "not a compiled scene";
+        return false;
+    }
+    std::memcpy(&header, bytes, sizeof(header));
+    if (!check_header(header, size, error))
+        return false;
+    const CompiledSphere *spheres = reinterpret_cast<const CompiledSphere *>(bytes + header.spheres_offset);
+    const CompiledNode *nodes = reinterpret_cast<const CompiledNode *>(bytes + header.nodes_offset);
+    if (!check_records(header, spheres, nodes, error))
+        return false;
+
+    std::string settings(reinterpret_cast<const char *>(bytes + header.settings_offset), header.settings_bytes);
+    std::vector<shared_ptr<IMaterial>> materials;
+    if (!load_settings(header, settings, scene, materials, error))
+        return false;
+
+    if (header.sphere_count > 0)
+    {
+        scene.addObject(std::make_shared<CompiledSpheres>(object_name(path), storage, spheres, header.sphere_count,
+                                                          nodes, header.node_count, materials));
+    }
+    return true;
+}
+#pragma endregion
@@ -0,0 +1,21 @@
+#ifndef SCENE_COMPILER_H
+#define SCENE_COMPILER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "scene.h"
+
+// the compiled scene format: the settings text of serialize_scene_settings, then every sphere and the BVH over them
+// as flat records. Loading maps the file and traces the records in place, nothing is parsed or built per object
+
+// empty with error set when the scene has objects that aren't spheres
+std::vector<uint8_t> compile_scene(Scene &scene, std::string &error);
+bool write_compiled_scene(Scene &scene, const std::string &path, std::string &error);
+
+bool is_compiled_scene(const std::string &path);
+// replaces the scene contents like deserialize_scene, the spheres become one read-only CompiledSpheres object.
+// With a geometry cache size they become a StreamedSpheres object instead, paged in from disk up to that many bytes
+bool load_compiled_scene(const std::string &path, Scene &scene, std::string &error, size_t geometry_cache_bytes = 0);
+
+#endif
@@ -0,0 +1,357 @@
+#include "scene_serializer.h"
+#include "raytracer/sphere3d.h"
+#include "raytracer/compiled_spheres.h"
+
+#include <iomanip>
+#include <limits>
+
+#pragma region names
+// names are quoted so they can hold spaces, with \ escaping quotes and backslashes
+static void write_name(std::ostream &out, const std::string &name)
+{
+    out << '"';
+    for (char c : name)
+    {
+        if (c == '"' || c == '\\')
+            out << '\\';
+        out << c;
+    }
+    out << '"';
+}
+
+static bool read_name(std::istream &in, std::string &name)
+{
+    name.clear();
+    char c;
+    if (!(in >> c) || c != '"')
+        return false;
+
+    while (in.get(c))
+    {
+        if (c == '"')
+            return true;
+        if (c == '\\' && !in.get(c))
+            return false;
+        name += c;
+    }
+    return false;
+}
+
+static void write_vector(std::ostream &out, const Vector3d &v)
+{
+    out << ' ' << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
+}
+
+static bool read_vector(std::istream &in, Vector3d &v)
+{
+    return static_cast<bool>(in >> v.e[0] >> v.e[1] >> v.e[2]);
+}
+
+// the settings a camera line carries, after its keyword
+static void write_camera(std::ostream &out, const Camera &camera)
+{
+    out << ' ' << camera.image_width << ' ' << camera.aspect_ratio_width << ' ' << camera.aspect_ratio_height << ' '
+        << camera.samples_per_pixel << ' ' << camera.max_depth << ' ' << camera.vfov;
+    write_vector(out, camera.lookFrom);
+    write_vector(out, camera.lookAt);
+    write_vector(out, camera.vector_up);
+    out << ' ' << camera.defocus_angle << ' ' << camera.focus_distance << ' ' << camera.tile_size << '\n';
+}
+
+static bool read_camera(std::istream &in, Camera &camera)
+{
+    return static_cast<bool>(in >> camera.image_width >> camera.aspect_ratio_width >> camera.aspect_ratio_height >>
+                             camera.samples_per_pixel >> camera.max_depth >> camera.vfov) &&
+           read_vector(in, camera.lookFrom) && read_vector(in, camera.lookAt) && read_vector(in, camera.vector_up) &&
+           static_cast<bool>(in >> camera.defocus_angle >> camera.focus_distance >> camera.tile_size);
+}
+#pragma endregion
+
+#pragma region writer
+SceneWriter::SceneWriter(std::ostream &out) : out(out) {}
+
+void SceneWriter::visit(IHittable *object)
+{
+    out << "# unsupported object ";
+    write_name(out, object->name);
+    out << '\n';
+}
+
+void SceneWriter::visit(Sphere3d *sphere)
+{
+    out << "sphere ";
+    write_name(out, sphere->name);
+    write_vector(out, sphere->center);
+    out << ' ' << sphere->radius << ' ';
+    write_name(out, sphere->material->name);
+    out << '\n';
+}
+
+void SceneWriter::visit(CompiledSpheres *spheres)
+{
+    // back to one line per sphere, named after the compiled object
+    for (size_t k = 0; k < spheres->sphere_count; k++)
+    {
+        const CompiledSphere &sphere = spheres->spheres[k];
+        out << "sphere ";
+        write_name(out, spheres->name + "/" + std::to_string(k));
+        out << ' ' << sphere.center[0] << ' ' << sphere.center[1] << ' ' << sphere.center[2] << ' ' << sphere.radius << ' ';
+        write_name(out, spheres->materials[sphere.material]->name);
+        out << '\n';
+    }
+}
+
+void SceneWriter::visit(Vector3d *vector)
+{
+    write_vector(out, *vector);
+}
+
+void SceneWriter::visit(IMaterial *material)
+{
+    out << "# unsupported material ";
+    write_name(out, material->name);
+    out << '\n';
+}
+
+void SceneWriter::visit(Lambertian *material)
+{
+    out << "lambertian ";
+    write_name(out, material->name);
+    write_vector(out, material->albedo);
+    out << '\n';
+}
+
+void SceneWriter::visit(Metal *material)
+{
+    out << "metal ";
+    write_name(out, material->name);
+    write_vector(out, material->albedo);
+    out << ' ' << material->fuzz << '\n';
+}
+
+void SceneWriter::visit(Dielectric *material)
+{
+    out << "dielectric ";
+    write_name(out, material->name);
+    write_vector(out, material->tint);
+    out << ' ' << material->refraction_index << '\n';
+}
+#pragma endregion
+
+static void write_settings(std::ostream &out, Scene &scene)
+{
+    SceneWriter writer(out);
+
+    out << "camera";
+    write_camera(out, scene.camera);
+    out << "budget " << scene.camera.budget.seconds << ' ' << scene.camera.budget.target_noise << ' ' << scene.camera.budget.max_passes << '\n';
+    for (const Camera &view : scene.views)
+    {
+        out << "view";
+        write_camera(out, view);
+    }
+
+    for (const auto &pair : scene.materials)
+    {
+        pair.second->accept(&writer);
+    }
+}
+
+std::string serialize_scene(Scene &scene)
+{
+    std::ostringstream out;
+    out << std::setprecision(std::numeric_limits<double>::max_digits10);
+    SceneWriter writer(out);
+    write_settings(out, scene);
+
+    for (const auto &pair : scene.world.objects)
+    {
+        pair.second->accept(&writer);
+    }
+
+    return out.str();
+}
+
+std::string serialize_scene_settings(Scene &scene)
+{
+    std::ostringstream out;
+    out << std::setprecision(std::numeric_limits<double>::max_digits10);
+    write_settings(out, scene);
+    return out.str();
+}
+
+bool deserialize_scene(const std::string &text, Scene &scene, std::string &error)
+{
+    scene.world.clear();
+    scene.materials.clear();
+    scene.views.clear();
+    scene.camera.budget = RenderBudget(); // files without a budget line render to the sample count
+    scene.markChanged(SCENE_CHANGE_ALL);
+
+    std::istringstream lines(text);
+    std::string line;
+    int line_number = 0;
+    while (std::getline(lines, line))
+    {
+        line_number++;
+        std::istringstream in(line);
+        std::string kind, name, material_name;
+        Vector3d v;
+        double value = 0;
+        bool ok = true;
+
+        if (!(in >> kind) || kind[0] == '#')
+            continue;
+
+        if (kind == "camera")
+        {
+            ok = read_camera(in, scene.camera);
+        }
+        else if (kind == "budget")
+        {
+            RenderBudget &budget = scene.camera.budget;
+            ok = static_cast<bool>(in >> budget.seconds >> budget.target_noise >> budget.max_passes);
+        }
+        else if (kind == "view")
+        {
+            Camera view = scene.camera;
+            ok = read_camera(in, view);
+            if (ok)
+                scene.views.push_back(view);
+        }
+        else if (kind == "lambertian")
+        {
+            ok = read_name(in, name) && read_vector(in, v);
+            if (ok)
+                scene.addMaterial(MaterialFactory::createLambertian(name, v));
+        }
+        else if (kind == "metal")
+        {
+            ok = read_name(in, name) && read_vector(in, v) && static_cast<bool>(in >> value);
+            if (ok)
+                scene.addMaterial(MaterialFactory::createMetal(name, v, value));
+        }
+        else if (kind == "dielectric")
+        {
+            ok = read_name(in, name) && read_vector(in, v) && static_cast<bool>(in >> value);
+            if (ok)
+                scene.addMaterial(MaterialFactory::createDielectric(name, v, value));
+        }
+        else if (kind == "sphere")
+        {
+            ok = read_name(in, name) && read_vector(in, v) && static_cast<bool>(in >> value) && read_name(in, material_name);
+            if (ok && scene.materials.find(material_name) == scene.materials.end())
+            {
+                error = "line " + std::to_string(line_number) + ": unknown material " + material_name;
+                return false;
+            }
+            if (ok)
+                scene.addObject(HittableFactory::createSphere(name, v, value, scene.materials[material_name]));
+        }
+        else
+        {
+            ok = false;
+        }
+
+        if (!ok)
+        {
+            error = "line " + std::to_string(line_number) + ": cannot read \"" + line + "\"";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool deserialize_views(const std::string &text, const Camera &base, std::vector<Camera> &views, std::string &error)
+{
+    views.clear();
+
+    std::istringstream lines(text);
+    std::string line;
+    int line_number = 0;
+    while (std::getline(lines, line))
+    {
+        line_number++;
+        std::istringstream in(line);
+        std::string kind;
+        if (!(in >> kind) || kind != "view")
+            continue;
+
+        Camera view = base;
+        if (!read_camera(in, view))
+        {
+            error = "line " + std::to_string(line_number) + ": cannot read \"" + line + "\"";
+            return false;
+        }
+        views.push_back(view);
+    }
+
+    return true;
+}
+
+// one key per line, times in seconds:
+//   fps 24
+//   from 0 x y z / at 0 x y z / vfov 0 degrees   camera keys
+//   center 0 "name" x y z / radius 0 "name" r    sphere keys
+bool deserialize_animation(const std::string &text, Animation &animation, std::string &error)
+{
+    animation = Animation();
+
+    std::istringstream lines(text);
+    std::string line;
+    int line_number = 0;
+    while (std::getline(lines, line))
+    {
+        line_number++;
+        std::istringstream in(line);
+        std::string kind, name;
+        Vector3d v;
+        double time = 0, value = 0;
+        bool ok = true;
+
+        if (!(in >> kind) || kind[0] == '#')
+            continue;
+
+        if (kind == "fps")
+        {
+            ok = static_cast<bool>(in >> animation.fps) && animation.fps > 0;
+        }
+        else if (kind == "from" || kind == "at")
+        {
+            ok = static_cast<bool>(in >> time) && read_vector(in, v);
+            if (ok)
+                (kind == "from" ? animation.camera_from : animation.camera_at).key(time, v);
+        }
+        else if (kind == "vfov")
+        {
+            ok = static_cast<bool>(in >> time >> value);
+            if (ok)
+                animation.camera_vfov.key(time, value);
+        }
+        else if (kind == "center")
+        {
+            ok = static_cast<bool>(in >> time) && read_name(in, name) && read_vector(in, v);
+            if (ok)
+                animation.object_center[name].key(time, v);
+        }
+        else if (kind == "radius")
+        {
+            ok = static_cast<bool>(in >> time) && read_name(in, name) && static_cast<bool>(in >> value);
+            if (ok)
+                animation.object_radius[name].key(time, value);
+        }
+        else
+        {
+            ok = false;
+        }
+
+        if (!ok)
+        {
+            error = "line " + std::to_string(line_number) + ": cannot read \"" + line + "\"";
+            return false;
+        }
+    }
+
+    return true;
+}
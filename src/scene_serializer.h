@@ -0,0 +1,43 @@
+#ifndef SCENE_SERIALIZER_H
+#define SCENE_SERIALIZER_H
+
+#include <string>
+#include <sstream>
+#include "scene.h"
+#include "sequence.h"
+#include "utils/visitor.h"
+
+// writes objects and materials as one line each of the scene text format
+class SceneWriter : public IVisitor
+{
+public:
+    SceneWriter(std::ostream &out);
+
+    void visit(IHittable *object) override;
+    void visit(Sphere3d *sphere) override;
+    void visit(CompiledSpheres *spheres) override;
+    void visit(Vector3d *vector) override;
+    void visit(IMaterial *material) override;
+    void visit(Lambertian *material) override;
+    void visit(Metal *material) override;
+    void visit(Dielectric *material) override;
+
+private:
+    std::ostream &out;
+};
+
+// camera, render settings, saved views, materials and objects as text, one entry per line
+std::string serialize_scene(Scene &scene);
+// the same without the objects
+std::string serialize_scene_settings(Scene &scene);
+
+// replaces the scene contents, returns false and describes the first bad line on error
+bool deserialize_scene(const std::string &text, Scene &scene, std::string &error);
+
+// only the view lines of text, on top of base for anything a line leaves out, so a scene file works too
+bool deserialize_views(const std::string &text, const Camera &base, std::vector<Camera> &views, std::string &error);
+
+// keyframes for SequenceRenderer, same error reporting
+bool deserialize_animation(const std::string &text, Animation &animation, std::string &error);
+
+#endif
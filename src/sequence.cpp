@@ -0,0 +1,268 @@
+#include "sequence.h"
+#include "raytracer/sphere3d.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <thread>
+
+static double seconds_since(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+#pragma region tracks
+template <typename T>
+void Track<T>::key(double time, const T &value)
+{
+    typename std::vector<std::pair<double, T>>::iterator it = keys.begin();
+    while (it != keys.end() && it->first < time)
+        ++it;
+
+    if (it != keys.end() && it->first == time)
+        it->second = value;
+    else
+        keys.insert(it, std::make_pair(time, value));
+}
+
+template <typename T>
+bool Track<T>::empty() const
+{
+    return keys.empty();
+}
+
+template <typename T>
+double Track<T>::end() const
+{
+    return keys.empty() ? 0 : keys.back().first;
+}
+
+template <typename T>
+T Track<T>::at(double time) const
+{
+    if (time <= keys.front().first)
+        return keys.front().second;
+    if (time >= keys.back().first)
+        return keys.back().second;
+
+    size_t k = 1;
+    while (keys[k].first < time)
+        k++;
+
+    const std::pair<double, T> &a = keys[k - 1];
+    const std::pair<double, T> &b = keys[k];
+    double s = (time - a.first) / (b.first - a.first);
+    return a.second * (1 - s) + b.second * s;
+}
+
+template class Track<Point3d>;
+template class Track<double>;
+#pragma endregion
+
+#pragma region animation
+Animation::Animation() : fps(24) {}
+
+Animation Animation::turntable(const Camera &camera, double seconds)
+{
+    Animation animation;
+    Vector3d axis = unit_vector(camera.vector_up);
+    Vector3d offset = camera.lookFrom - camera.lookAt;
+
+    // a key every 5 degrees keeps the linear path within a fraction of a percent of the circle
+    const int steps = 72;
+    for (int k = 0; k <= steps; k++)
+    {
+        double angle = 2 * pi * k / steps;
+        Vector3d rotated = offset * cos(angle) + cross(axis, offset) * sin(angle) + axis * dot(axis, offset) * (1 - cos(angle));
+        animation.camera_from.key(seconds * k / steps, camera.lookAt + rotated);
+    }
+    animation.camera_at.key(0, camera.lookAt);
+    return animation;
+}
+
+double Animation::duration() const
+{
+    double end = std::max(camera_from.end(), std::max(camera_at.end(), camera_vfov.end()));
+    for (const auto &track : object_center)
+        end = std::max(end, track.second.end());
+    for (const auto &track : object_radius)
+        end = std::max(end, track.second.end());
+    return end;
+}
+
+int Animation::frame_count() const
+{
+    // a loop's last key is its first frame again, so frames stop just short of the end
+    return std::max(1, static_cast<int>(std::lround(duration() * fps)));
+}
+
+bool Animation::check(const Scene &scene, std::string &error) const
+{
+    if (fps <= 0)
+    {
+        error = "frames per second must be positive";
+        return false;
+    }
+
+    std::vector<std::string> names;
+    for (const auto &track : object_center)
+        names.push_back(track.first);
+    for (const auto &track : object_radius)
+        names.push_back(track.first);
+
+    for (const std::string &name : names)
+    {
+        std::map<std::string, shared_ptr<IHittable>>::const_iterator it = scene.world.objects.find(name);
+        if (it == scene.world.objects.end() || dynamic_cast<Sphere3d *>(it->second.get()) == nullptr)
+        {
+            error = "no sphere named " + name;
+            return false;
+        }
+    }
+    return true;
+}
+
+void Animation::apply(Scene &scene, double time) const
+{
+    if (!camera_from.empty())
+        scene.camera.lookFrom = camera_from.at(time);
+    if (!camera_at.empty())
+        scene.camera.lookAt = camera_at.at(time);
+    if (!camera_vfov.empty())
+        scene.camera.vfov = camera_vfov.at(time);
+
+    for (const auto &track : object_center)
+        static_cast<Sphere3d *>(scene.world.getObject(track.first).get())->center = track.second.at(time);
+    for (const auto &track : object_radius)
+        static_cast<Sphere3d *>(scene.world.getObject(track.first).get())->radius = track.second.at(time);
+}
+#pragma endregion
+
+#pragma region sequence
+std::string numbered_path(const std::string &pattern, int number)
+{
+    std::string path = pattern;
+    size_t first = path.find('#');
+    if (first == std::string::npos)
+    {
+        // no placeholder, number before the extension
+        size_t dot = path.rfind('.');
+        size_t slash = path.find_last_of('/');
+        first = (dot == std::string::npos || (slash != std::string::npos && dot < slash)) ? path.size() : dot;
+        path.insert(first, "_####");
+        first++;
+    }
+    size_t width = path.find_first_not_of('#', first);
+    width = (width == std::string::npos ? path.size() : width) - first;
+
+    std::string digits = std::to_string(number);
+    if (digits.size() < width)
+        digits.insert(0, width - digits.size(), '0');
+    return path.replace(first, width, digits);
+}
+
+SequenceRenderer::SequenceRenderer(Scene &scene, const Animation &animation)
+    : output_pattern("frame_####.png"),
+      first_frame(0),
+      last_frame(-1),
+      frames_rendered(0),
+      bvh_builds(0),
+      trace_seconds(0),
+      encode_seconds(0),
+      total_seconds(0),
+      scene(scene),
+      animation(animation)
+{
+}
+
+double SequenceRenderer::frames_per_hour() const
+{
+    return total_seconds > 0 ? 3600 * frames_rendered / total_seconds : 0;
+}
+
+std::string SequenceRenderer::frame_path(int frame) const
+{
+    return numbered_path(output_pattern, frame);
+}
+
+bool SequenceRenderer::render(int nthreads, std::string &progress)
+{
+    std::string error;
+    if (!animation.check(scene, error))
+    {
+        std::cerr << "Cannot render sequence: " << error << std::endl;
+        return false;
+    }
+
+    int last = last_frame < 0 ? animation.frame_count() - 1 : last_frame;
+    ImageFormat format = IMAGE_FORMAT_PNG;
+    image_format_for_path(output_pattern, format); // png unless the pattern says otherwise
+    frames_rendered = 0;
+    bvh_builds = 0;
+    trace_seconds = 0;
+    encode_seconds = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // the frame being written while the next one traces
+    struct Encoding
+    {
+        std::thread thread;
+        bool written;
+        double seconds;
+    } encoding;
+    encoding.written = true;
+    encoding.seconds = 0;
+
+    bool ok = true;
+    auto finish_encoding = [&]()
+    {
+        if (encoding.thread.joinable())
+        {
+            encoding.thread.join();
+            encode_seconds += encoding.seconds;
+            ok = ok && encoding.written;
+        }
+    };
+
+    for (int frame = first_frame; frame <= last && ok; frame++)
+    {
+        animation.apply(scene, frame / animation.fps);
+        bvh_builds += scene.world.updateBvh() ? 1 : 0;
+
+        std::chrono::steady_clock::time_point trace_start = std::chrono::steady_clock::now();
+        std::string frame_progress;
+        shared_ptr<FramePixels> image = std::make_shared<FramePixels>(scene.camera.render(scene.world, nthreads, frame_progress));
+        trace_seconds += seconds_since(trace_start);
+
+        finish_encoding();
+        if (image->empty())
+        {
+            ok = false;
+            break;
+        }
+
+        int width = scene.camera.image_width;
+        int height = scene.camera.image_height;
+        std::string path = frame_path(frame);
+        Encoding *target = &encoding;
+        encoding.thread = std::thread([image, width, height, path, format, target]()
+                                      {
+            // one thread, the render threads are busy with the next frame
+            std::chrono::steady_clock::time_point encode_start = std::chrono::steady_clock::now();
+            target->written = write_image_file(path, format, *image, width, height, 1);
+            target->seconds = seconds_since(encode_start); });
+
+        frames_rendered++;
+        progress = "Frame " + std::to_string(frame - first_frame + 1) + "/" + std::to_string(last - first_frame + 1);
+    }
+    finish_encoding();
+
+    total_seconds = seconds_since(start);
+    scene.markChanged(SCENE_CHANGE_ALL); // the scene is left at the last frame's pose
+
+    std::clog << "Rendered " << frames_rendered << " frames in " << total_seconds << "s, " << frames_per_hour() << " frames per hour ("
+              << trace_seconds << "s tracing, " << encode_seconds << "s writing, " << bvh_builds << " BVH builds)" << std::endl;
+    return ok;
+}
+#pragma endregion
@@ -0,0 +1,78 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "scene.h"
+
+// a value over time in seconds, linear between keys and held before the first and after the last
+template <typename T>
+class Track
+{
+public:
+    std::vector<std::pair<double, T>> keys; // sorted by time
+
+    void key(double time, const T &value);
+    bool empty() const;
+    double end() const;
+    T at(double time) const;
+};
+
+// keyframed camera and object parameters
+class Animation
+{
+public:
+    double fps;
+    Track<Point3d> camera_from;
+    Track<Point3d> camera_at;
+    Track<double> camera_vfov;
+    std::map<std::string, Track<Point3d>> object_center; // by object name, spheres only
+    std::map<std::string, Track<double>> object_radius;
+
+    Animation();
+
+    // one orbit of the camera around its look-at point, keeping its height and distance
+    static Animation turntable(const Camera &camera, double seconds);
+
+    double duration() const; // time of the last key
+    int frame_count() const;
+    // false when a track names an object that isn't a sphere of the scene
+    bool check(const Scene &scene, std::string &error) const;
+    void apply(Scene &scene, double time) const;
+};
+
+// pattern with its run of # replaced by the zero padded number, or _#### added before the extension
+std::string numbered_path(const std::string &pattern, int number);
+
+// renders an animation to numbered image files. Each frame refits the scene's BVH instead of
+// building it again, and frame N is written on a second thread while frame N+1 traces
+class SequenceRenderer
+{
+public:
+    SequenceRenderer(Scene &scene, const Animation &animation);
+
+    std::string output_pattern; // a run of # becomes the zero padded frame number, "frame_####.png". Also picks png, qoi or ppm
+    int first_frame;
+    int last_frame; // inclusive, -1 for the end of the animation
+
+    // results of the last render
+    int frames_rendered;
+    int bvh_builds;
+    double trace_seconds;
+    double encode_seconds;
+    double total_seconds;
+    double frames_per_hour() const;
+
+    // false when the animation doesn't fit the scene or a frame couldn't be written
+    bool render(int nthreads, std::string &progress);
+
+    std::string frame_path(int frame) const;
+
+private:
+    Scene &scene;
+    const Animation &animation;
+};
+
+#endif
@@ -0,0 +1,291 @@
+#include "cpu_topology.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#pragma region parsing
+
+// "0-3,8,10-11" as used by sysfs cpulists
+static std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ','))
+    {
+        if (range.empty() || range == "\n")
+            continue;
+
+        size_t dash = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = (dash == std::string::npos) ? first : std::atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+static bool read_first_line(const std::string &path, std::string &line)
+{
+    std::ifstream file(path);
+    return file && std::getline(file, line);
+}
+
+// cgroup v2 cpu.max is "<quota> <period>" or "max <period>"
+static double cgroup_v2_quota(const std::string &dir)
+{
+    std::string line;
+    if (!read_first_line(dir + "/cpu.max", line))
+        return -1;
+
+    std::stringstream ss(line);
+    std::string quota;
+    double period = 0;
+    ss >> quota >> period;
+    if (quota == "max" || period <= 0)
+        return 0;
+    return std::atof(quota.c_str()) / period;
+}
+
+static double cgroup_v1_quota(const std::string &dir)
+{
+    std::string quota, period;
+    if (!read_first_line(dir + "/cpu.cfs_quota_us", quota) || !read_first_line(dir + "/cpu.cfs_period_us", period))
+        return -1;
+
+    double q = std::atof(quota.c_str());
+    double p = std::atof(period.c_str());
+    return (q > 0 && p > 0) ? q / p : 0;
+}
+
+// a cgroup gets no more than its parents allow, so the smallest quota from path up to the root counts.
+// 0 when none is set, -1 when no cgroup on the way could be read
+static double smallest_quota(const std::string &root, std::string path, double (*quota_of)(const std::string &dir))
+{
+    double smallest = -1;
+    while (true)
+    {
+        double quota = quota_of(root + path);
+        if (quota > 0 && (smallest <= 0 || quota < smallest))
+            smallest = quota;
+        else if (quota == 0 && smallest < 0)
+            smallest = 0;
+
+        if (path.empty() || path == "/")
+            break;
+        size_t slash = path.rfind('/');
+        path = (slash == std::string::npos) ? std::string() : path.substr(0, slash);
+    }
+    return smallest;
+}
+
+// whether a cgroup v1 line of /proc/self/cgroup, "<id>:<controllers>:<path>", is the cpu controller's
+static bool is_v1_cpu_line(const std::string &line)
+{
+    size_t first = line.find(':');
+    size_t second = (first == std::string::npos) ? std::string::npos : line.find(':', first + 1);
+    if (second == std::string::npos)
+        return false;
+
+    std::stringstream controllers(line.substr(first + 1, second - first - 1));
+    std::string controller;
+    while (std::getline(controllers, controller, ','))
+    {
+        if (controller == "cpu")
+            return true;
+    }
+    return false;
+}
+
+static double detect_cpu_quota()
+{
+    // the process' own cgroup and its parents. In a container that path may not exist, its namespace root
+    // is the top then
+    std::ifstream cgroups("/proc/self/cgroup");
+    std::string line, v2_path, v1_path;
+    while (cgroups && std::getline(cgroups, line))
+    {
+        if (line.compare(0, 3, "0::") == 0)
+            v2_path = line.substr(3);
+        else if (is_v1_cpu_line(line))
+            v1_path = line.substr(line.find(':', line.find(':') + 1) + 1);
+    }
+
+    double quota = smallest_quota("/sys/fs/cgroup", v2_path, cgroup_v2_quota);
+    if (quota >= 0)
+        return quota;
+
+    quota = smallest_quota("/sys/fs/cgroup/cpu,cpuacct", v1_path, cgroup_v1_quota);
+    if (quota >= 0)
+        return quota;
+
+    quota = smallest_quota("/sys/fs/cgroup/cpu", v1_path, cgroup_v1_quota);
+    return (quota >= 0) ? quota : 0;
+}
+
+#pragma endregion
+
+CpuTopology::CpuTopology() : cpu_quota(0) {}
+
+CpuTopology CpuTopology::detect()
+{
+    CpuTopology topology;
+
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &mask))
+                topology.cpus.push_back(cpu);
+        }
+    }
+
+    for (int node = 0;; node++)
+    {
+        std::string list;
+        if (!read_first_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", list))
+            break;
+
+        std::vector<int> usable;
+        for (int cpu : parse_cpu_list(list))
+        {
+            for (int allowed : topology.cpus)
+            {
+                if (cpu == allowed)
+                    usable.push_back(cpu);
+            }
+        }
+
+        if (!usable.empty())
+            topology.nodes.push_back(usable);
+    }
+
+    topology.cpu_quota = detect_cpu_quota();
+#endif
+
+    if (topology.cpus.empty())
+    {
+        unsigned int count = std::thread::hardware_concurrency();
+        for (unsigned int cpu = 0; cpu < (count ? count : 1); cpu++)
+            topology.cpus.push_back(cpu);
+    }
+
+    if (topology.nodes.empty())
+    {
+        topology.nodes.push_back(topology.cpus);
+    }
+
+    return topology;
+}
+
+const CpuTopology &CpuTopology::get()
+{
+    static const CpuTopology topology = detect();
+    return topology;
+}
+
+unsigned int CpuTopology::usable_threads() const
+{
+    unsigned int threads = cpus.size();
+    if (cpu_quota > 0 && std::ceil(cpu_quota) < threads)
+    {
+        threads = (unsigned int)std::ceil(cpu_quota);
+    }
+    return threads ? threads : 1;
+}
+
+unsigned int CpuTopology::clamp_threads(int requested) const
+{
+    unsigned int usable = usable_threads();
+    if (requested < 1)
+    {
+        return 1;
+    }
+    return (unsigned int)requested < usable ? (unsigned int)requested : usable;
+}
+
+std::vector<int> CpuTopology::place_threads(unsigned int nthreads) const
+{
+    // round robin over the nodes, then over each node's CPUs. Each call goes on where the last one stopped,
+    // so renders running at the same time don't pin their workers to the same CPUs
+    static std::atomic<unsigned int> next_slot(0);
+    unsigned int first = next_slot.fetch_add(nthreads);
+    std::vector<int> placement;
+    for (unsigned int t = 0; t < nthreads; t++)
+    {
+        unsigned int slot = first + t;
+        const std::vector<int> &node = nodes[slot % nodes.size()];
+        placement.push_back(node[(slot / nodes.size()) % node.size()]);
+    }
+    return placement;
+}
+
+int CpuTopology::node_of(int cpu) const
+{
+    for (size_t n = 0; n < nodes.size(); n++)
+    {
+        for (int node_cpu : nodes[n])
+        {
+            if (node_cpu == cpu)
+                return n;
+        }
+    }
+    return 0;
+}
+
+std::string CpuTopology::describe() const
+{
+    std::stringstream ss;
+    ss << cpus.size() << " usable CPUs on " << nodes.size() << " NUMA node" << (nodes.size() == 1 ? "" : "s");
+    if (cpu_quota > 0)
+    {
+        ss << ", cgroup quota " << cpu_quota << " CPUs";
+    }
+    for (size_t n = 0; n < nodes.size(); n++)
+    {
+        ss << "\n  node " << n << ":";
+        for (int cpu : nodes[n])
+            ss << " " << cpu;
+    }
+    return ss.str();
+}
+
+bool pin_current_thread(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+#else
+    return false;
+#endif
+}
+
+void advise_huge_pages(void *memory, size_t bytes)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    uintptr_t page = uintptr_t(sysconf(_SC_PAGESIZE));
+    uintptr_t first = (uintptr_t(memory) + page - 1) & ~(page - 1);
+    uintptr_t end = (uintptr_t(memory) + bytes) & ~(page - 1);
+    if (end > first)
+        madvise(reinterpret_cast<void *>(first), end - first, MADV_HUGEPAGE);
+#endif
+}
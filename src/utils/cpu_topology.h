@@ -0,0 +1,68 @@
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+// the wasm build without pthreads runs everything on the calling thread; with -pthread it's multithreaded like Linux
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+#define SINGLE_THREADED_BUILD 1
+#endif
+
+// CPUs this process can actually run on, grouped by NUMA node
+class CpuTopology
+{
+public:
+    std::vector<int> cpus;               // from the affinity mask
+    std::vector<std::vector<int>> nodes; // usable CPUs of every NUMA node that has any
+    double cpu_quota;                    // cgroup CPU quota in CPUs, 0 when unlimited
+
+    CpuTopology();
+
+    static CpuTopology detect();
+    static const CpuTopology &get(); // detected once per process
+
+    unsigned int usable_threads() const;
+    unsigned int clamp_threads(int requested) const; // what a render asked for requested threads runs on, 1 to usable_threads()
+    std::vector<int> place_threads(unsigned int nthreads) const; // CPU for each worker, spread over the nodes and calls
+    int node_of(int cpu) const;
+    std::string describe() const;
+};
+
+bool pin_current_thread(int cpu);
+
+// asks for transparent huge pages on the whole pages within [memory, memory + bytes), where the system has them.
+// Pages touched before keep their size until the kernel collapses them
+void advise_huge_pages(void *memory, size_t bytes);
+
+// std::allocator, but elements made without arguments are left unconstructed, so sizing a vector doesn't touch its
+// memory. The thread that first writes a page decides its NUMA node. Such elements must be constructed in place
+// before they're used, assigning to them isn't enough for classes with virtual functions
+template <typename T>
+class UntouchedAllocator : public std::allocator<T>
+{
+public:
+    template <typename U>
+    struct rebind
+    {
+        typedef UntouchedAllocator<U> other;
+    };
+
+    UntouchedAllocator() {}
+    template <typename U>
+    UntouchedAllocator(const UntouchedAllocator<U> &) {}
+
+    template <typename U>
+    void construct(U *) {}
+    template <typename U, typename... Args>
+    void construct(U *element, Args &&...args)
+    {
+        ::new (static_cast<void *>(element)) U(std::forward<Args>(args)...);
+    }
+};
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <cstdio>
+#include <string>
+
+// text for a JSON string literal, without the quotes. Paths and error messages can hold any byte
+inline std::string json_escape(const std::string &text)
+{
+    std::string escaped;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        if (c == '\n')
+        {
+            escaped += "\\n";
+            continue;
+        }
+        // other control characters aren't allowed in JSON strings either
+        if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned char>(c));
+            escaped += code;
+            continue;
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+#endif
@@ -1,5 +1,22 @@
 #include "math_utils.h"
 
+thread_local RandomStream random_stream = {0, false};
+
+void RandomStream::seed(uint64_t seed, uint64_t stream)
+{
+    uint64_t z = seed * 0x9e3779b97f4a7c15ULL + stream + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    state = z != 0 ? z : 1; // xorshift never leaves zero
+    seeded = true;
+}
+
+void RandomStream::clear()
+{
+    seeded = false;
+}
+
 const Interval Interval::empty = Interval(+infinity, -infinity);
 const Interval Interval::universe = Interval(-infinity, +infinity);
 
@@ -7,6 +24,9 @@ Interval::Interval() : min(0), max(0) {}
 
 Interval::Interval(double min, double max) : min(min), max(max) {}
 
+Interval::Interval(const Interval &a, const Interval &b)
+    : min(a.min <= b.min ? a.min : b.min), max(a.max >= b.max ? a.max : b.max) {}
+
 double Interval::size() const {
     return max - min;
 }
@@ -23,4 +43,9 @@ double Interval::clamp(double x) const {
     if (x < min) return min;
     if (x > max) return max;
     return x;
+}
+
+Interval Interval::expand(double delta) const {
+    double padding = delta / 2;
+    return Interval(min - padding, max + padding);
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 #define MATH_UTILS_H
 
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
 #include <limits>
 
 const double infinity = std::numeric_limits<double>::infinity();
@@ -20,11 +22,33 @@ inline double radians_to_degrees(double angle_in_radians)
     return angle_in_radians * (180.0 / pi);
 }
 
+// a thread's own random numbers, for renders that must come out the same on any number of threads.
+// Unseeded, random_double() uses rand()
+struct RandomStream
+{
+    uint64_t state;
+    bool seeded;
+
+    void seed(uint64_t seed, uint64_t stream); // splitmix64 of both, so neighbouring streams don't correlate
+    void clear();
+    double next() // xorshift64*, [0,1)
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return double((state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+extern thread_local RandomStream random_stream;
+
 /**
  * Return a random double in the interval [0,1)
  */
 inline double random_double()
 {
+    if (random_stream.seeded)
+        return random_stream.next();
     return rand() / (RAND_MAX + 1.0);
 }
 
@@ -43,10 +67,12 @@ public:
     double min, max;
     Interval();
     Interval(double min, double max);
+    Interval(const Interval &a, const Interval &b); // tightest interval enclosing both
     double size() const;
     bool contains(double x) const;
     bool surrounds(double x) const;
     double clamp(double x) const;
+    Interval expand(double delta) const;
 
     static const Interval empty, universe;
 };
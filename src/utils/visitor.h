@@ -6,12 +6,14 @@
 class Sphere3d;
 class Vector3d;
 class IHittable;
+class CompiledSpheres;
 
 class IVisitor
 {
 public:
     virtual void visit(IHittable *object) = 0;
     virtual void visit(Sphere3d *sphere) = 0;
+    virtual void visit(CompiledSpheres *spheres) = 0;
     virtual void visit(Vector3d *vector) = 0;
     virtual void visit(class IMaterial *material) = 0;
     virtual void visit(class Lambertian *material) = 0;
@@ -0,0 +1,143 @@
+#include "world_mirror.h"
+#include "raytracer/sphere3d.h"
+#include "raytracer/compiled_spheres.h"
+
+// the copy of the last update with source's state, or a new one when there was none of the same type
+template <typename T, typename Base>
+static shared_ptr<T> refreshed(const T &source, const shared_ptr<Base> &last)
+{
+    shared_ptr<T> copy = std::dynamic_pointer_cast<T>(last);
+    if (copy)
+    {
+        *copy = source;
+    }
+    else
+    {
+        copy = std::make_shared<T>(source);
+    }
+    return copy;
+}
+
+WorldMirror::WorldMirror() : object_visited(nullptr), material_visited(nullptr) {}
+
+void WorldMirror::update(const World &source, const std::map<std::string, shared_ptr<IMaterial>> &source_materials,
+                         World &target, std::map<std::string, shared_ptr<IMaterial>> &target_materials)
+{
+    updated_objects.clear();
+    updated_materials.clear();
+
+    std::map<std::string, shared_ptr<IHittable>> copies;
+    for (const auto &pair : source.objects)
+    {
+        copies.insert({pair.first, copy(pair.second)});
+    }
+    if (copies != target.objects)
+    {
+        target.clear();
+        target.objects.swap(copies);
+    }
+    // source's tree is up to date, so the render thread doesn't build or refit one
+    target.copyBvh(source, [this](const IHittable *object)
+                   { return updated_objects.at(object); });
+
+    target_materials.clear();
+    for (const auto &pair : source_materials)
+    {
+        target_materials.insert({pair.first, copy(pair.second)});
+    }
+
+    // copies of objects and materials that are gone are dropped
+    objects.swap(updated_objects);
+    materials.swap(updated_materials);
+    updated_objects.clear();
+    updated_materials.clear();
+}
+
+shared_ptr<IHittable> WorldMirror::copy(const shared_ptr<IHittable> &object)
+{
+    auto found = updated_objects.find(object.get());
+    if (found != updated_objects.end())
+    {
+        return found->second;
+    }
+
+    object_visited = &object;
+    object->accept(this);
+    updated_objects[object.get()] = object_copy;
+    return object_copy;
+}
+
+shared_ptr<IMaterial> WorldMirror::copy(const shared_ptr<IMaterial> &material)
+{
+    if (!material)
+    {
+        return material;
+    }
+    auto found = updated_materials.find(material.get());
+    if (found != updated_materials.end())
+    {
+        return found->second;
+    }
+
+    material_visited = &material;
+    material->accept(this);
+    updated_materials[material.get()] = material_copy;
+    return material_copy;
+}
+
+shared_ptr<IHittable> WorldMirror::last_copy(const IHittable *object) const
+{
+    auto found = objects.find(object);
+    return (found != objects.end()) ? found->second : nullptr;
+}
+
+shared_ptr<IMaterial> WorldMirror::last_copy(const IMaterial *material) const
+{
+    auto found = materials.find(material);
+    return (found != materials.end()) ? found->second : nullptr;
+}
+
+void WorldMirror::visit(IHittable *object)
+{
+    object_copy = *object_visited;
+}
+
+void WorldMirror::visit(Sphere3d *sphere)
+{
+    shared_ptr<Sphere3d> sphere_copy = refreshed(*sphere, last_copy(sphere));
+    sphere_copy->material = copy(sphere->material);
+    object_copy = sphere_copy;
+}
+
+void WorldMirror::visit(CompiledSpheres *spheres)
+{
+    shared_ptr<CompiledSpheres> spheres_copy = refreshed(*spheres, last_copy(spheres));
+    spheres_copy->material = copy(spheres->material);
+    for (shared_ptr<IMaterial> &material : spheres_copy->materials)
+    {
+        material = copy(material);
+    }
+    object_copy = spheres_copy;
+}
+
+void WorldMirror::visit(Vector3d *vector) {}
+
+void WorldMirror::visit(IMaterial *material)
+{
+    material_copy = *material_visited;
+}
+
+void WorldMirror::visit(Lambertian *material)
+{
+    material_copy = refreshed(*material, last_copy(material));
+}
+
+void WorldMirror::visit(Metal *material)
+{
+    material_copy = refreshed(*material, last_copy(material));
+}
+
+void WorldMirror::visit(Dielectric *material)
+{
+    material_copy = refreshed(*material, last_copy(material));
+}
@@ -0,0 +1,48 @@
+#ifndef WORLD_MIRROR_H
+#define WORLD_MIRROR_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "raytracer/world.h"
+#include "utils/visitor.h"
+
+// keeps a second world that renders on another thread while the first one is edited. update() copies every object
+// and material into its own copy, the same copy every time as long as the original is around, so primary hits cached
+// by the last render stay valid. Objects it can't copy, such as streamed spheres, are shared, they aren't editable
+class WorldMirror : public IVisitor
+{
+public:
+    WorldMirror();
+
+    // makes target and target_materials a copy of source and source_materials, with a copy of source's BVH.
+    // Call source.updateBvh() first. Neither may be in use meanwhile
+    void update(const World &source, const std::map<std::string, shared_ptr<IMaterial>> &source_materials,
+                World &target, std::map<std::string, shared_ptr<IMaterial>> &target_materials);
+
+    void visit(IHittable *object) override;
+    void visit(Sphere3d *sphere) override;
+    void visit(CompiledSpheres *spheres) override;
+    void visit(Vector3d *vector) override;
+    void visit(IMaterial *material) override;
+    void visit(Lambertian *material) override;
+    void visit(Metal *material) override;
+    void visit(Dielectric *material) override;
+
+private:
+    // copies of the last update, and those already brought up to date in this one
+    std::unordered_map<const IHittable *, shared_ptr<IHittable>> objects, updated_objects;
+    std::unordered_map<const IMaterial *, shared_ptr<IMaterial>> materials, updated_materials;
+    const shared_ptr<IHittable> *object_visited;
+    const shared_ptr<IMaterial> *material_visited;
+    shared_ptr<IHittable> object_copy;
+    shared_ptr<IMaterial> material_copy;
+
+    shared_ptr<IHittable> copy(const shared_ptr<IHittable> &object);
+    shared_ptr<IMaterial> copy(const shared_ptr<IMaterial> &material);
+    shared_ptr<IHittable> last_copy(const IHittable *object) const;
+    shared_ptr<IMaterial> last_copy(const IMaterial *material) const;
+};
+
+#endif